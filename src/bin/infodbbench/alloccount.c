@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include "alloccount.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <string.h>
+#include <threads.h>
+
+/* Counts heap allocations per thread by interposing the allocator
+ * functions and forwarding to the next definition. dlsym() may allocate
+ * itself while resolving, that is served from a static buffer. */
+
+static thread_local size_t count;
+
+static void *(*realMalloc)(size_t);
+static void *(*realCalloc)(size_t, size_t);
+static void *(*realRealloc)(void *, size_t);
+static void (*realFree)(void *);
+
+static _Alignas(16) unsigned char bootstrap[8192];
+static size_t bootstrapUsed;
+static int resolving;
+
+static void *bootalloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (size > sizeof bootstrap - bootstrapUsed) return 0;
+    void *ptr = bootstrap + bootstrapUsed;
+    bootstrapUsed += size;
+    return ptr;
+}
+
+static int isboot(const void *ptr)
+{
+    return (const unsigned char *)ptr >= bootstrap
+	&& (const unsigned char *)ptr < bootstrap + sizeof bootstrap;
+}
+
+static void resolve(void)
+{
+    resolving = 1;
+    *(void **)&realMalloc = dlsym(RTLD_NEXT, "malloc");
+    *(void **)&realCalloc = dlsym(RTLD_NEXT, "calloc");
+    *(void **)&realRealloc = dlsym(RTLD_NEXT, "realloc");
+    *(void **)&realFree = dlsym(RTLD_NEXT, "free");
+    resolving = 0;
+}
+
+void *malloc(size_t size)
+{
+    if (!realMalloc)
+    {
+	if (resolving) return bootalloc(size);
+	resolve();
+    }
+    ++count;
+    return realMalloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (!realCalloc)
+    {
+	if (resolving)
+	{
+	    if (size && nmemb > SIZE_MAX / size) return 0;
+	    return bootalloc(nmemb * size);
+	}
+	resolve();
+    }
+    ++count;
+    return realCalloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!realRealloc) resolve();
+    ++count;
+    if (ptr && isboot(ptr))
+    {
+	void *moved = realMalloc(size);
+	if (moved)
+	{
+	    size_t avail = bootstrap + sizeof bootstrap
+		- (const unsigned char *)ptr;
+	    memcpy(moved, ptr, avail < size ? avail : size);
+	}
+	return moved;
+    }
+    return realRealloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (!ptr || isboot(ptr)) return;
+    if (!realFree) resolve();
+    realFree(ptr);
+}
+
+size_t AllocCount_get(void)
+{
+    return count;
+}
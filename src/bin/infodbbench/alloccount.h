@@ -0,0 +1,8 @@
+#ifndef INFODBBENCH_ALLOCCOUNT_H
+#define INFODBBENCH_ALLOCCOUNT_H
+
+#include <stddef.h>
+
+size_t AllocCount_get(void);
+
+#endif
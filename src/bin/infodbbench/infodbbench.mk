@@ -0,0 +1,6 @@
+infodbbench_MODULES:= main alloccount ../wumsbot/arena ../wumsbot/dbimage \
+	../wumsbot/infodb ../wumsbot/keyfilter ../wumsbot/keyindex \
+	../wumsbot/rowcache ../wumsbot/stats ../wumsbot/store
+infodbbench_LDFLAGS:= -pthread
+infodbbench_PKGDEPS:= ircbot >= 1.0
+$(call binrules, infodbbench)
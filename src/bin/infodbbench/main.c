@@ -0,0 +1,393 @@
+#include "../wumsbot/infodb.h"
+#include "alloccount.h"
+
+#include <ircbot/list.h>
+#include <ircbot/log.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEYFMT "bench key %u"
+#define CHURNFMT "churn key %u %lu"
+#define MAXSAMPLES (1U << 20)
+
+typedef enum Workload
+{
+    WL_GET,
+    WL_VIEW,
+    WL_RANDOM,
+    WL_ADD,
+    WL_PUTDEL,
+    WL_MIX,
+    WL_COUNT
+} Workload;
+
+static const char *workloadNames[] = {
+    "get", "view", "random", "add", "putdel", "mix"
+};
+
+typedef struct Worker
+{
+    pthread_t thread;
+    uint32_t rnd;
+    unsigned id;
+    Workload workload;
+    unsigned long ops;
+    unsigned long allocs;
+    uint32_t *samples;
+    size_t nsamples;
+} Worker;
+
+typedef struct Result
+{
+    double opsPerSec;
+    double p50;
+    double p99;
+    double allocsPerOp;
+} Result;
+
+static unsigned nkeys = 10000;
+static unsigned nentries = 3;
+static unsigned maxthreads = 8;
+static unsigned seconds = 2;
+static unsigned syncAfter = 16;
+static size_t cachesize = 0;
+static int workloads[WL_COUNT];
+static unsigned long *churned;
+static InfoDb *db;
+static atomic_int running;
+
+static uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static uint64_t nsecs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+static void viewkey(const char *key)
+{
+    InfoDbEntryView entry;
+    InfoDbRowView *view = InfoDb_view(db, key);
+    if (!view) return;
+    for (int ok = InfoDbRowView_first(view, &entry); ok;
+	    ok = InfoDbRowView_next(view, &entry));
+    InfoDbRowView_destroy(view);
+}
+
+/* performs one operation, returns 0 when there is nothing left to do */
+static int operation(Worker *w)
+{
+    char key[64];
+    InfoDbRow *row;
+    InfoDbEntry *entry;
+    unsigned r;
+
+    switch (w->workload)
+    {
+	case WL_GET:
+	    snprintf(key, sizeof key, KEYFMT, xorshift(&w->rnd) % nkeys);
+	    InfoDbRow_destroy(InfoDb_get(db, key));
+	    break;
+
+	case WL_VIEW:
+	    snprintf(key, sizeof key, KEYFMT, xorshift(&w->rnd) % nkeys);
+	    viewkey(key);
+	    break;
+
+	case WL_RANDOM:
+	    InfoDbRow_destroy(InfoDb_getRandom(db));
+	    break;
+
+	case WL_ADD:
+	    snprintf(key, sizeof key, CHURNFMT, w->id, churned[w->id]++);
+	    entry = InfoDbEntry_create("benchmark churn fact", "infodbbench");
+	    InfoDb_add(db, key, entry);
+	    InfoDbEntry_destroy(entry);
+	    break;
+
+	case WL_PUTDEL:
+	    if (!churned[w->id]) return 0;
+	    snprintf(key, sizeof key, CHURNFMT, w->id, --churned[w->id]);
+	    if ((row = InfoDb_get(db, key)))
+	    {
+		IBList_clear(InfoDbRow_entries(row));
+		InfoDb_put(db, row);
+		InfoDbRow_destroy(row);
+	    }
+	    break;
+
+	case WL_MIX:
+	    /* 90% lookups, 5% random lookups, 5% learn and forget */
+	    r = xorshift(&w->rnd) % 100;
+	    if (r < 90)
+	    {
+		snprintf(key, sizeof key, KEYFMT, xorshift(&w->rnd) % nkeys);
+		viewkey(key);
+	    }
+	    else if (r < 95)
+	    {
+		InfoDbRowView_destroy(InfoDb_viewRandom(db));
+	    }
+	    else
+	    {
+		snprintf(key, sizeof key, KEYFMT, xorshift(&w->rnd) % nkeys);
+		entry = InfoDbEntry_create("benchmark mix fact", "infodbbench");
+		InfoDb_add(db, key, entry);
+		InfoDb_remove(db, key, "benchmark mix fact");
+		InfoDbEntry_destroy(entry);
+	    }
+	    break;
+
+	default:
+	    return 0;
+    }
+    return 1;
+}
+
+static void *worker(void *arg)
+{
+    Worker *w = arg;
+    while (atomic_load_explicit(&running, memory_order_relaxed))
+    {
+	size_t allocs = AllocCount_get();
+	uint64_t start = nsecs();
+	if (!operation(w)) break;
+	uint64_t ns = nsecs() - start;
+	w->allocs += AllocCount_get() - allocs;
+	if (ns > UINT32_MAX) ns = UINT32_MAX;
+
+	/* reservoir sampling keeps the latency samples unbiased */
+	if (w->nsamples < MAXSAMPLES) w->samples[w->nsamples++] = (uint32_t)ns;
+	else
+	{
+	    unsigned long pick = ((unsigned long)xorshift(&w->rnd) << 16
+		    ^ xorshift(&w->rnd)) % (w->ops + 1);
+	    if (pick < MAXSAMPLES) w->samples[pick] = (uint32_t)ns;
+	}
+	++w->ops;
+    }
+    return 0;
+}
+
+static int cmpsample(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static Result run(unsigned nthreads, Workload workload)
+{
+    Result result = { 0, 0, 0, 0 };
+    Worker *workers = calloc(nthreads, sizeof *workers);
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+	workers[i].rnd = 2463534242U + i * 7919U;
+	workers[i].id = i;
+	workers[i].workload = workload;
+	workers[i].samples = malloc(MAXSAMPLES * sizeof *workers[i].samples);
+    }
+    atomic_store(&running, 1);
+    uint64_t start = nsecs();
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+	pthread_create(&workers[i].thread, 0, worker, workers+i);
+    }
+    if (workload != WL_PUTDEL)
+    {
+	sleep(seconds);
+	atomic_store(&running, 0);
+    }
+    unsigned long ops = 0;
+    unsigned long allocs = 0;
+    size_t nsamples = 0;
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+	pthread_join(workers[i].thread, 0);
+	ops += workers[i].ops;
+	allocs += workers[i].allocs;
+	nsamples += workers[i].nsamples;
+    }
+    double secs = (double)(nsecs() - start) / 1e9;
+    atomic_store(&running, 0);
+
+    if (nsamples)
+    {
+	uint32_t *samples = malloc(nsamples * sizeof *samples);
+	size_t pos = 0;
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+	    memcpy(samples + pos, workers[i].samples,
+		    workers[i].nsamples * sizeof *samples);
+	    pos += workers[i].nsamples;
+	}
+	qsort(samples, nsamples, sizeof *samples, cmpsample);
+	result.p50 = samples[nsamples / 2] / 1e3;
+	result.p99 = samples[nsamples * 99 / 100] / 1e3;
+	free(samples);
+    }
+    if (ops)
+    {
+	result.opsPerSec = (double)ops / secs;
+	result.allocsPerOp = (double)allocs / (double)ops;
+    }
+    for (unsigned i = 0; i < nthreads; ++i) free(workers[i].samples);
+    free(workers);
+    return result;
+}
+
+static int populate(void)
+{
+    char key[32];
+    char desc[64];
+    snprintf(key, sizeof key, KEYFMT, nkeys - 1);
+    InfoDbRow *row = InfoDb_get(db, key);
+    if (row)
+    {
+	InfoDbRow_destroy(row);
+	return 0;
+    }
+    fprintf(stderr, "populating %u keys with %u entries each ...\n",
+	    nkeys, nentries);
+    InfoDb_setSyncPolicy(db, 4096, 0);
+    for (unsigned i = 0; i < nkeys; ++i)
+    {
+	snprintf(key, sizeof key, KEYFMT, i);
+	for (unsigned j = 0; j < nentries; ++j)
+	{
+	    snprintf(desc, sizeof desc, "benchmark fact number %u for key %u",
+		    j, i);
+	    InfoDbEntry *entry = InfoDbEntry_create(desc, "infodbbench");
+	    int rc = InfoDb_add(db, key, entry);
+	    InfoDbEntry_destroy(entry);
+	    if (rc < 0) return -1;
+	}
+    }
+    InfoDb_setSyncPolicy(db, 0, 0);
+    return InfoDb_sync(db);
+}
+
+static int selectWorkloads(char *list)
+{
+    for (char *name = strtok(list, ","); name; name = strtok(0, ","))
+    {
+	int found = 0;
+	for (int i = 0; i < WL_COUNT; ++i)
+	{
+	    if (!strcmp(name, workloadNames[i])) workloads[i] = found = 1;
+	}
+	if (!found) return -1;
+    }
+    /* deletes work on the rows created by adds */
+    if (workloads[WL_PUTDEL]) workloads[WL_ADD] = 1;
+    return 0;
+}
+
+static void usage(const char *prg)
+{
+    fprintf(stderr, "usage: %s [-k keys] [-e entries] [-t maxthreads] "
+	    "[-s seconds] [-c cachesize] [-p syncafter]\n"
+	    "\t[-w get,view,random,add,putdel,mix] [-S btree|mmap|mem] "
+	    "dbfile\n", prg);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int selected = 0;
+    StoreType store = STORE_BTREE;
+    while ((opt = getopt(argc, argv, "k:e:t:s:c:p:w:S:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'k': nkeys = (unsigned)atoi(optarg); break;
+	    case 'e': nentries = (unsigned)atoi(optarg); break;
+	    case 't': maxthreads = (unsigned)atoi(optarg); break;
+	    case 's': seconds = (unsigned)atoi(optarg); break;
+	    case 'c': cachesize = (size_t)atol(optarg); break;
+	    case 'p': syncAfter = (unsigned)atoi(optarg); break;
+	    case 'w':
+		if (selectWorkloads(optarg) < 0)
+		{
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		selected = 1;
+		break;
+	    case 'S':
+		if (Store_parseType(optarg, &store) < 0)
+		{
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    default: usage(argv[0]); return EXIT_FAILURE;
+	}
+    }
+    if (optind != argc - 1 || !nkeys || !nentries || !maxthreads || !seconds)
+    {
+	usage(argv[0]);
+	return EXIT_FAILURE;
+    }
+    if (!selected) for (int i = 0; i < WL_COUNT; ++i) workloads[i] = 1;
+
+    IBLog_setFileLogger(stderr);
+    if (!(db = InfoDb_createStore(argv[optind], store))) return EXIT_FAILURE;
+    if (populate() < 0)
+    {
+	fputs("error populating database\n", stderr);
+	InfoDb_destroy(db);
+	return EXIT_FAILURE;
+    }
+    InfoDb_setCacheSize(db, cachesize);
+    InfoDb_setSyncPolicy(db, syncAfter, 0);
+    churned = calloc(maxthreads, sizeof *churned);
+
+    printf("%-8s %8s %12s %8s %10s %10s %10s\n", "workload", "threads",
+	    "ops/s", "scale", "p50(us)", "p99(us)", "allocs/op");
+    for (int i = 0; i < WL_COUNT; ++i)
+    {
+	if (!workloads[i] || i == WL_PUTDEL) continue;
+	double base = 0;
+	for (unsigned n = 1; n <= maxthreads; n *= 2)
+	{
+	    Result r = run(n, (Workload)i);
+	    if (n == 1) base = r.opsPerSec;
+	    printf("%-8s %8u %12.0f %8.2f %10.2f %10.2f %10.2f\n",
+		    workloadNames[i], n, r.opsPerSec,
+		    base ? r.opsPerSec / base : 0, r.p50, r.p99,
+		    r.allocsPerOp);
+	    if (i == WL_ADD)
+	    {
+		/* remove the rows just added, so the next round starts
+		 * from the same state */
+		Result d = run(n, WL_PUTDEL);
+		if (workloads[WL_PUTDEL])
+		{
+		    printf("%-8s %8u %12.0f %8s %10.2f %10.2f %10.2f\n",
+			    workloadNames[WL_PUTDEL], n, d.opsPerSec, "",
+			    d.p50, d.p99, d.allocsPerOp);
+		}
+	    }
+	}
+    }
+
+    free(churned);
+    InfoDb_destroy(db);
+    return EXIT_SUCCESS;
+}
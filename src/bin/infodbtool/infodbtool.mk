@@ -0,0 +1,6 @@
+infodbtool_MODULES:= main ../wumsbot/arena ../wumsbot/dbimage ../wumsbot/infodb \
+	../wumsbot/keyfilter ../wumsbot/keyindex ../wumsbot/rowcache \
+	../wumsbot/stats ../wumsbot/store
+infodbtool_LDFLAGS:= -pthread
+infodbtool_PKGDEPS:= ircbot >= 1.0
+$(call binrules, infodbtool)
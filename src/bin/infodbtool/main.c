@@ -0,0 +1,538 @@
+#include "../wumsbot/infodb.h"
+
+#include <ircbot/list.h>
+#include <ircbot/log.h>
+#include <ircbot/util.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IOBUFSZ (1U << 20)
+#define BATCHROWS 4096
+
+/* Lines hold one entry each: key, time, author and description separated
+ * by tabs. Backslashes, tabs and line breaks are escaped. */
+
+typedef struct KeyMapEntry
+{
+    char *key;
+    InfoDbRow *row;
+} KeyMapEntry;
+
+/* maps lowercased keys to rows, open addressing with linear probing */
+typedef struct KeyMap
+{
+    KeyMapEntry *entries;
+    size_t used;
+    size_t mask;
+} KeyMap;
+
+static uint64_t nsecs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+static uint32_t hashstr(const char *key)
+{
+    uint32_t h = 2166136261U;
+    while (*key)
+    {
+	h ^= (unsigned char)*key++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static void KeyMap_init(KeyMap *self)
+{
+    self->mask = 255;
+    self->used = 0;
+    self->entries = IB_xmalloc((self->mask + 1) * sizeof *self->entries);
+    memset(self->entries, 0, (self->mask + 1) * sizeof *self->entries);
+}
+
+static KeyMapEntry *KeyMap_slot(KeyMap *self, const char *key)
+{
+    size_t pos = hashstr(key) & self->mask;
+    while (self->entries[pos].key && strcmp(self->entries[pos].key, key))
+    {
+	pos = (pos + 1) & self->mask;
+    }
+    return self->entries + pos;
+}
+
+/* returns the entry for key, creating an empty one if needed */
+static KeyMapEntry *KeyMap_get(KeyMap *self, const char *key)
+{
+    if ((self->used + 1) * 2 > self->mask + 1)
+    {
+	KeyMapEntry *old = self->entries;
+	size_t oldsize = self->mask + 1;
+	self->mask = self->mask * 2 + 1;
+	self->entries = IB_xmalloc((self->mask + 1) * sizeof *self->entries);
+	memset(self->entries, 0, (self->mask + 1) * sizeof *self->entries);
+	for (size_t i = 0; i < oldsize; ++i)
+	{
+	    if (old[i].key) *KeyMap_slot(self, old[i].key) = old[i];
+	}
+	free(old);
+    }
+    KeyMapEntry *entry = KeyMap_slot(self, key);
+    if (!entry->key)
+    {
+	entry->key = IB_copystr(key);
+	++self->used;
+    }
+    return entry;
+}
+
+static int KeyMap_contains(KeyMap *self, const char *key)
+{
+    return !!KeyMap_slot(self, key)->key;
+}
+
+static void KeyMap_clear(KeyMap *self)
+{
+    for (size_t i = 0; i <= self->mask; ++i)
+    {
+	free(self->entries[i].key);
+	self->entries[i].key = 0;
+	self->entries[i].row = 0;
+    }
+    self->used = 0;
+}
+
+static void KeyMap_done(KeyMap *self)
+{
+    KeyMap_clear(self);
+    free(self->entries);
+}
+
+static void deleteEntry(void *entry)
+{
+    InfoDbEntry_destroy(entry);
+}
+
+static void lowerstr(char *str)
+{
+    for (; *str; ++str) *str = tolower((unsigned char)*str);
+}
+
+static void writeEscaped(FILE *out, const char *str)
+{
+    for (;;)
+    {
+	size_t len = strcspn(str, "\\\t\n\r");
+	fwrite(str, 1, len, out);
+	str += len;
+	switch (*str++)
+	{
+	    case '\\': fputs("\\\\", out); break;
+	    case '\t': fputs("\\t", out); break;
+	    case '\n': fputs("\\n", out); break;
+	    case '\r': fputs("\\r", out); break;
+	    default: return;
+	}
+    }
+}
+
+/* unescapes a field in place and returns the start of the next one */
+static char *readField(char *field)
+{
+    char *w = field;
+    for (char *r = field; *r; ++r)
+    {
+	if (*r == '\t')
+	{
+	    *w = 0;
+	    return r + 1;
+	}
+	if (*r == '\\' && r[1])
+	{
+	    switch (*++r)
+	    {
+		case 't': *w++ = '\t'; break;
+		case 'n': *w++ = '\n'; break;
+		case 'r': *w++ = '\r'; break;
+		default: *w++ = *r; break;
+	    }
+	}
+	else *w++ = *r;
+    }
+    *w = 0;
+    return 0;
+}
+
+typedef struct Exporter
+{
+    FILE *out;
+    size_t rows;
+    size_t entries;
+} Exporter;
+
+static int exportRow(void *ctx, const InfoDbRowView *row)
+{
+    Exporter *exp = ctx;
+    InfoDbEntryView entry;
+    for (int ok = InfoDbRowView_first(row, &entry); ok;
+	    ok = InfoDbRowView_next(row, &entry))
+    {
+	writeEscaped(exp->out, InfoDbRowView_key(row));
+	fprintf(exp->out, "\t%lld\t", (long long)entry.time);
+	writeEscaped(exp->out, entry.author);
+	fputc('\t', exp->out);
+	writeEscaped(exp->out, entry.description);
+	fputc('\n', exp->out);
+	++exp->entries;
+    }
+    ++exp->rows;
+    return ferror(exp->out) ? -1 : 0;
+}
+
+static int exportDb(InfoDb *db, FILE *out)
+{
+    Exporter exp = { out, 0, 0 };
+    uint64_t start = nsecs();
+    int rc = InfoDb_foreach(db, exportRow, &exp);
+    if (fflush(out) != 0) rc = -1;
+    if (rc != 0)
+    {
+	fputs("export failed\n", stderr);
+	return -1;
+    }
+    double secs = (double)(nsecs() - start) / 1e9;
+    fprintf(stderr, "exported %zu entries in %zu rows in %.2fs\n",
+	    exp.entries, exp.rows, secs);
+    return 0;
+}
+
+typedef struct Importer
+{
+    InfoDb *db;
+    KeyMap batch;
+    KeyMap imported;
+    InfoDbRow **rows;
+    size_t nrows;
+    size_t batchrows;
+    size_t written;
+    size_t entries;
+} Importer;
+
+static int flushBatch(Importer *imp)
+{
+    int rc = InfoDb_putAll(imp->db, (const InfoDbRow *const *)imp->rows,
+	    imp->nrows);
+    for (size_t i = 0; i < imp->nrows; ++i) InfoDbRow_destroy(imp->rows[i]);
+    for (size_t i = 0; i <= imp->batch.mask; ++i)
+    {
+	if (imp->batch.entries[i].key)
+	{
+	    KeyMap_get(&imp->imported, imp->batch.entries[i].key);
+	}
+    }
+    KeyMap_clear(&imp->batch);
+    imp->written += imp->nrows;
+    imp->nrows = 0;
+    return rc;
+}
+
+/* Imported rows replace existing rows with the same key. Entries for one
+ * key don't have to be adjacent, rows already written by an earlier batch
+ * are read back and extended. */
+static int importEntry(Importer *imp, const char *key, time_t time,
+	const char *author, const char *description)
+{
+    char *lower = IB_copystr(key);
+    lowerstr(lower);
+    KeyMapEntry *slot = KeyMap_get(&imp->batch, lower);
+    if (!slot->row)
+    {
+	InfoDbRow *row = 0;
+	if (KeyMap_contains(&imp->imported, lower))
+	{
+	    row = InfoDb_get(imp->db, key);
+	}
+	if (!row) row = InfoDbRow_create(key);
+	slot->row = row;
+	imp->rows[imp->nrows++] = row;
+    }
+    free(lower);
+    IBList_append(InfoDbRow_entries(slot->row),
+	    InfoDbEntry_createAt(description, author, time), deleteEntry);
+    ++imp->entries;
+    return imp->nrows == imp->batchrows ? flushBatch(imp) : 0;
+}
+
+static int importDb(InfoDb *db, FILE *in, size_t batchrows)
+{
+    Importer imp = { .db = db, .batchrows = batchrows };
+    KeyMap_init(&imp.batch);
+    KeyMap_init(&imp.imported);
+    imp.rows = IB_xmalloc(batchrows * sizeof *imp.rows);
+    char *line = 0;
+    size_t linesz = 0;
+    size_t lineno = 0;
+    int rc = 0;
+    uint64_t start = nsecs();
+
+    /* all batches are committed with a single sync at the end */
+    InfoDb_setSyncPolicy(db, UINT_MAX, 0);
+    while (rc == 0 && getline(&line, &linesz, in) >= 0)
+    {
+	++lineno;
+	line[strcspn(line, "\r\n")] = 0;
+	if (!*line) continue;
+	char *key = line;
+	char *timestr = readField(key);
+	char *author = timestr ? readField(timestr) : 0;
+	char *description = author ? readField(author) : 0;
+	if (description) readField(description);
+	char *end = 0;
+	long long time = timestr ? strtoll(timestr, &end, 10) : 0;
+	if (!description || !*key || !*description || *end)
+	{
+	    fprintf(stderr, "line %zu: invalid entry\n", lineno);
+	    rc = -1;
+	    break;
+	}
+	rc = importEntry(&imp, key, (time_t)time, author, description);
+    }
+    free(line);
+    if (rc == 0 && ferror(in)) rc = -1;
+    if (imp.nrows && flushBatch(&imp) < 0) rc = -1;
+    if (InfoDb_sync(db) < 0) rc = -1;
+    InfoDb_setSyncPolicy(db, 0, 0);
+
+    if (rc == 0)
+    {
+	double secs = (double)(nsecs() - start) / 1e9;
+	fprintf(stderr, "imported %zu entries with %zu row writes in %.2fs "
+		"(%.0f entries/s)\n", imp.entries, imp.written, secs,
+		secs > 0 ? (double)imp.entries / secs : 0);
+    }
+    else fputs("import failed\n", stderr);
+    free(imp.rows);
+    KeyMap_done(&imp.batch);
+    KeyMap_done(&imp.imported);
+    return rc;
+}
+
+typedef struct Resharder
+{
+    InfoDb *db;
+    InfoDbRow **rows;
+    size_t nrows;
+    size_t batchrows;
+    size_t copied;
+    size_t entries;
+} Resharder;
+
+static int flushRows(Resharder *res)
+{
+    int rc = InfoDb_putAll(res->db, (const InfoDbRow *const *)res->rows,
+	    res->nrows);
+    for (size_t i = 0; i < res->nrows; ++i) InfoDbRow_destroy(res->rows[i]);
+    res->copied += res->nrows;
+    res->nrows = 0;
+    return rc;
+}
+
+static int reshardRow(void *ctx, const InfoDbRowView *row)
+{
+    Resharder *res = ctx;
+    InfoDbRow *copy = InfoDbRow_create(InfoDbRowView_key(row));
+    InfoDbEntryView entry;
+    for (int ok = InfoDbRowView_first(row, &entry); ok;
+	    ok = InfoDbRowView_next(row, &entry))
+    {
+	IBList_append(InfoDbRow_entries(copy), InfoDbEntry_createAt(
+		    entry.description, entry.author, entry.time), deleteEntry);
+	++res->entries;
+    }
+    res->rows[res->nrows++] = copy;
+    return res->nrows == res->batchrows ? flushRows(res) : 0;
+}
+
+/* Rows are copied to a new set of files, because the shard of a row
+ * depends on the number of shards. */
+static int reshardDb(InfoDb *db, InfoDb *newdb, size_t batchrows)
+{
+    Resharder res = { .db = newdb, .batchrows = batchrows };
+    res.rows = IB_xmalloc(batchrows * sizeof *res.rows);
+    uint64_t start = nsecs();
+
+    InfoDb_setSyncPolicy(newdb, UINT_MAX, 0);
+    int rc = InfoDb_foreach(db, reshardRow, &res) ? -1 : 0;
+    if (res.nrows && flushRows(&res) < 0) rc = -1;
+    if (InfoDb_sync(newdb) < 0) rc = -1;
+    InfoDb_setSyncPolicy(newdb, 0, 0);
+
+    if (rc == 0)
+    {
+	double secs = (double)(nsecs() - start) / 1e9;
+	fprintf(stderr, "copied %zu entries in %zu rows in %.2fs\n",
+		res.entries, res.copied, secs);
+    }
+    else fputs("reshard failed\n", stderr);
+    free(res.rows);
+    return rc;
+}
+
+/* Swaps a database resharded in place in. The old files are only removed
+ * once the new ones are in place. */
+static int replaceDb(const char *dbfile, unsigned shards,
+	const char *tmpname, unsigned newshards)
+{
+    char *oldname = IB_xmalloc(strlen(dbfile) + sizeof ".old");
+    sprintf(oldname, "%s.old", dbfile);
+    int rc = -1;
+    if (InfoDb_rename(dbfile, oldname, shards) < 0)
+    {
+	InfoDb_rename(oldname, dbfile, shards);
+	fprintf(stderr, "cannot replace `%s', the resharded database is "
+		"`%s'\n", dbfile, tmpname);
+	goto done;
+    }
+    if (InfoDb_rename(tmpname, dbfile, newshards) < 0)
+    {
+	fprintf(stderr, "cannot replace `%s', the old database is kept as "
+		"`%s'\n", dbfile, oldname);
+	goto done;
+    }
+    rc = InfoDb_unlink(oldname, shards);
+done:
+    free(oldname);
+    return rc;
+}
+
+static void usage(const char *prg)
+{
+    fprintf(stderr, "usage: %s export [-n shards] dbfile [outfile]\n"
+	    "       %s import [-b batchrows] [-n shards] [-S btree|mmap|mem] "
+	    "dbfile [infile]\n"
+	    "       %s compact [-n shards] dbfile\n"
+	    "       %s reshard [-b batchrows] [-n shards] [-S btree|mmap|mem] "
+	    "dbfile newdbfile newshards\n", prg, prg, prg, prg);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+	usage(argv[0]);
+	return EXIT_FAILURE;
+    }
+    int import = !strcmp(argv[1], "import");
+    int compact = !strcmp(argv[1], "compact");
+    int reshard = !strcmp(argv[1], "reshard");
+    if (!import && !compact && !reshard && strcmp(argv[1], "export"))
+    {
+	usage(argv[0]);
+	return EXIT_FAILURE;
+    }
+    size_t batchrows = BATCHROWS;
+    unsigned shards = 1;
+    StoreType store = STORE_BTREE;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "b:n:S:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'b': batchrows = (size_t)atol(optarg); break;
+	    case 'n': shards = (unsigned)atol(optarg); break;
+	    case 'S':
+		if (Store_parseType(optarg, &store) < 0)
+		{
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    default: usage(argv[0]); return EXIT_FAILURE;
+	}
+    }
+    int nargs = argc - optind;
+    if (nargs < 1 + 2 * reshard || nargs > (reshard ? 3 : 2 - compact)
+	    || !batchrows || !shards)
+    {
+	usage(argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    IBLog_setFileLogger(stderr);
+    if (compact)
+    {
+	InfoDb *db = InfoDb_createSharded(argv[optind], STORE_BTREE, shards);
+	if (!db) return EXIT_FAILURE;
+	int rc = InfoDb_compact(db);
+	InfoDb_destroy(db);
+	return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (reshard)
+    {
+	unsigned newshards = (unsigned)atol(argv[optind+2]);
+	if (!newshards)
+	{
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+	const char *dbfile = argv[optind];
+	const char *newdbfile = argv[optind+1];
+	char *tmpname = 0;
+	if (!strcmp(dbfile, newdbfile))
+	{
+	    tmpname = IB_xmalloc(strlen(dbfile) + sizeof ".reshard");
+	    sprintf(tmpname, "%s.reshard", dbfile);
+	    InfoDb_unlink(tmpname, newshards);
+	    newdbfile = tmpname;
+	}
+	int rc = EXIT_FAILURE;
+	InfoDb *db = InfoDb_createSharded(dbfile, store, shards);
+	InfoDb *newdb = db ? InfoDb_createSharded(newdbfile, store,
+		newshards) : 0;
+	if (newdb && reshardDb(db, newdb, batchrows) == 0) rc = EXIT_SUCCESS;
+	InfoDb_destroy(newdb);
+	InfoDb_destroy(db);
+	if (tmpname)
+	{
+	    if (rc == EXIT_SUCCESS
+		    && replaceDb(dbfile, shards, tmpname, newshards) < 0)
+	    {
+		rc = EXIT_FAILURE;
+	    }
+	    else if (rc != EXIT_SUCCESS) InfoDb_unlink(tmpname, newshards);
+	    free(tmpname);
+	}
+	return rc;
+    }
+
+    const char *filename = argc - optind == 2 ? argv[optind+1] : 0;
+    FILE *file = import ? stdin : stdout;
+    if (filename && strcmp(filename, "-")
+	    && !(file = fopen(filename, import ? "r" : "w")))
+    {
+	perror(filename);
+	return EXIT_FAILURE;
+    }
+    setvbuf(file, 0, _IOFBF, IOBUFSZ);
+
+    int rc = EXIT_FAILURE;
+    InfoDb *db = InfoDb_createSharded(argv[optind], store, shards);
+    if (!db) goto done;
+    if ((import ? importDb(db, file, batchrows) : exportDb(db, file)) == 0)
+    {
+	rc = EXIT_SUCCESS;
+    }
+    InfoDb_destroy(db);
+done:
+    if (file != stdin && file != stdout && fclose(file) != 0) rc = EXIT_FAILURE;
+    return rc;
+}
@@ -0,0 +1,189 @@
+#include "arena.h"
+
+#include <ircbot/util.h>
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFCHUNKSIZE 4096
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk
+{
+    ArenaChunk *next;
+    size_t size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+struct Arena
+{
+    ArenaChunk *chunks;
+    size_t chunksize;
+    size_t used;
+    void *last;
+    char *appended;
+    size_t appendedlen;
+    ArenaStats stats;
+    int active;
+};
+
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadArena;
+
+static size_t align(size_t size)
+{
+    return (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+}
+
+static void newchunk(Arena *self, size_t minsize)
+{
+    size_t size = self->chunksize;
+    if (size < minsize) size = minsize;
+    ArenaChunk *chunk = IB_xmalloc(sizeof *chunk + size);
+    chunk->next = self->chunks;
+    chunk->size = size;
+    self->chunks = chunk;
+    self->used = 0;
+    ++self->stats.heapAllocs;
+}
+
+Arena *Arena_create(size_t chunksize)
+{
+    Arena *self = IB_xmalloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->chunksize = chunksize ? align(chunksize) : DEFCHUNKSIZE;
+    return self;
+}
+
+void *Arena_alloc(Arena *self, size_t size)
+{
+    size = align(size ? size : 1);
+    if (!self->chunks || self->chunks->size - self->used < size)
+    {
+	newchunk(self, size);
+    }
+    void *ptr = self->chunks->data + self->used;
+    self->used += size;
+    self->last = ptr;
+    ++self->stats.allocs;
+    self->stats.bytes += size;
+    return ptr;
+}
+
+void *Arena_grow(Arena *self, void *ptr, size_t oldsize, size_t newsize)
+{
+    if (ptr && ptr == self->last)
+    {
+	size_t oldaligned = align(oldsize ? oldsize : 1);
+	size_t newaligned = align(newsize ? newsize : 1);
+	size_t start = self->used - oldaligned;
+	if (newaligned <= oldaligned
+		|| self->chunks->size - start >= newaligned)
+	{
+	    self->used = start + newaligned;
+	    if (newaligned > oldaligned)
+	    {
+		self->stats.bytes += newaligned - oldaligned;
+	    }
+	    return ptr;
+	}
+    }
+    void *newptr = Arena_alloc(self, newsize);
+    if (ptr) memcpy(newptr, ptr, oldsize < newsize ? oldsize : newsize);
+    return newptr;
+}
+
+char *Arena_copystr(Arena *self, const char *str)
+{
+    size_t size = strlen(str) + 1;
+    return memcpy(Arena_alloc(self, size), str, size);
+}
+
+char *Arena_append(Arena *self, char *str, const char *append)
+{
+    /* remember the length of the last result, so repeated appends to
+     * the same string don't have to scan it again */
+    size_t len = 0;
+    if (str) len = str == self->appended ? self->appendedlen : strlen(str);
+    size_t appendsz = strlen(append) + 1;
+    str = Arena_grow(self, str, len + 1, len + appendsz);
+    memcpy(str + len, append, appendsz);
+    self->appended = str;
+    self->appendedlen = len + appendsz - 1;
+    return str;
+}
+
+void Arena_stats(const Arena *self, ArenaStats *stats)
+{
+    *stats = self->stats;
+}
+
+void Arena_reset(Arena *self)
+{
+    /* keep the most recent chunk for reuse */
+    if (self->chunks)
+    {
+	ArenaChunk *chunk = self->chunks->next;
+	while (chunk)
+	{
+	    ArenaChunk *next = chunk->next;
+	    free(chunk);
+	    chunk = next;
+	}
+	self->chunks->next = 0;
+    }
+    self->used = 0;
+    self->last = 0;
+    self->appended = 0;
+    self->appendedlen = 0;
+    memset(&self->stats, 0, sizeof self->stats);
+}
+
+void Arena_destroy(Arena *self)
+{
+    if (!self) return;
+    Arena_reset(self);
+    free(self->chunks);
+    free(self);
+}
+
+static void destroyThreadArena(void *arena)
+{
+    Arena_destroy(arena);
+}
+
+static void createKey(void)
+{
+    pthread_key_create(&threadArena, destroyThreadArena);
+}
+
+Arena *Arena_begin(void)
+{
+    pthread_once(&keyOnce, createKey);
+    Arena *self = pthread_getspecific(threadArena);
+    if (!self)
+    {
+	self = Arena_create(0);
+	pthread_setspecific(threadArena, self);
+    }
+    self->active = 1;
+    return self;
+}
+
+Arena *Arena_current(void)
+{
+    pthread_once(&keyOnce, createKey);
+    Arena *self = pthread_getspecific(threadArena);
+    return self && self->active ? self : 0;
+}
+
+void Arena_end(Arena *self, ArenaStats *stats)
+{
+    if (stats) *stats = self->stats;
+    self->active = 0;
+    Arena_reset(self);
+}
@@ -0,0 +1,34 @@
+#ifndef WUMSBOT_ARENA_H
+#define WUMSBOT_ARENA_H
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+
+C_CLASS_DECL(Arena);
+
+typedef struct ArenaStats
+{
+    size_t allocs;
+    size_t bytes;
+    size_t heapAllocs;
+} ArenaStats;
+
+Arena *Arena_create(size_t chunksize) ATTR_RETNONNULL;
+void *Arena_alloc(Arena *self, size_t size) CMETHOD ATTR_RETNONNULL;
+void *Arena_grow(Arena *self, void *ptr, size_t oldsize, size_t newsize)
+    CMETHOD ATTR_RETNONNULL;
+char *Arena_copystr(Arena *self, const char *str)
+    CMETHOD ATTR_NONNULL((2)) ATTR_RETNONNULL;
+char *Arena_append(Arena *self, char *str, const char *append)
+    CMETHOD ATTR_NONNULL((3)) ATTR_RETNONNULL;
+void Arena_stats(const Arena *self, ArenaStats *stats)
+    CMETHOD ATTR_NONNULL((2));
+void Arena_reset(Arena *self) CMETHOD;
+void Arena_destroy(Arena *self);
+
+Arena *Arena_begin(void) ATTR_RETNONNULL;
+Arena *Arena_current(void);
+void Arena_end(Arena *self, ArenaStats *stats) CMETHOD;
+
+#endif
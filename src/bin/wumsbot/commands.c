@@ -0,0 +1,658 @@
+#include "commands.h"
+
+#include <ircbot/list.h>
+#include <ircbot/log.h>
+#include <ircbot/util.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "arena.h"
+#include "infodb.h"
+#include "stats.h"
+
+#define SEARCHRESULTS 10
+
+/* Facts of namespaced channels are stored as NSMARK namespace NSMARK key.
+ * The mark never occurs in UTF-8 text, so these keys sort after all the
+ * shared ones. */
+#define NSMARK "\xff"
+#define STATSLINES 5
+
+static const char *beer[] = {
+    "Prost!",
+    "Feierabend?",
+    "Beer is the answer, but I can't remember the question ...",
+    "gmBh heißt, geh mal Bier holen!",
+    "Bierpreisbremse jetzt!",
+    "Mit des Bieres Hochgenuss, wächst des Bauches Radius.",
+    "Bier kalt stellen ist auch irgendwie kochen.",
+    "Wer das Bier nicht ehrt, ist des Deliriums nicht wert!",
+    "The mouth of a perfectly happy man is filled with beer.",
+    "Beer ...a high and mighty liquor.",
+    "Es gibt keine hässlichen Frauen. Es gibt nur zu wenig Bier.",
+    "Im Himmel gibts kein Bier. Drum trinken wir es hier.",
+    "Nur Wasser trinkt der Vierbeiner. Der Mensch, der findet Bier feiner.",
+    "Beer is proof that God loves us and wants us to be happy.",
+    "Beauty is in the eye of the beer holder",
+    "Am Morgen ein Bier und der Tag gehört dir.",
+    "Bier trinken ist besser als Quark reden!",
+    "Durst wird durch Bier erst schön!",
+    "Ein Bier das nicht getrunken wird, hat seinen Beruf verfehlt.",
+    "Zwischen Leber und Milz passt noch immer ein Pils.",
+    "Bier am Morgen vertreibt Kummer und Sorgen!",
+    "Jeder sollte an etwas glauben. Ich glaube ich trinke noch ein Bier.",
+    "Endlich wieder nüchtern. Das muss ich feiern.",
+    "Alkohol löst keine Probleme, aber das tut Milch ja auch nicht.",
+    "Meine mentale Verfassung ist besäufniserregend.",
+    "Wer Asbach trinkt, sieht uralt aus.",
+    "Alcohol, the cause and solution to all of lifes problems."
+};
+
+static InfoDb *infoDb;
+static char *admins;
+static char *adminPass;
+static char *backupFile;
+
+static const struct
+{
+    const char *name;
+    CommandHandler handler;
+} commands[] = {
+    { "bier", Command_bier },
+    { "kaffee", Command_kaffee },
+    { "info", Command_info },
+    { "lerne", Command_lerne },
+    { "lern", Command_lerne },
+    { "learn", Command_lerne },
+    { "vergiss", Command_vergiss },
+    { "forget", Command_vergiss },
+    { "suche", Command_suche },
+    { "search", Command_suche },
+    { "finde", Command_finde },
+    { "find", Command_finde },
+    { "gelehrt", Command_gelehrt },
+    { "taught", Command_gelehrt },
+    { "stats", Command_stats },
+    { "backup", Command_backup },
+    { "compact", Command_compact }
+};
+
+void Commands_init(InfoDb *db)
+{
+    infoDb = db;
+}
+
+void Commands_setAdmins(const char *nicks, const char *password)
+{
+    free(admins);
+    free(adminPass);
+    admins = nicks ? IB_copystr(nicks) : 0;
+    adminPass = password ? IB_copystr(password) : 0;
+}
+
+void Commands_setBackupFile(const char *filename)
+{
+    free(backupFile);
+    backupFile = filename ? IB_copystr(filename) : 0;
+}
+
+CommandHandler Commands_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof commands / sizeof *commands; ++i)
+    {
+	if (!strcmp(commands[i].name, name)) return commands[i].handler;
+    }
+    return 0;
+}
+
+static void endCommand(StatsTimer timer, Arena *arena, uint64_t start)
+{
+    ArenaStats stats;
+    Arena_end(arena, &stats);
+    Stats_record(timer, start);
+    IBLog_fmt(L_DEBUG, "%s: %zu arena allocations (%zu bytes), "
+	    "%zu heap allocations", Stats_name(timer), stats.allocs,
+	    stats.bytes, stats.heapAllocs);
+}
+
+/* compares in constant time, so answer times don't leak the password */
+static int checkPass(const char *arg)
+{
+    if (!arg) return 0;
+    arg += strspn(arg, " \t");
+    size_t len = strcspn(arg, " \t");
+    size_t passlen = strlen(adminPass);
+    unsigned char diff = len != passlen;
+    for (size_t i = 0; i < passlen; ++i)
+    {
+	diff |= (unsigned char)adminPass[i]
+	    ^ (unsigned char)arg[i < len ? i : 0];
+    }
+    return !diff;
+}
+
+/* Anyone can take a nick, so admins must also give the admin password
+ * as the argument of the command. */
+static int isAdmin(const CommandEvent *event)
+{
+    if (!event->from || !admins || !adminPass) return 0;
+    size_t len = strlen(event->from);
+    for (const char *admin = admins + strspn(admins, " \t"); *admin;
+	    admin += strspn(admin, " \t"))
+    {
+	size_t adminlen = strcspn(admin, " \t");
+	if (adminlen == len && !strncasecmp(admin, event->from, len))
+	{
+	    return checkPass(event->arg);
+	}
+	admin += adminlen;
+    }
+    return 0;
+}
+
+static char *nextToken(char **str)
+{
+    char *token = *str + strspn(*str, " \t");
+    if (!*token) return 0;
+    size_t len = strcspn(token, " \t");
+    *str = token[len] ? token + len + 1 : token + len;
+    token[len] = 0;
+    return token;
+}
+
+void Command_bier(const CommandEvent *event)
+{
+    if (!event->hasNick) return;
+
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    char *beerfor = arg ? Arena_copystr(arena, arg) : 0;
+    const char *nick = beerfor ? nextToken(&beerfor) : 0;
+    if (nick)
+    {
+	char buf[256];
+	do
+	{
+	    if (event->hasNick(event->ctx, nick))
+	    {
+		snprintf(buf, 256, "wird %s mit Bier abfüllen!", nick);
+		event->respond(event->ctx, buf, 1);
+	    }
+	} while ((nick = nextToken(&beerfor)));
+    }
+    else
+    {
+	event->respond(event->ctx,
+		beer[rand() % (sizeof beer / sizeof *beer)], 0);
+    }
+    endCommand(ST_BIER, arena, start);
+}
+
+void Command_kaffee(const CommandEvent *event)
+{
+    if (!event->hasNick) return;
+
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    const char *from = event->from;
+    char *coffeefor = 0;
+    const char *nick = 0;
+    if (arg)
+    {
+	coffeefor = Arena_copystr(arena, arg);
+	nick = nextToken(&coffeefor);
+    }
+    if (!nick && from)
+    {
+	coffeefor = Arena_copystr(arena, from);
+	nick = nextToken(&coffeefor);
+    }
+    if (nick)
+    {
+	char buf[256];
+	do
+	{
+	    if (event->hasNick(event->ctx, nick))
+	    {
+		snprintf(buf, 256, "reicht %s eine Tasse Kaffee...", nick);
+		event->respond(event->ctx, buf, 1);
+	    }
+	} while ((nick = nextToken(&coffeefor)));
+    }
+    endCommand(ST_KAFFEE, arena, start);
+}
+
+/* maps a key given in a channel to the key in the database */
+static char *dbKey(const CommandEvent *event, Arena *arena, char *key)
+{
+    if (!key || strchr(key, *NSMARK)) return 0;
+    if (!event->ns) return key;
+    char *nskey = Arena_append(arena, 0, NSMARK);
+    nskey = Arena_append(arena, nskey, event->ns);
+    nskey = Arena_append(arena, nskey, NSMARK);
+    return Arena_append(arena, nskey, key);
+}
+
+/* returns a key as shown in the channel, 0 if it belongs elsewhere */
+static const char *channelKey(const CommandEvent *event, const char *key)
+{
+    if (*key != *NSMARK) return event->ns ? 0 : key;
+    if (!event->ns) return 0;
+    size_t nslen = strlen(event->ns);
+    if (strncasecmp(key + 1, event->ns, nslen)
+	    || key[nslen + 1] != *NSMARK) return 0;
+    return key + nslen + 2;
+}
+
+/* the range [from, to) of database keys visible in the channel */
+static void channelRange(const CommandEvent *event, Arena *arena,
+	const char **from, const char **to)
+{
+    if (!event->ns)
+    {
+	*from = 0;
+	*to = NSMARK;
+	return;
+    }
+    char *start = dbKey(event, arena, "");
+    *from = start;
+    *to = Arena_append(arena, Arena_copystr(arena, start), NSMARK);
+}
+
+static InfoDbRowView *randomRow(const CommandEvent *event, Arena *arena)
+{
+    const char *from;
+    const char *to;
+    channelRange(event, arena, &from, &to);
+    return InfoDb_viewRandomRange(infoDb, from, to);
+}
+
+static char *normalizeWs(Arena *arena, const char *input, size_t len)
+{
+    if (!len) len = strlen(input);
+    char *output = Arena_alloc(arena, len+1);
+    const char *r = input;
+    char *w = output;
+    while (isspace(*r)) { ++r; --len; }
+    while (len)
+    {
+	if (isspace(*r))
+	{
+	    *w++ = ' ';
+	    while (isspace(*r)) { ++r; --len; }
+	}
+	else
+	{
+	    *w++ = *r++;
+	    --len;
+	}
+    }
+    if (w != output && w[-1] == ' ') --w;
+    *w = 0;
+    return w == output ? 0 : output;
+}
+
+void Command_info(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    char *key = 0;
+    InfoDbRowView *row = 0;
+    if (arg && (key = normalizeWs(arena, arg, 0)))
+    {
+	if ((key = dbKey(event, arena, key))) row = InfoDb_view(infoDb, key);
+    }
+    else
+    {
+	row = randomRow(event, arena);
+    }
+    if (row)
+    {
+	char date[11];
+	struct tm tm;
+	InfoDbEntryView entry;
+	const char *rowkey = channelKey(event, InfoDbRowView_key(row));
+	char *msg = Arena_append(arena, 0,
+		rowkey ? rowkey : InfoDbRowView_key(row));
+	msg = Arena_append(arena, msg, " = ");
+	int first = 1;
+	for (int ok = InfoDbRowView_first(row, &entry); ok;
+		ok = InfoDbRowView_next(row, &entry))
+	{
+	    if (!first) msg = Arena_append(arena, msg, " | ");
+	    else first = 0;
+	    msg = Arena_append(arena, msg, entry.description);
+	    msg = Arena_append(arena, msg, " [");
+	    msg = Arena_append(arena, msg, entry.author);
+	    msg = Arena_append(arena, msg, ", ");
+	    gmtime_r(&entry.time, &tm);
+	    strftime(date, 11, "%d.%m.%Y", &tm);
+	    msg = Arena_append(arena, msg, date);
+	    msg = Arena_append(arena, msg, "]");
+	}
+	InfoDbRowView_destroy(row);
+	event->respond(event->ctx, msg, 0);
+    }
+    else
+    {
+	event->respond(event->ctx, "hat keine Ahnung...", 1);
+    }
+    endCommand(ST_INFO, arena, start);
+}
+
+/* Changes are applied by the InfoDb writer thread. The handler returns
+ * right away, the completion callback sends the reply on its own. */
+typedef struct WriteReply
+{
+    void *target;
+    CommandSendReply send;
+    const char *unchanged;	/* reply if nothing was changed */
+    char ok[];
+} WriteReply;
+
+static WriteReply *writeReply(const CommandEvent *event, const char *ok,
+	const char *unchanged)
+{
+    size_t oklen = strlen(ok);
+    WriteReply *reply = IB_xmalloc(sizeof *reply + oklen + 1);
+    reply->target = event->replyTarget(event->ctx);
+    reply->send = event->sendReply;
+    reply->unchanged = unchanged;
+    memcpy(reply->ok, ok, oklen + 1);
+    return reply;
+}
+
+static void writeDone(void *ctx, int rc)
+{
+    WriteReply *reply = ctx;
+    if (rc < 0)
+    {
+	reply->send(reply->target, "hat ein Datenbankproblem :o", 1);
+    }
+    else if (rc == 0 && reply->unchanged)
+    {
+	reply->send(reply->target, reply->unchanged, 1);
+    }
+    else
+    {
+	reply->send(reply->target, reply->ok, 0);
+    }
+    free(reply);
+}
+
+void Command_lerne(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    size_t eqpos;
+    if (!arg || !arg[(eqpos = strcspn(arg, "="))]) goto invalid;
+    char *key = normalizeWs(arena, arg, eqpos);
+    char *val = normalizeWs(arena, arg+eqpos+1, 0);
+    char *storedkey = dbKey(event, arena, key);
+    if (!storedkey || !val) goto invalid;
+    const char *author = event->from;
+    if (!author) author = "<anonymous>";
+    char *msg = Arena_append(arena, 0, "Ok, ");
+    msg = Arena_append(arena, msg, key);
+    msg = Arena_append(arena, msg, " = ");
+    msg = Arena_append(arena, msg, val);
+    InfoDbEntry *entry = InfoDbEntry_create(val, author);
+    InfoDb_addAsync(infoDb, storedkey, entry, writeDone,
+	    writeReply(event, msg, 0));
+    InfoDbEntry_destroy(entry);
+    endCommand(ST_LERNE, arena, start);
+    return;
+
+invalid:
+    event->respond(event->ctx, "hat nicht verstanden (?)", 1);
+    endCommand(ST_LERNE, arena, start);
+}
+
+void Command_vergiss(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    size_t eqpos;
+    if (!arg || !arg[(eqpos = strcspn(arg, "="))]) goto invalid;
+    char *key = dbKey(event, arena, normalizeWs(arena, arg, eqpos));
+    char *val = normalizeWs(arena, arg+eqpos+1, 0);
+    if (!key || !val) goto invalid;
+    InfoDb_removeAsync(infoDb, key, val, writeDone, writeReply(event,
+		"Ok, vergessen!", "wusste davon nichts..."));
+    endCommand(ST_VERGISS, arena, start);
+    return;
+
+invalid:
+    event->respond(event->ctx, "hat nicht verstanden (?)", 1);
+    endCommand(ST_VERGISS, arena, start);
+}
+
+/* lists keys found in the channel's range as shown in the channel */
+static void listKeys(const CommandEvent *event, Arena *arena, IBList *keys)
+{
+    char *msg = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < IBList_size(keys); ++i)
+    {
+	const char *key = channelKey(event, IBList_at(keys, i));
+	if (!key) continue;
+	msg = Arena_append(arena, msg, n++ ? " | " : "Gefunden: ");
+	msg = Arena_append(arena, msg, key);
+    }
+    if (msg)
+    {
+	event->respond(event->ctx, msg, 0);
+    }
+    else
+    {
+	event->respond(event->ctx, "hat nichts gefunden...", 1);
+    }
+    IBList_destroy(keys);
+}
+
+void Command_suche(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    char *query = arg ? dbKey(event, arena, normalizeWs(arena, arg, 0)) : 0;
+    if (query)
+    {
+	const char *from;
+	const char *to;
+	channelRange(event, arena, &from, &to);
+	listKeys(event, arena, InfoDb_search(infoDb, query, from, to,
+		    SEARCHRESULTS));
+    }
+    else
+    {
+	event->respond(event->ctx, "hat nicht verstanden (?)", 1);
+    }
+    endCommand(ST_SUCHE, arena, start);
+}
+
+void Command_finde(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    if (arg)
+    {
+	const char *from;
+	const char *to;
+	channelRange(event, arena, &from, &to);
+	listKeys(event, arena, InfoDb_find(infoDb, arg, from, to,
+		    SEARCHRESULTS));
+    }
+    else
+    {
+	event->respond(event->ctx, "hat nicht verstanden (?)", 1);
+    }
+    endCommand(ST_FINDE, arena, start);
+}
+
+void Command_gelehrt(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    const char *arg = event->arg;
+    char *nick = arg ? normalizeWs(arena, arg, 0) : 0;
+    if (nick && !strchr(nick, ' '))
+    {
+	const char *from;
+	const char *to;
+	channelRange(event, arena, &from, &to);
+	listKeys(event, arena, InfoDb_byAuthor(infoDb, nick, from, to,
+		    SEARCHRESULTS));
+    }
+    else
+    {
+	event->respond(event->ctx, "hat nicht verstanden (?)", 1);
+    }
+    endCommand(ST_GELEHRT, arena, start);
+}
+
+static char *statsTimers(Arena *arena, const char *title,
+	StatsTimer first, StatsTimer last)
+{
+    char buf[128];
+    StatsSummary summary;
+    char *msg = Arena_append(arena, 0, title);
+    int empty = 1;
+    for (StatsTimer timer = first; timer <= last; ++timer)
+    {
+	Stats_summary(timer, &summary);
+	if (!summary.count) continue;
+	snprintf(buf, sizeof buf, "%s%s %llux %.1f/%.0f/%.0f/%.0f",
+		empty ? " " : " | ", Stats_name(timer),
+		(unsigned long long)summary.count, summary.mean,
+		summary.p50, summary.p99, summary.max);
+	msg = Arena_append(arena, msg, buf);
+	empty = 0;
+    }
+    if (empty) msg = Arena_append(arena, msg, " -");
+    return msg;
+}
+
+static char *statsLine(Arena *arena, int line)
+{
+    char buf[160];
+    size_t hits = 0;
+    size_t misses = 0;
+    InfoDbFilterStats filter = { 0 };
+    switch (line)
+    {
+	case 0:
+	    return statsTimers(arena,
+		    "Befehle (Anzahl Mittel/p50/p99/max in µs):",
+		    ST_BIER, ST_COMPACT);
+	case 1:
+	    return statsTimers(arena, "Datenbank:", ST_DBGET,
+		    ST_DBCHECKPOINT);
+	case 2:
+	    return statsTimers(arena, "Warten auf Locks:",
+		    ST_READLOCK, ST_DBLOCK);
+	case 3:
+	    if (infoDb) InfoDb_cacheStats(infoDb, &hits, &misses);
+	    snprintf(buf, sizeof buf, "Cache: %zu Treffer, %zu Fehlschläge "
+		    "(%.1f%%)", hits, misses, hits + misses ?
+		    100.0 * (double)hits / (double)(hits + misses) : 0);
+	    return Arena_copystr(arena, buf);
+	default:
+	    if (infoDb) InfoDb_filterStats(infoDb, &filter);
+	    snprintf(buf, sizeof buf, "Filter: %zu Schlüssel, %zu KiB, "
+		    "%zu abgewiesen, %zu falsch positiv (%.3f%%, erwartet "
+		    "%.3f%%)", filter.keys, (filter.memory + 1023) / 1024,
+		    filter.rejected, filter.falsePositives,
+		    filter.rejected + filter.falsePositives ?
+		    100.0 * (double)filter.falsePositives
+		    / (double)(filter.rejected + filter.falsePositives) : 0,
+		    100.0 * filter.fpRate);
+	    return Arena_copystr(arena, buf);
+    }
+}
+
+void Command_stats(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    if (isAdmin(event))
+    {
+	for (int i = 0; i < STATSLINES; ++i)
+	{
+	    event->respond(event->ctx, statsLine(arena, i), 0);
+	}
+    }
+    else
+    {
+	event->respond(event->ctx, "darf das nicht verraten!", 1);
+    }
+    endCommand(ST_STATS, arena, start);
+}
+
+void Command_backup(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    if (!isAdmin(event))
+    {
+	event->respond(event->ctx, "darf das nicht!", 1);
+    }
+    else if (!backupFile)
+    {
+	event->respond(event->ctx, "weiß nicht, wohin mit dem Backup...", 1);
+    }
+    else if (InfoDb_startBackup(infoDb, backupFile) < 0)
+    {
+	event->respond(event->ctx, "ist noch mit Backup oder Aufräumen "
+		"beschäftigt", 1);
+    }
+    else
+    {
+	char *msg = Arena_append(arena, 0, "Ok, Backup nach ");
+	msg = Arena_append(arena, msg, backupFile);
+	msg = Arena_append(arena, msg, " läuft...");
+	event->respond(event->ctx, msg, 0);
+    }
+    endCommand(ST_BACKUP, arena, start);
+}
+
+void Command_compact(const CommandEvent *event)
+{
+    uint64_t start = Stats_now();
+    Arena *arena = Arena_begin();
+    if (!isAdmin(event))
+    {
+	event->respond(event->ctx, "darf das nicht!", 1);
+    }
+    else if (InfoDb_startCompact(infoDb) < 0)
+    {
+	event->respond(event->ctx, "ist noch mit Backup oder Aufräumen "
+		"beschäftigt", 1);
+    }
+    else
+    {
+	event->respond(event->ctx, "Ok, Datenbank wird aufgeräumt...", 0);
+    }
+    endCommand(ST_COMPACT, arena, start);
+}
+
+void Commands_logStats(void)
+{
+    Arena *arena = Arena_begin();
+    for (int i = 0; i < STATSLINES; ++i)
+    {
+	IBLog_fmt(L_INFO, "stats: %s", statsLine(arena, i));
+    }
+    Arena_end(arena, 0);
+}
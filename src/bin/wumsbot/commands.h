@@ -0,0 +1,51 @@
+#ifndef WUMSBOT_COMMANDS_H
+#define WUMSBOT_COMMANDS_H
+
+#include <ircbot/decl.h>
+
+C_CLASS_DECL(InfoDb);
+
+/* transport independent view of a bot command, so the handlers can be
+ * driven by the ircbot library as well as by the replay harness */
+typedef int (*CommandNickCheck)(void *ctx, const char *nick);
+typedef void (*CommandResponder)(void *ctx, const char *msg, int action);
+
+/* replies sent after the handler returned: replyTarget copies what is
+ * needed from ctx, sendReply sends once and releases the target, it is
+ * called from the InfoDb writer thread */
+typedef void *(*CommandReplyTarget)(void *ctx);
+typedef void (*CommandSendReply)(void *target, const char *msg, int action);
+
+typedef struct CommandEvent
+{
+    const char *arg;
+    const char *from;
+    CommandNickCheck hasNick;	/* 0 if not sent to a channel */
+    const char *ns;		/* channel namespace, 0 for shared facts */
+    CommandResponder respond;
+    CommandReplyTarget replyTarget;
+    CommandSendReply sendReply;
+    void *ctx;
+} CommandEvent;
+
+typedef void (*CommandHandler)(const CommandEvent *event);
+
+void Commands_init(InfoDb *db);
+void Commands_setAdmins(const char *nicks, const char *password);
+void Commands_setBackupFile(const char *filename);
+CommandHandler Commands_find(const char *name) ATTR_NONNULL((1));
+void Commands_logStats(void);
+
+void Command_bier(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_kaffee(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_info(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_lerne(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_vergiss(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_suche(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_finde(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_gelehrt(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_stats(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_backup(const CommandEvent *event) ATTR_NONNULL((1));
+void Command_compact(const CommandEvent *event) ATTR_NONNULL((1));
+
+#endif
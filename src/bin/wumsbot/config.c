@@ -0,0 +1,342 @@
+#include "config.h"
+
+#include <ircbot/log.h>
+#include <ircbot/util.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAXARGS 32
+
+#define IRCNET "libera"
+#define SERVER "irc.libera.chat"
+#define PORT 6697
+#define NICK "wumsbot"
+#define CHANNEL "#bsd-de"
+#define UID 999
+#define PIDFILE "/var/run/wumsbot/wumsbot.pid"
+#define DBFILE "/var/db/wumsbot/wumsbot.db"
+#define BACKUPFILE "/var/db/wumsbot/wumsbot.db.backup"
+#define CACHESIZE 1024
+#define SHARDS 1
+#define SYNCAFTER 16
+#define SYNCDELAY 5
+#define CERTFILE "/var/db/wumsbot/wumsbot.crt"
+#define KEYFILE "/var/db/wumsbot/wumsbot.key"
+#define ADMINS "Zirias"
+#define STATSINTERVAL 3600
+
+static void setstr(char **str, const char *val)
+{
+    free(*str);
+    *str = val ? IB_copystr(val) : 0;
+}
+
+static int parsenum(const char *str, long min, long max, long *num)
+{
+    char *end;
+    errno = 0;
+    long val = strtol(str, &end, 10);
+    if (errno || end == str || *end || val < min || val > max) return -1;
+    *num = val;
+    return 0;
+}
+
+static int validns(const char *ns)
+{
+    for (const char *c = ns; *c; ++c)
+    {
+	if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_') return 0;
+    }
+    return 1;
+}
+
+static ConfigServer *addserver(Config *self, const char *id,
+	const char *host, int port)
+{
+    self->servers = IB_xrealloc(self->servers,
+	    (self->nservers + 1) * sizeof *self->servers);
+    ConfigServer *server = self->servers + self->nservers++;
+    memset(server, 0, sizeof *server);
+    server->id = IB_copystr(id);
+    server->host = IB_copystr(host);
+    server->port = port;
+    server->nick = IB_copystr(NICK);
+    return server;
+}
+
+static void addchannel(ConfigServer *server, const char *name, const char *ns)
+{
+    server->channels = IB_xrealloc(server->channels,
+	    (server->nchannels + 1) * sizeof *server->channels);
+    ConfigChannel *channel = server->channels + server->nchannels++;
+    channel->name = IB_copystr(name);
+    channel->ns = ns ? IB_copystr(ns) : 0;
+}
+
+/* joins all arguments from the second one on, for lists like admins */
+static char *joinargs(char **args, int nargs)
+{
+    size_t len = 0;
+    for (int i = 1; i < nargs; ++i) len += strlen(args[i]) + 1;
+    char *joined = IB_xmalloc(len ? len : 1);
+    *joined = 0;
+    for (int i = 1; i < nargs; ++i)
+    {
+	if (i > 1) strcat(joined, " ");
+	strcat(joined, args[i]);
+    }
+    return joined;
+}
+
+/* Settings are given one per line as a keyword followed by arguments.
+ * A server line starts a server section, the nick, ipv6, tls and
+ * channel lines following it apply to that server. */
+static int parseline(Config *self, char **args, int nargs, const char **err)
+{
+    const char *kw = args[0];
+    ConfigServer *server = self->nservers
+	? self->servers + self->nservers - 1 : 0;
+    long num;
+    *err = "wrong number of arguments";
+
+    if (!strcmp(kw, "server"))
+    {
+	if (nargs != 4) return -1;
+	*err = "invalid port";
+	if (parsenum(args[3], 1, 65535, &num) < 0) return -1;
+	for (size_t i = 0; i < self->nservers; ++i)
+	{
+	    *err = "duplicate server id";
+	    if (!strcmp(self->servers[i].id, args[1])) return -1;
+	}
+	addserver(self, args[1], args[2], (int)num);
+	return 0;
+    }
+    if (!strcmp(kw, "nick") || !strcmp(kw, "ipv6") || !strcmp(kw, "tls")
+	    || !strcmp(kw, "channel"))
+    {
+	if (!server)
+	{
+	    *err = "only valid after a server line";
+	    return -1;
+	}
+	if (!strcmp(kw, "nick"))
+	{
+	    if (nargs != 2) return -1;
+	    setstr(&server->nick, args[1]);
+	}
+	else if (!strcmp(kw, "ipv6"))
+	{
+	    if (nargs != 1) return -1;
+	    server->ipv6 = 1;
+	}
+	else if (!strcmp(kw, "tls"))
+	{
+	    if (nargs != 3) return -1;
+	    setstr(&server->cert, args[1]);
+	    setstr(&server->key, args[2]);
+	}
+	else
+	{
+	    if (nargs < 2 || nargs > 3) return -1;
+	    *err = "invalid namespace";
+	    if (nargs == 3 && !validns(args[2])) return -1;
+	    addchannel(server, args[1], nargs == 3 ? args[2] : 0);
+	}
+	return 0;
+    }
+    if (server)
+    {
+	*err = "global settings must precede the server sections";
+	return -1;
+    }
+    if (!strcmp(kw, "admins"))
+    {
+	free(self->admins);
+	self->admins = joinargs(args, nargs);
+	return 0;
+    }
+    if (nargs != 2) return -1;
+    if (!strcmp(kw, "pidfile")) setstr(&self->pidfile, args[1]);
+    else if (!strcmp(kw, "adminpass")) setstr(&self->adminpass, args[1]);
+    else if (!strcmp(kw, "dbfile")) setstr(&self->dbfile, args[1]);
+    else if (!strcmp(kw, "backupfile"))
+    {
+	setstr(&self->backupfile, strcmp(args[1], "none") ? args[1] : 0);
+    }
+    else if (!strcmp(kw, "store"))
+    {
+	*err = "unknown store type";
+	if (Store_parseType(args[1], &self->store) < 0) return -1;
+    }
+    else
+    {
+	*err = "invalid number";
+	if (!strcmp(kw, "uid"))
+	{
+	    if (parsenum(args[1], -1, LONG_MAX, &num) < 0) return -1;
+	    self->uid = num;
+	}
+	else if (!strcmp(kw, "cachesize"))
+	{
+	    if (parsenum(args[1], 0, LONG_MAX, &num) < 0) return -1;
+	    self->cachesize = (size_t)num;
+	}
+	else if (!strcmp(kw, "shards"))
+	{
+	    if (parsenum(args[1], 1, 1024, &num) < 0) return -1;
+	    self->shards = (unsigned)num;
+	}
+	else if (!strcmp(kw, "syncafter"))
+	{
+	    if (parsenum(args[1], 0, INT_MAX, &num) < 0) return -1;
+	    self->syncafter = (unsigned)num;
+	}
+	else if (!strcmp(kw, "syncdelay"))
+	{
+	    if (parsenum(args[1], 0, INT_MAX, &num) < 0) return -1;
+	    self->syncdelay = (unsigned)num;
+	}
+	else if (!strcmp(kw, "statsinterval"))
+	{
+	    if (parsenum(args[1], 0, INT_MAX, &num) < 0) return -1;
+	    self->statsinterval = (unsigned)num;
+	}
+	else
+	{
+	    *err = "unknown setting";
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static int parse(Config *self, FILE *in, const char *filename)
+{
+    char *line = 0;
+    size_t linesz = 0;
+    unsigned lineno = 0;
+    int rc = -1;
+    while (getline(&line, &linesz, in) >= 0)
+    {
+	++lineno;
+	char *args[MAXARGS + 1];
+	int nargs = 0;
+	char *pos = line + strspn(line, " \t\r\n");
+	if (*pos == '#') continue;
+	for (char *arg = strtok(pos, " \t\r\n"); arg;
+		arg = strtok(0, " \t\r\n"))
+	{
+	    if (nargs == MAXARGS + 1) break;
+	    args[nargs++] = arg;
+	}
+	if (!nargs) continue;
+	const char *err = "too many arguments";
+	if (nargs > MAXARGS || parseline(self, args, nargs, &err) < 0)
+	{
+	    IBLog_fmt(L_ERROR, "%s:%u: %s: %s", filename, lineno, args[0],
+		    err);
+	    goto done;
+	}
+    }
+    rc = ferror(in) ? -1 : 0;
+    if (rc < 0) IBLog_fmt(L_ERROR, "cannot read config file `%s'", filename);
+done:
+    free(line);
+    return rc;
+}
+
+Config *Config_load(const char *filename, int optional)
+{
+    Config *self = IB_xmalloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->uid = UID;
+    self->pidfile = IB_copystr(PIDFILE);
+    self->dbfile = IB_copystr(DBFILE);
+    self->backupfile = IB_copystr(BACKUPFILE);
+    self->admins = IB_copystr(ADMINS);
+    self->store = STORE_BTREE;
+    self->cachesize = CACHESIZE;
+    self->shards = SHARDS;
+    self->syncafter = SYNCAFTER;
+    self->syncdelay = SYNCDELAY;
+    self->statsinterval = STATSINTERVAL;
+
+    FILE *in = fopen(filename, "r");
+    if (in)
+    {
+	int rc = parse(self, in, filename);
+	fclose(in);
+	if (rc < 0) goto error;
+    }
+    else if (!optional || errno != ENOENT)
+    {
+	IBLog_fmt(L_ERROR, "cannot open config file `%s'", filename);
+	goto error;
+    }
+
+    if (!self->nservers)
+    {
+	ConfigServer *server = addserver(self, IRCNET, SERVER, PORT);
+	server->ipv6 = 1;
+	server->cert = IB_copystr(CERTFILE);
+	server->key = IB_copystr(KEYFILE);
+	addchannel(server, CHANNEL, 0);
+    }
+    return self;
+
+error:
+    Config_destroy(self);
+    return 0;
+}
+
+const char *Config_namespace(const Config *self, const char *serverId,
+	const char *channel)
+{
+    for (size_t i = 0; i < self->nservers; ++i)
+    {
+	const ConfigServer *server = self->servers + i;
+	if (strcmp(server->id, serverId)) continue;
+	for (size_t j = 0; j < server->nchannels; ++j)
+	{
+	    if (!strcasecmp(server->channels[j].name, channel))
+	    {
+		return server->channels[j].ns;
+	    }
+	}
+    }
+    return 0;
+}
+
+void Config_destroy(Config *self)
+{
+    if (!self) return;
+    for (size_t i = 0; i < self->nservers; ++i)
+    {
+	ConfigServer *server = self->servers + i;
+	for (size_t j = 0; j < server->nchannels; ++j)
+	{
+	    free(server->channels[j].name);
+	    free(server->channels[j].ns);
+	}
+	free(server->channels);
+	free(server->id);
+	free(server->host);
+	free(server->nick);
+	free(server->cert);
+	free(server->key);
+    }
+    free(self->servers);
+    free(self->pidfile);
+    free(self->dbfile);
+    free(self->backupfile);
+    free(self->admins);
+    free(self->adminpass);
+    free(self);
+}
@@ -0,0 +1,52 @@
+#ifndef WUMSBOT_CONFIG_H
+#define WUMSBOT_CONFIG_H
+
+#include "store.h"
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+
+typedef struct ConfigChannel
+{
+    char *name;
+    char *ns;		/* 0 for the shared facts */
+} ConfigChannel;
+
+typedef struct ConfigServer
+{
+    char *id;
+    char *host;
+    int port;
+    char *nick;
+    char *cert;		/* 0 without TLS */
+    char *key;
+    int ipv6;
+    ConfigChannel *channels;
+    size_t nchannels;
+} ConfigServer;
+
+typedef struct Config
+{
+    long uid;
+    char *pidfile;
+    char *dbfile;
+    char *backupfile;	/* 0 if backups are disabled */
+    char *admins;
+    char *adminpass;	/* 0 disables the admin commands */
+    StoreType store;
+    size_t cachesize;
+    unsigned shards;
+    unsigned syncafter;
+    unsigned syncdelay;
+    unsigned statsinterval;
+    ConfigServer *servers;
+    size_t nservers;
+} Config;
+
+Config *Config_load(const char *filename, int optional) ATTR_NONNULL((1));
+const char *Config_namespace(const Config *self, const char *serverId,
+	const char *channel) CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+void Config_destroy(Config *self);
+
+#endif
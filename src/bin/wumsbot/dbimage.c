@@ -0,0 +1,228 @@
+#include "dbimage.h"
+
+#include <ircbot/util.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* An image starts with a magic, the number of records and the offset of
+ * the record table. Records follow as key size, value size, key and
+ * value, the table at the end holds the offset of each record. */
+#define HEADERSZ 24
+#define RECHDRSZ 8
+
+static const uint8_t magic[8] = { 'W','U','M','S','I','M','G','1' };
+
+struct DbImage
+{
+    const uint8_t *data;
+    size_t size;
+    size_t count;
+    const uint8_t *table;
+};
+
+static uint64_t get64(const uint8_t *data)
+{
+    uint64_t val = 0;
+    for (int i = 0; i < 8; ++i) val = (val << 8) | data[i];
+    return val;
+}
+
+static uint32_t get32(const uint8_t *data)
+{
+    return ((uint32_t)data[0]<<24)
+	|((uint32_t)data[1]<<16)
+	|((uint32_t)data[2]<<8)
+	|(uint32_t)data[3];
+}
+
+static void put64(uint8_t *data, uint64_t val)
+{
+    for (int i = 7; i >= 0; --i)
+    {
+	data[i] = val & 0xff;
+	val >>= 8;
+    }
+}
+
+static void put32(uint8_t *data, uint32_t val)
+{
+    data[0] = val >> 24;
+    data[1] = (val >> 16) & 0xff;
+    data[2] = (val >> 8) & 0xff;
+    data[3] = val & 0xff;
+}
+
+/* same order as the default btree comparison */
+int DbImage_cmp(const DBT *a, const DBT *b)
+{
+    size_t len = a->size < b->size ? a->size : b->size;
+    int rc = len ? memcmp(a->data, b->data, len) : 0;
+    if (rc) return rc;
+    return (a->size > b->size) - (a->size < b->size);
+}
+
+int DbImage_check(int fd)
+{
+    uint8_t header[sizeof magic];
+    return pread(fd, header, sizeof header, 0) == (ssize_t)sizeof header
+	&& !memcmp(header, magic, sizeof magic);
+}
+
+/* writes all records of source, or an empty image if source is 0, to a
+ * temporary file that is renamed on success */
+int DbImage_save(const char *filename, const DB *source)
+{
+    size_t namelen = strlen(filename);
+    char *tmpname = IB_xmalloc(namelen + 5);
+    memcpy(tmpname, filename, namelen);
+    memcpy(tmpname + namelen, ".tmp", 5);
+    uint64_t *offsets = 0;
+    size_t count = 0;
+    size_t capa = 0;
+    int rc = -1;
+
+    int fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    FILE *out = fd < 0 ? 0 : fdopen(fd, "w");
+    if (!out)
+    {
+	if (fd >= 0) close(fd);
+	goto done;
+    }
+    uint8_t header[HEADERSZ] = { 0 };
+    fwrite(header, 1, HEADERSZ, out);
+    uint64_t pos = HEADERSZ;
+    DBT key;
+    DBT val;
+    int drc = source ? source->seq(source, &key, &val, R_FIRST) : 1;
+    while (drc == 0)
+    {
+	if (count == capa)
+	{
+	    capa = capa ? 2 * capa : 1024;
+	    offsets = IB_xrealloc(offsets, capa * sizeof *offsets);
+	}
+	offsets[count++] = pos;
+	uint8_t rechdr[RECHDRSZ];
+	put32(rechdr, (uint32_t)key.size);
+	put32(rechdr + 4, (uint32_t)val.size);
+	fwrite(rechdr, 1, RECHDRSZ, out);
+	fwrite(key.data, 1, key.size, out);
+	fwrite(val.data, 1, val.size, out);
+	pos += RECHDRSZ + key.size + val.size;
+	drc = source->seq(source, &key, &val, R_NEXT);
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+	uint8_t entry[8];
+	put64(entry, offsets[i]);
+	fwrite(entry, 1, 8, out);
+    }
+    memcpy(header, magic, sizeof magic);
+    put64(header + 8, count);
+    put64(header + 16, pos);
+    if (drc < 0 || fflush(out) != 0 || ferror(out)
+	    || pwrite(fd, header, HEADERSZ, 0) != HEADERSZ
+	    || fsync(fd) < 0)
+    {
+	fclose(out);
+	unlink(tmpname);
+	goto done;
+    }
+    if (fclose(out) != 0 || rename(tmpname, filename) < 0)
+    {
+	unlink(tmpname);
+	goto done;
+    }
+    rc = 0;
+done:
+    free(offsets);
+    free(tmpname);
+    return rc;
+}
+
+DbImage *DbImage_map(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < HEADERSZ) return 0;
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) return 0;
+    const uint8_t *bytes = data;
+    uint64_t count = get64(bytes + 8);
+    uint64_t tableoff = get64(bytes + 16);
+    if (memcmp(bytes, magic, sizeof magic) || tableoff < HEADERSZ
+	    || tableoff > size || count > (size - tableoff) / 8)
+    {
+	goto error;
+    }
+    /* a damaged file must be rejected here, lookups trust the table */
+    for (uint64_t i = 0; i < count; ++i)
+    {
+	uint64_t off = get64(bytes + tableoff + 8 * i);
+	if (off < HEADERSZ || off > tableoff - RECHDRSZ) goto error;
+	uint64_t recsize = (uint64_t)get32(bytes + off)
+	    + get32(bytes + off + 4);
+	if (recsize > tableoff - RECHDRSZ - off) goto error;
+    }
+    DbImage *self = IB_xmalloc(sizeof *self);
+    self->data = bytes;
+    self->size = size;
+    self->count = (size_t)count;
+    self->table = bytes + tableoff;
+    return self;
+
+error:
+    munmap(data, size);
+    return 0;
+}
+
+size_t DbImage_count(const DbImage *self)
+{
+    return self->count;
+}
+
+void DbImage_record(const DbImage *self, size_t i, DBT *key, DBT *val)
+{
+    const uint8_t *rec = self->data + get64(self->table + 8 * i);
+    key->size = get32(rec);
+    key->data = (void *)(rec + RECHDRSZ);
+    val->size = get32(rec + 4);
+    val->data = (void *)(rec + RECHDRSZ + key->size);
+}
+
+/* returns the index of the first record not sorting before key */
+size_t DbImage_find(const DbImage *self, const DBT *key, int *found)
+{
+    size_t lo = 0;
+    size_t hi = self->count;
+    *found = 0;
+    while (lo < hi)
+    {
+	size_t mid = lo + (hi - lo) / 2;
+	DBT mkey;
+	DBT mval;
+	DbImage_record(self, mid, &mkey, &mval);
+	int rc = DbImage_cmp(&mkey, key);
+	if (rc < 0) lo = mid + 1;
+	else
+	{
+	    if (rc == 0) *found = 1;
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+void DbImage_destroy(DbImage *self)
+{
+    if (!self) return;
+    munmap((void *)self->data, self->size);
+    free(self);
+}
@@ -0,0 +1,25 @@
+#ifndef WUMSBOT_DBIMAGE_H
+#define WUMSBOT_DBIMAGE_H
+
+#include <ircbot/decl.h>
+
+#include <db.h>
+#include <stddef.h>
+
+/* Immutable database images holding all records sorted by key, the file
+ * format of the mem and mmap stores. Images are mapped read-only, so
+ * records returned point into the mapping. */
+C_CLASS_DECL(DbImage);
+
+int DbImage_cmp(const DBT *a, const DBT *b) ATTR_NONNULL((1)) ATTR_NONNULL((2));
+int DbImage_check(int fd);
+int DbImage_save(const char *filename, const DB *source) ATTR_NONNULL((1));
+DbImage *DbImage_map(int fd);
+size_t DbImage_count(const DbImage *self) CMETHOD;
+void DbImage_record(const DbImage *self, size_t i, DBT *key, DBT *val)
+    CMETHOD ATTR_NONNULL((3)) ATTR_NONNULL((4));
+size_t DbImage_find(const DbImage *self, const DBT *key, int *found)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+void DbImage_destroy(DbImage *self);
+
+#endif
@@ -1,72 +1,310 @@
+#include "arena.h"
+#include "dbimage.h"
 #include "infodb.h"
+#include "keyfilter.h"
+#include "keyindex.h"
+#include "rowcache.h"
+#include "stats.h"
+#include "store.h"
 
 #include <ircbot/list.h>
 #include <ircbot/log.h>
 #include <ircbot/util.h>
 
+#include <ctype.h>
+#include <errno.h>
 #include <db.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/random.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum WriteOp
+{
+    WO_ADD,
+    WO_REMOVE
+} WriteOp;
+
+typedef struct WriteRequest WriteRequest;
+struct WriteRequest
+{
+    WriteRequest *next;
+    WriteOp op;
+    int rc;
+    char *key;
+    char *lower;
+    InfoDbEntry *entry;
+    char *description;
+    InfoDbDone done;
+    void *ctx;
+};
 
 struct InfoDb
 {
+    InfoDb **shards;		/* only set on the facade of shards */
+    unsigned nshards;
     DB *db;
-    size_t rowCapa;
+    char *filename;
+    StoreType storeType;
     size_t rowUsed;
-    pthread_mutex_t lock;
+    uint32_t authorCount;
+    RowCache *cache;
+    KeyIndex *keys;
+    KeyFilter *filter;
+    atomic_size_t filterRejected;
+    atomic_size_t filterFalse;
+    unsigned syncAfter;
+    unsigned syncDelay;
+    unsigned pending;
+    int syncThreadRunning;
+    int stopping;
+    struct timespec firstPending;
+    pthread_t syncThread;
+    pthread_cond_t syncCond;
+    pthread_mutex_t syncLock;
+    pthread_mutex_t walSyncLock;
+    pthread_mutex_t dblock;
+    pthread_rwlock_t lock;
+    DB *backup;
+    uint8_t *backupKey;
+    size_t backupKeySz;
+    int backupFailed;
+    int backupComplete;
+    int backupThreadRunning;
+    int backupDone;
+    char *backupFile;
+    pthread_t backupThread;
+    int walfd;
+    uint8_t *walbuf;
+    size_t walbufsz;
+    size_t walsize;
+    uint8_t *txlog;
+    size_t txlogsz;
+    size_t txloglen;
+    size_t txstart;
+    int txlogged;
+    size_t txRowUsed;
+    uint32_t txAuthorCount;
+    uint64_t txChangeTag;
+    uint64_t changeTag;
+    char *factsFile;
+    DbImage *facts[2];
+    atomic_uint factsReaders[2];
+    atomic_int factsCurrent;
+    int factsSlot;
+    int factsWanted;
+    int factsStopping;
+    int factsThreadRunning;
+    struct timespec factsDue;
+    pthread_t factsThread;
+    pthread_cond_t factsCond;
+    pthread_mutex_t factsLock;
+    WriteRequest *writeHead;
+    WriteRequest *writeTail;
+    size_t writeQueued;
+    int writerRunning;
+    int writerStopping;
+    pthread_t writerThread;
+    pthread_cond_t writeCond;
+    pthread_cond_t writeSpace;
+    pthread_mutex_t writeLock;
 };
 
-static thread_local InfoDb *lockedDb;
-static thread_local int lockCount;
-
-static void lock(InfoDb *db)
-{
-    if (db == lockedDb)
-    {
-	++lockCount;
-	return;
-    }
-    if (!lockedDb)
-    {
-	lockedDb = db;
-	lockCount = 1;
-    }
-    pthread_mutex_lock(&(db)->lock);
-}
+/* libdb handles aren't thread-safe, even for lookups, so readers copy
+ * values out of the DB into a per-thread buffer under dblock and decode
+ * them after releasing it */
+static thread_local uint8_t *fetchBuf;
+static thread_local size_t fetchBufSize;
 
-static void unlock(InfoDb *db)
-{
-    if (db == lockedDb)
-    {
-	if (--lockCount) return;
-	lockedDb = 0;
-    }
-    pthread_mutex_unlock(&(db)->lock);
-}
+/* loadview() assembles rows in per-thread buffers, so a view takes a
+ * single allocation of its final size */
+static thread_local uint8_t *loadBuf;
+static thread_local size_t loadBufSize;
+static thread_local uint8_t *recordBuf;
+static thread_local size_t recordBufSize;
+static pthread_key_t bufKey;
+static pthread_once_t bufKeyOnce = PTHREAD_ONCE_INIT;
 
 struct InfoDbRow
 {
     char *key;
     IBList *entries;
+    atomic_uint refcnt;
+};
+
+/* data is the row in row encoding, assembled from its head and entry
+ * records with the author names resolved */
+struct InfoDbRowView
+{
+    atomic_uint refcnt;
+    _Atomic(InfoDbRow *) row;
+    const char *key;
+    size_t first;
+    size_t size;
+    uint8_t data[];
 };
 
 struct InfoDbEntry
 {
     size_t authorlen;
+    size_t desclen;
     time_t time;
     char content[];
 };
 
-static const uint8_t rowCapaKey[] = { 0, 0 };
+/* Database layout:
+ * lowercase key  -> 8 bytes slot, 8 bytes next entry sequence number,
+ *                   row header, the entries are { 0, 13 } records
+ * { 0, 1 }       -> number of rows (8 bytes)
+ * { 0, 3, slot } -> lowercase key, slots are dense for random selection
+ * { 0, 4 }       -> layout version (1 byte)
+ * { 0, 5, word, 0, lowercase key }
+ *                -> occurrences of word in the row's descriptions (8 bytes)
+ * { 0, 6 }       -> full-text index version (1 byte), written once the
+ *                   index is complete
+ * { 0, 7 }       -> random tag changed by every commit (8 bytes)
+ * { 0, 8, lowercase key, 0, sequence number (8 bytes) }
+ *                -> legacy entry of layout version 3 with its author
+ *                   inline, only present while migrating
+ * { 0, 9 }       -> shard number and count (4 bytes each), only present
+ *                   in shards
+ * { 0, 10 }      -> number of authors (4 bytes)
+ * { 0, 10, id (4 bytes) }
+ *                -> author nick
+ * { 0, 11, author nick }
+ *                -> author id (4 bytes)
+ * { 0, 12, lowercase author, 0, lowercase key, 0, sequence number }
+ *                -> empty, indexes the entries by author
+ * { 0, 13, lowercase key, 0, sequence number (8 bytes) }
+ *                -> entry record referencing its author by id
+ */
 static const uint8_t rowUsedKey[] = { 0, 1 };
-static const uint8_t freeListKey[] = { 0, 2 };
+static const uint8_t versionKey[] = { 0, 4 };
+static const uint8_t ftVersionKey[] = { 0, 6 };
+static const uint8_t changeKey[] = { 0, 7 };
+static const uint8_t shardKey[] = { 0, 9 };
+static const uint8_t authorCountKey[] = { 0, 10 };
+static const uint8_t oldEntryPrefix[] = { 0, 8 };
+
+#define DBVERSION 4
+#define FTVERSION 1
+#define SLOTKEYSZ 10
+#define AUTHORKEYSZ 6
+#define ROWPREFIXSZ 16
+#define MINWORDLEN 2
+#define MAXWORDLEN 64
+#define FOREACHSLICE 256
+#define BACKUPSLICE 256
+#define LOOKUPSAMPLES 1000
+#define CHECKPOINTSIZE (16U << 20)
+#define FACTSDELAY 5
+#define RANGETRIES 16
+#define WRITEQUEUESIZE 256
+#define MIGRATESLICE 1024
+
+#define WAL_PUT 'P'
+#define WAL_DEL 'D'
+#define WAL_COMMIT 'C'
+#define WAL_ABORT 'A'
+
+static thread_local uint64_t prngState[4];
+static thread_local int prngSeeded;
+
+#define KEYBUFSZ 256
+
+/* transient buffers are taken from the calling thread's arena while it
+ * processes a command, so they are released together with it */
+static void *scratch_alloc(size_t size)
+{
+    Arena *arena = Arena_current();
+    return arena ? Arena_alloc(arena, size) : IB_xmalloc(size);
+}
+
+static void scratch_free(void *ptr)
+{
+    if (!Arena_current()) free(ptr);
+}
+
+static char *tolowerkey(const char *key, char *buf)
+{
+    size_t keysz = strlen(key) + 1;
+    char *lower = keysz > KEYBUFSZ ? scratch_alloc(keysz) : buf;
+    for (size_t i = 0; i < keysz; ++i)
+    {
+	lower[i] = tolower((unsigned char)key[i]);
+    }
+    return lower;
+}
+
+static void freekey(char *lower, char *buf)
+{
+    if (lower != buf) scratch_free(lower);
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t prng_next(void)
+{
+    uint64_t *st = prngState;
+    if (!prngSeeded)
+    {
+	if (getrandom(st, sizeof prngState, 0) != sizeof prngState)
+	{
+	    st[0] = (uint64_t)time(0);
+	    st[1] = (uint64_t)(uintptr_t)st;
+	    st[2] = (uint64_t)clock();
+	    st[3] = 0x9e3779b97f4a7c15ULL;
+	}
+	if (!(st[0]|st[1]|st[2]|st[3])) st[0] = 1;
+	prngSeeded = 1;
+    }
+    uint64_t result = rotl(st[1] * 5, 7) * 9;
+    uint64_t t = st[1] << 17;
+    st[2] ^= st[0];
+    st[3] ^= st[1];
+    st[1] ^= st[2];
+    st[0] ^= st[3];
+    st[2] ^= t;
+    st[3] = rotl(st[3], 45);
+    return result;
+}
+
+/* seeds the calling thread's generator, only meant for reproducible
+ * test runs */
+void InfoDb_seedRandom(uint64_t seed)
+{
+    /* splitmix64 expands the seed, it never yields an all-zero state */
+    for (int i = 0; i < 4; ++i)
+    {
+	uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	prngState[i] = z ^ (z >> 31);
+    }
+    prngSeeded = 1;
+}
+
+static uint64_t prng_below(uint64_t bound)
+{
+    uint64_t threshold = -bound % bound;
+    uint64_t r;
+    while ((r = prng_next()) < threshold);
+    return r % bound;
+}
 
 static void uint64_ser(uint8_t *data, uint64_t val)
 {
@@ -80,6 +318,22 @@ static void uint64_ser(uint8_t *data, uint64_t val)
     data[7] = val & 0xff;
 }
 
+static void uint32_ser(uint8_t *data, uint32_t val)
+{
+    data[0] = val >> 24;
+    data[1] = (val >> 16) & 0xff;
+    data[2] = (val >> 8) & 0xff;
+    data[3] = val & 0xff;
+}
+
+static uint32_t uint32_deser(const uint8_t *data)
+{
+    return ((uint32_t)data[0]<<24)
+	|((uint32_t)data[1]<<16)
+	|((uint32_t)data[2]<<8)
+	|(uint32_t)data[3];
+}
+
 static uint64_t uint64_deser(const uint8_t *data)
 {
     return ((uint64_t)data[0]<<56)
@@ -92,22 +346,58 @@ static uint64_t uint64_deser(const uint8_t *data)
 	|(uint64_t)data[7];
 }
 
-static void time_ser(uint8_t *data, time_t time)
+static void slotkey(uint8_t *key, uint64_t slot)
+{
+    key[0] = 0;
+    key[1] = 3;
+    uint64_ser(key+2, slot);
+}
+
+static size_t varint_size(uint64_t val)
+{
+    size_t sz = 1;
+    while (val >>= 7) ++sz;
+    return sz;
+}
+
+static uint8_t *varint_ser(uint8_t *data, uint64_t val)
+{
+    while (val >= 0x80)
+    {
+	*data++ = (val & 0x7f) | 0x80;
+	val >>= 7;
+    }
+    *data++ = val;
+    return data;
+}
+
+static const uint8_t *varint_deser(const uint8_t *data, const uint8_t *end,
+	uint64_t *val)
+{
+    uint64_t v = 0;
+    for (int shift = 0; data < end && shift < 64; shift += 7)
+    {
+	v |= (uint64_t)(*data & 0x7f) << shift;
+	if (!(*data++ & 0x80))
+	{
+	    *val = v;
+	    return data;
+	}
+    }
+    return 0;
+}
+
+static uint64_t zigzag(int64_t val)
 {
-    struct tm tm;
-    gmtime_r(&time, &tm);
-    uint32_t year = (uint32_t)tm.tm_year;
-    data[0] = year >> 24;
-    data[1] = (year >> 16) & 0xff;
-    data[2] = (year >> 8) & 0xff;
-    data[3] = year & 0xff;
-    data[4] = tm.tm_mon;
-    data[5] = tm.tm_mday;
-    data[6] = tm.tm_hour;
-    data[7] = tm.tm_min;
-    data[8] = tm.tm_sec;
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
 }
 
+static int64_t unzigzag(uint64_t val)
+{
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+/* legacy entries store a 9 bytes broken-down UTC time */
 static time_t time_deser(const uint8_t *data)
 {
     struct tm tm = {0};
@@ -124,73 +414,220 @@ static time_t time_deser(const uint8_t *data)
     return timegm(&tm);
 }
 
-static uint8_t *row_ser(const InfoDbRow *row, size_t *size)
+/* Row encoding:
+ * 0x00, ROWENCODING, varint keylen, key, NUL
+ * for each entry:
+ *   varint zigzag(time - time of previous entry), first entry relative to 0
+ *   varint authorlen, author, NUL
+ *   varint desclen, description, NUL
+ *
+ * Strings stay NUL-terminated so they can be used in place. Legacy rows
+ * start directly with the NUL-terminated key, which is never empty. The
+ * database stores the header and the entries in separate records, rows
+ * are assembled in this encoding when read.
+ */
+#define ROWENCODING 1
+
+static size_t header_size(size_t keylen)
+{
+    return 2 + varint_size(keylen) + keylen + 1;
+}
+
+static uint8_t *header_ser(uint8_t *p, const char *key, size_t keylen)
+{
+    *p++ = 0;
+    *p++ = ROWENCODING;
+    p = varint_ser(p, keylen);
+    memcpy(p, key, keylen + 1);
+    return p + keylen + 1;
+}
+
+static size_t entry_size(int64_t delta, size_t authorlen, size_t desclen)
+{
+    return varint_size(zigzag(delta))
+	+ varint_size(authorlen) + authorlen + 1
+	+ varint_size(desclen) + desclen + 1;
+}
+
+static uint8_t *entry_ser(uint8_t *p, int64_t delta,
+	const char *author, size_t authorlen,
+	const char *description, size_t desclen)
+{
+    p = varint_ser(p, zigzag(delta));
+    p = varint_ser(p, authorlen);
+    memcpy(p, author, authorlen);
+    p += authorlen;
+    *p++ = 0;
+    p = varint_ser(p, desclen);
+    memcpy(p, description, desclen);
+    p += desclen;
+    *p++ = 0;
+    return p;
+}
+
+static const uint8_t *str_deser(const uint8_t *data, const uint8_t *end,
+	const char **str, size_t *len)
+{
+    uint64_t l;
+    if (!(data = varint_deser(data, end, &l))) return 0;
+    if (l >= (uint64_t)(end - data) || data[l]) return 0;
+    *str = (const char *)data;
+    *len = (size_t)l;
+    return data + l + 1;
+}
+
+static InfoDbRow *row_create(const char *key, size_t keylen)
+{
+    InfoDbRow *row = IB_xmalloc(sizeof *row);
+    row->key = IB_xmalloc(keylen + 1);
+    memcpy(row->key, key, keylen + 1);
+    row->entries = IBList_create();
+    atomic_init(&row->refcnt, 1);
+    return row;
+}
+
+static InfoDbEntry *entry_create(const char *author, size_t authorlen,
+	const char *description, size_t desclen, time_t time)
+{
+    InfoDbEntry *entry = IB_xmalloc(sizeof *entry + authorlen + desclen + 2);
+    entry->authorlen = authorlen;
+    entry->desclen = desclen;
+    entry->time = time;
+    memcpy(entry->content, author, authorlen + 1);
+    memcpy(entry->content + authorlen + 1, description, desclen + 1);
+    return entry;
+}
+
+/* Decodes the key of a serialized row, returns the position of the first
+ * entry or 0 on error */
+static size_t row_key(const uint8_t *data, size_t datasz,
+	const char **key, size_t *keylen)
+{
+    if (!datasz) return 0;
+    if (data[0])
+    {
+	const uint8_t *keyend = memchr(data, 0, datasz);
+	if (!keyend) return 0;
+	*key = (const char *)data;
+	*keylen = keyend - data;
+	return *keylen + 1;
+    }
+    if (datasz < 2 || data[1] != ROWENCODING) return 0;
+    const uint8_t *p = str_deser(data + 2, data + datasz, key, keylen);
+    return p ? (size_t)(p - data) : 0;
+}
+
+typedef struct RowEntry
+{
+    const char *author;
+    const char *description;
+    size_t authorlen;
+    size_t desclen;
+    int64_t time;
+} RowEntry;
+
+/* decodes an entry of the current encoding, entry->time must hold the
+ * time its delta is relative to */
+static const uint8_t *entry_deser(const uint8_t *p, const uint8_t *end,
+	RowEntry *entry)
+{
+    uint64_t delta;
+    if (!(p = varint_deser(p, end, &delta))) return 0;
+    if (!(p = str_deser(p, end, &entry->author, &entry->authorlen)))
+    {
+	return 0;
+    }
+    if (!(p = str_deser(p, end, &entry->description, &entry->desclen)))
+    {
+	return 0;
+    }
+    entry->time += unzigzag(delta);
+    return p;
+}
+
+/* Entry records reference their author by id:
+ * varint zigzag(time), varint author id, varint desclen, description, NUL
+ */
+static size_t record_size(int64_t time, uint32_t author, size_t desclen)
+{
+    return varint_size(zigzag(time)) + varint_size(author)
+	+ varint_size(desclen) + desclen + 1;
+}
+
+static uint8_t *record_ser(uint8_t *p, int64_t time, uint32_t author,
+	const char *description, size_t desclen)
+{
+    p = varint_ser(p, zigzag(time));
+    p = varint_ser(p, author);
+    p = varint_ser(p, desclen);
+    memcpy(p, description, desclen + 1);
+    return p + desclen + 1;
+}
+
+/* decodes an entry record except for the author, returns -1 unless it
+ * takes exactly size bytes */
+static int record_deser(const uint8_t *p, size_t size, RowEntry *entry,
+	uint32_t *author)
 {
-    size_t keysz = strlen(row->key) + 1;
-    size_t sz = keysz;
-    IBListIterator *i = IBList_iterator(row->entries);
-    while (IBListIterator_moveNext(i))
+    const uint8_t *end = p + size;
+    uint64_t time;
+    uint64_t id;
+    if (!(p = varint_deser(p, end, &time))
+	    || !(p = varint_deser(p, end, &id)) || id > UINT32_MAX
+	    || !(p = str_deser(p, end, &entry->description, &entry->desclen)))
     {
-	InfoDbEntry *entry = IBListIterator_current(i);
-	sz += 9 + entry->authorlen
-	    + strlen(entry->content+entry->authorlen+1) + 2;
+	return -1;
     }
-    uint8_t *ser = IB_xmalloc(sz);
-    memcpy(ser, row->key, keysz);
-    uint8_t *p = ser + keysz;
-    while (IBListIterator_moveNext(i))
+    entry->time = unzigzag(time);
+    *author = (uint32_t)id;
+    return p == end ? 0 : -1;
+}
+
+/* Decodes the entry at *pos and advances *pos. entry->time must hold the
+ * time of the previous entry (0 for the first one). Returns 1 for an
+ * entry, 0 at the end of the row and -1 on error. */
+static int row_entry(const uint8_t *data, size_t datasz, size_t *pos,
+	RowEntry *entry)
+{
+    if (*pos >= datasz) return 0;
+    const uint8_t *p = data + *pos;
+    const uint8_t *end = data + datasz;
+    if (data[0])
     {
-	InfoDbEntry *entry = IBListIterator_current(i);
-	time_ser(p, entry->time);
+	if (end - p <= 13) return -1;
+	entry->time = time_deser(p);
 	p += 9;
-	size_t contentsz = entry->authorlen
-	    + strlen(entry->content+entry->authorlen+1) + 2;
-	memcpy(p, entry->content, contentsz);
-	p += contentsz;
+	const uint8_t *authorend = memchr(p, 0, end - p);
+	if (!authorend) return -1;
+	const uint8_t *descend = memchr(authorend + 1, 0, end - authorend - 1);
+	if (!descend) return -1;
+	entry->author = (const char *)p;
+	entry->authorlen = authorend - p;
+	entry->description = (const char *)authorend + 1;
+	entry->desclen = descend - authorend - 1;
+	p = descend + 1;
     }
-    IBListIterator_destroy(i);
-    *size = sz;
-    return ser;
+    else if (!(p = entry_deser(p, end, entry))) return -1;
+    *pos = p - data;
+    return 1;
 }
 
 static InfoDbRow *row_deser(const uint8_t *data, size_t datasz)
 {
-    const char *key = (const char *)data;
-    const char *keyend = memchr(data, 0, datasz);
-    if (!keyend) return 0;
-    InfoDbRow *row = IB_xmalloc(sizeof *row);
-    row->key = IB_copystr(key);
-    row->entries = IBList_create();
-    size_t keylen = keyend - key;
-    data += keylen + 1;
-    datasz -= keylen + 1;
-    while (datasz > 13)
-    {
-	time_t time = time_deser(data);
-	data+=9; datasz-=9;
-	const char *author = (const char *)data;
-	const char *authorend = memchr(data, 0, datasz);
-	if (authorend)
-	{
-	    size_t authorlen = authorend - author;
-	    const char *descend = memchr(authorend+1, 0, datasz-authorlen-1);
-	    if (descend)
-	    {
-		size_t desclen = descend - authorend - 1;
-		InfoDbEntry *entry = IB_xmalloc(sizeof *entry
-			+ authorlen + desclen + 2);
-		entry->authorlen = authorlen;
-		entry->time = time;
-		memcpy(entry->content, data, authorlen+desclen+2);
-		IBList_append(row->entries, entry, free);
-		data = (const uint8_t *)descend+1;
-		datasz -= authorlen+desclen+2;
-	    }
-	    else break;
-	}
-	else break;
+    const char *key;
+    size_t keylen;
+    size_t pos = row_key(data, datasz, &key, &keylen);
+    if (!pos) return 0;
+    InfoDbRow *row = row_create(key, keylen);
+    RowEntry entry = { .time = 0 };
+    int rc;
+    while ((rc = row_entry(data, datasz, &pos, &entry)) > 0)
+    {
+	IBList_append(row->entries, entry_create(entry.author,
+		    entry.authorlen, entry.description, entry.desclen,
+		    (time_t)entry.time), free);
     }
-    if (datasz)
+    if (rc < 0)
     {
 	InfoDbRow_destroy(row);
 	row = 0;
@@ -198,285 +635,4221 @@ static InfoDbRow *row_deser(const uint8_t *data, size_t datasz)
     return row;
 }
 
-InfoDb *InfoDb_create(const char *filename)
+static InfoDbRow *row_retain(InfoDbRow *row)
 {
-    InfoDb *self = IB_xmalloc(sizeof *self);
-    if (pthread_mutex_init(&self->lock, 0) != 0)
-    {
-	free(self);
-	self = 0;
-    }
-    else if ((self->db = dbopen(filename, O_RDWR|O_CREAT, 0600, DB_BTREE, 0)))
+    atomic_fetch_add_explicit(&row->refcnt, 1, memory_order_relaxed);
+    return row;
+}
+
+/* Words are runs of ASCII letters and digits and any non-ASCII bytes, so
+ * UTF-8 encoded letters stay part of a word. Only ASCII is lowercased. */
+static int iswordchar(unsigned char c)
+{
+    return c >= 0x80 || isalnum(c);
+}
+
+static const char *nextword(const char *text, const char **word, size_t *len)
+{
+    for (;;)
     {
-	IBLog_fmt(L_INFO, "database file `%s' opened", filename);
-	DBT id = { (void *)rowCapaKey, sizeof rowCapaKey };
-	DBT val = { 0 };
-	int needsync = 0;
-	if (self->db->get(self->db, &id, &val, 0) == 0 && val.size == 8)
-	{
-	    self->rowCapa = (size_t)uint64_deser(val.data);
-	}
-	else
+	while (*text && !iswordchar((unsigned char)*text)) ++text;
+	if (!*text) return 0;
+	const char *start = text;
+	while (iswordchar((unsigned char)*text)) ++text;
+	size_t wordlen = text - start;
+	if (wordlen >= MINWORDLEN && wordlen <= MAXWORDLEN)
 	{
-	    uint8_t sz[8] = { 0 };
-	    val.data = sz;
-	    val.size = 8;
-	    self->db->put(self->db, &id, &val, 0);
-	    self->rowCapa = 0;
-	    needsync = 1;
-	}
-	id.data = (void *)rowUsedKey;
-	if (self->db->get(self->db, &id, &val, 0) == 0 && val.size == 8)
-	{
-	    self->rowUsed = (size_t)uint64_deser(val.data);
-	}
-	else
-	{
-	    uint8_t sz[8] = { 0 };
-	    val.data = sz;
-	    val.size = 8;
-	    self->db->put(self->db, &id, &val, 0);
-	    self->rowUsed = 0;
-	    needsync = 1;
-	}
-	if (self->rowUsed > self->rowCapa)
-	{
-	    self->db->close(self->db);
-	    pthread_mutex_destroy(&self->lock);
-	    free(self);
-	    self = 0;
-	    IBLog_fmt(L_FATAL, "corrupted database file `%s'", filename);
+	    *word = start;
+	    *len = wordlen;
+	    return text;
 	}
-	else if (needsync) self->db->sync(self->db, 0);
-    }
-    else
-    {
-	pthread_mutex_destroy(&self->lock);
-	free(self);
-	self = 0;
-	IBLog_fmt(L_FATAL, "error opening database file `%s'", filename);
     }
-    return self;
 }
 
-InfoDbRow *InfoDb_get(InfoDb *self, const char *key)
+typedef struct WordDelta
 {
-    char *lowerkey = IB_lowerstr(key);
-    DBT id = { lowerkey, strlen(lowerkey) };
-    DBT val = { 0 };
-    InfoDbRow *row = 0;
-    lock(self);
-    if (self->db->get(self->db, &id, &val, 0) != 0) goto done;
-    if (val.size != 8) goto done;
-    id.data = val.data;
-    id.size = 8;
-    if (self->db->get(self->db, &id, &val, 0) != 0) goto done;
-    row = row_deser(val.data, val.size);
-done:
-    free(lowerkey);
-    unlock(self);
-    return row;
-}
+    char *word;
+    int64_t delta;
+} WordDelta;
 
-int InfoDb_put(InfoDb *self, const InfoDbRow *row)
+typedef struct WordDeltas
 {
-    char *lowerkey = IB_lowerstr(row->key);
-    DBT id = { lowerkey, strlen(lowerkey) };
-    DBT val = { 0 };
-    int rc = -1;
-    uint8_t nkey[10] = { 0, 2, 0 };
-    uint8_t szval[8] = { 0 };
-    lock(self);
-    int drc = self->db->get(self->db, &id, &val, 0);
-    if (drc < 0) goto done;
-    if (drc > 0)
+    WordDelta *words;
+    size_t n;
+    size_t capa;
+} WordDeltas;
+
+static void words_add(WordDeltas *self, const char *text, int64_t delta)
+{
+    const char *word;
+    size_t len;
+    while ((text = nextword(text, &word, &len)))
     {
-	if (!IBList_size(row->entries))
+	if (self->n == self->capa)
 	{
-	    rc = 0;
-	    goto done;
-	}
-	DBT nid = { (void *)freeListKey, 2 };
-	DBT nval = { 0 };
-	drc = self->db->get(self->db, &nid, &nval, 0);
-	if (drc < 0) goto done;
-	if (drc == 0)
-	{
-	    if (nval.size != 8) goto done;
-	    memcpy(nkey+2, nval.data, 8);
-	    nid.data = nkey;
-	    nid.size = 10;
-	    drc = self->db->get(self->db, &nid, &nval, 0);
-	    if (drc < 0) goto done;
-	    nid.data = (void *)freeListKey;
-	    nid.size = 2;
-	    if (drc == 0)
-	    {
-		if (self->db->put(self->db, &nid, &nval, 0) < 0) goto done;
-		nid.data = nkey;
-		nid.size = 10;
-		if (self->db->del(self->db, &nid, 0) < 0) goto done;
-	    }
-	    else
-	    {
-		if (self->db->del(self->db, &nid, 0) < 0) goto done;
-	    }
+	    self->capa = self->capa ? 2 * self->capa : 16;
+	    self->words = IB_xrealloc(self->words,
+		    self->capa * sizeof *self->words);
 	}
-	else
+	char *w = scratch_alloc(len + 1);
+	for (size_t i = 0; i < len; ++i)
 	{
-	    uint64_t newkey = (uint64_t)self->rowCapa;
-	    ++self->rowCapa;
-	    uint64_ser(nkey+2, newkey);
-	    uint64_ser(szval, (uint64_t)self->rowCapa);
-	    nval.data = szval;
-	    nval.size = 8;
-	    nid.data = (void *)rowCapaKey;
-	    nid.size = 2;
-	    if (self->db->put(self->db, &nid, &nval, 0) < 0) goto done;
+	    w[i] = tolower((unsigned char)word[i]);
 	}
-	++self->rowUsed;
-	uint64_ser(szval, (uint64_t)self->rowUsed);
-	nval.data = szval;
-	nval.size = 8;
-	nid.data = (void *)rowUsedKey;
-	nid.size = 2;
-	if (self->db->put(self->db, &nid, &nval, 0) < 0) goto done;
-	val.data = nkey+2;
-	val.size = 8;
-	if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
-    }
-    else if (val.size != 8) goto done;
-    else
-    {
-	memcpy(nkey+2, val.data, 8);
+	w[len] = 0;
+	self->words[self->n].word = w;
+	self->words[self->n++].delta = delta;
     }
-    if (!IBList_size(row->entries))
+}
+
+static int cmpworddelta(const void *a, const void *b)
+{
+    return strcmp(((const WordDelta *)a)->word, ((const WordDelta *)b)->word);
+}
+
+/* sorts the words and sums up the deltas of duplicates */
+static void words_merge(WordDeltas *self)
+{
+    if (!self->n) return;
+    qsort(self->words, self->n, sizeof *self->words, cmpworddelta);
+    size_t u = 0;
+    for (size_t i = 1; i < self->n; ++i)
     {
-	if (self->db->del(self->db, &id, 0) < 0) goto done;
-	id.data = (void *)freeListKey;
-	id.size = 2;
-	drc = self->db->get(self->db, &id, &val, 0);
-	if (drc < 0) goto done;
-	if (drc == 0)
+	if (!strcmp(self->words[u].word, self->words[i].word))
 	{
-	    if (val.size != 8) goto done;
-	    id.data = nkey;
-	    id.size = 10;
-	    if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
-	    id.data = (void *)freeListKey;
-	    id.size = 2;
+	    self->words[u].delta += self->words[i].delta;
+	    scratch_free(self->words[i].word);
 	}
-	val.data = nkey+2;
-	val.size = 8;
-	if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
-	id.data = nkey+2;
-	id.size = 8;
-	if (self->db->del(self->db, &id, 0) < 0) goto done;
-	--self->rowUsed;
-	uint64_ser(szval, (uint64_t)self->rowUsed);
-	val.data = szval;
-	val.size = 8;
-	id.data = (void *)rowUsedKey;
-	id.size = 2;
-	if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
+	else self->words[++u] = self->words[i];
     }
-    else
-    {
-	id.data = nkey+2;
-	id.size = 8;
-	uint8_t *serialized = row_ser(row, &val.size);
-	val.data = serialized;
-	drc = self->db->put(self->db, &id, &val, 0);
-	free(serialized);
-	if (drc < 0) goto done;
-    }
-    rc = self->db->sync(self->db, 0);
-done:
-    free(lowerkey);
-    unlock(self);
-    return rc;
+    self->n = u + 1;
 }
 
-int InfoDb_add(InfoDb *self, const char *key, const InfoDbEntry *entry)
+static void words_done(WordDeltas *self)
 {
-    lock(self);
-    InfoDbRow *row = InfoDb_get(self, key);
-    if (!row) 
+    for (size_t i = 0; i < self->n; ++i) scratch_free(self->words[i].word);
+    free(self->words);
+    memset(self, 0, sizeof *self);
+}
+
+/* adds the words of all entries of a serialized row */
+static int words_addrow(WordDeltas *self, const uint8_t *data, size_t datasz,
+	int64_t delta)
+{
+    const char *key;
+    size_t keylen;
+    size_t pos = row_key(data, datasz, &key, &keylen);
+    if (!pos) return -1;
+    RowEntry entry = { .time = 0 };
+    int rc;
+    while ((rc = row_entry(data, datasz, &pos, &entry)) > 0)
     {
-	row = IB_xmalloc(sizeof *row);
-	row->key = IB_copystr(key);
-	row->entries = IBList_create();
+	words_add(self, entry.description, delta);
     }
-    IBList_append(row->entries, (InfoDbEntry *)entry, 0);
-    int rc = InfoDb_put(self, row);
-    InfoDbRow_destroy(row);
-    unlock(self);
     return rc;
 }
 
-InfoDbRow *InfoDb_getRandom(InfoDb *self)
+static uint8_t *wordkey(const char *word, size_t wordlen,
+	const char *lower, size_t lowerlen, size_t *size)
 {
-    if (self->rowUsed == 0) return 0;
+    *size = 3 + wordlen + lowerlen;
+    uint8_t *key = scratch_alloc(*size);
+    key[0] = 0;
+    key[1] = 5;
+    memcpy(key + 2, word, wordlen);
+    key[2 + wordlen] = 0;
+    memcpy(key + 3 + wordlen, lower, lowerlen);
+    return key;
+}
 
-    uint64_t rndid;
-    uint8_t rndkey[8];
-    DBT id = { rndkey, 8 };
-    DBT val = { 0 };
-    InfoDbRow *row = 0;
-    lock(self);
-    for (;;)
-    {
-	getrandom(&rndid, sizeof rndid, 0);
-	rndid %= (uint64_t) self->rowCapa;
-	uint64_ser(rndkey, rndid);
-	int drc = self->db->get(self->db, &id, &val, 0);
-	if (drc < 0) break;
-	if (drc == 0)
-	{
-	    row = row_deser(val.data, val.size);
-	    break;
-	}
-    }
-    unlock(self);
-    return row;
+#define ENTRYKEYSZ(lowerlen) (11 + (lowerlen))
+
+static void entrykey_ser(uint8_t *key, const char *lower, size_t lowerlen,
+	uint64_t seq)
+{
+    key[0] = 0;
+    key[1] = 13;
+    memcpy(key + 2, lower, lowerlen);
+    key[2 + lowerlen] = 0;
+    uint64_ser(key + 3 + lowerlen, seq);
 }
 
-void InfoDb_destroy(InfoDb *self)
+/* the sequence number takes the last 8 bytes, release with scratch_free() */
+static uint8_t *entrykey(const char *lower, size_t lowerlen, uint64_t seq,
+	size_t *size)
 {
-    if (!self) return;
-    self->db->close(self->db);
-    pthread_mutex_destroy(&self->lock);
-    free(self);
+    *size = ENTRYKEYSZ(lowerlen);
+    uint8_t *key = scratch_alloc(*size);
+    entrykey_ser(key, lower, lowerlen, seq);
+    return key;
 }
 
-const char *InfoDbRow_key(const InfoDbRow *self)
+static void authorkey(uint8_t *key, uint32_t id)
 {
-    return self->key;
+    key[0] = 0;
+    key[1] = 10;
+    uint32_ser(key + 2, id);
 }
 
-IBList *InfoDbRow_entries(InfoDbRow *self)
+/* release with scratch_free() */
+static uint8_t *authoridkey(const char *author, size_t authorlen,
+	size_t *size)
 {
-    return self->entries;
+    *size = 2 + authorlen;
+    uint8_t *key = scratch_alloc(*size);
+    key[0] = 0;
+    key[1] = 11;
+    memcpy(key + 2, author, authorlen);
+    return key;
 }
 
-void InfoDbRow_destroy(InfoDbRow *self)
+/* Keys of the author index, the lowercase key and the sequence number
+ * take the last lowerlen + 9 bytes. Release with scratch_free(). */
+static uint8_t *authoredkey(const char *lowerauthor, size_t authorlen,
+	const char *lower, size_t lowerlen, uint64_t seq, size_t *size)
 {
-    if (!self) return;
-    IBList_destroy(self->entries);
-    free(self->key);
-    free(self);
+    *size = 12 + authorlen + lowerlen;
+    uint8_t *key = scratch_alloc(*size);
+    key[0] = 0;
+    key[1] = 12;
+    memcpy(key + 2, lowerauthor, authorlen);
+    key[2 + authorlen] = 0;
+    memcpy(key + 3 + authorlen, lower, lowerlen);
+    key[3 + authorlen + lowerlen] = 0;
+    uint64_ser(key + 4 + authorlen + lowerlen, seq);
+    return key;
 }
 
-InfoDbEntry *InfoDbEntry_create(const char *description, const char *author)
+static char *suffixname(const char *filename, const char *suffix)
 {
-    size_t authorlen = strlen(author);
-    InfoDbEntry *self = IB_xmalloc(sizeof *self
-	    + authorlen + strlen(description) + 2);
-    strcpy(self->content, author);
-    strcpy(self->content + authorlen + 1, description);
-    self->authorlen = authorlen;
-    self->time = time(0);
-    return self;
+    size_t namelen = strlen(filename);
+    size_t suffixlen = strlen(suffix);
+    char *name = IB_xmalloc(namelen + suffixlen + 1);
+    memcpy(name, filename, namelen);
+    memcpy(name + namelen, suffix, suffixlen + 1);
+    return name;
+}
+
+/* The write-ahead log holds records of a type byte, the payload size,
+ * the payload and a checksum. Changes log the key with its old value, so
+ * changes not followed by a commit record can be rolled back after a
+ * crash, and puts also log the new value to redo them. The records of the
+ * running transaction are kept in memory as well. When a change fails
+ * part-way, they are undone and an abort record tells replay to undo them
+ * too.
+ *
+ * The log is only fsynced at commits, but libdb may write dirty pages
+ * back to the database file at any time. That is fine when the process
+ * crashes, because the log records are in the page cache already. After
+ * a power loss, the file may hold changes whose log records were lost,
+ * so those can't be rolled back.
+ *
+ * Replay works on records through the libdb API, so it needs a database
+ * file that is intact as a structure. The image stores save a new file
+ * and rename it. A btree writes its pages back one by one, so a crash
+ * in the middle of a checkpoint's sync can leave a torn tree the log
+ * can't repair. Only backups protect against that. */
+static uint32_t walsum(const uint8_t *data, size_t size)
+{
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < size; ++i)
+    {
+	h ^= data[i];
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static int walwrite(InfoDb *self, uint8_t type, const DBT *id,
+	const DBT *old, const DBT *val)
+{
+    size_t payload = 0;
+    if (id)
+    {
+	payload = varint_size(id->size) + id->size + 1;
+	if (old) payload += varint_size(old->size) + old->size;
+	if (val) payload += varint_size(val->size) + val->size;
+    }
+    size_t size = payload + 9;
+    if (size > self->walbufsz)
+    {
+	self->walbuf = IB_xrealloc(self->walbuf, size);
+	self->walbufsz = size;
+    }
+    uint8_t *p = self->walbuf;
+    *p++ = type;
+    uint32_ser(p, (uint32_t)payload);
+    p += 4;
+    if (id)
+    {
+	p = varint_ser(p, id->size);
+	memcpy(p, id->data, id->size);
+	p += id->size;
+	*p++ = !!old;
+	if (old)
+	{
+	    p = varint_ser(p, old->size);
+	    memcpy(p, old->data, old->size);
+	    p += old->size;
+	}
+	if (val)
+	{
+	    p = varint_ser(p, val->size);
+	    memcpy(p, val->data, val->size);
+	    p += val->size;
+	}
+    }
+    uint32_ser(p, walsum(self->walbuf, size - 4));
+
+    const uint8_t *w = self->walbuf;
+    size_t left = size;
+    while (left)
+    {
+	ssize_t n = write(self->walfd, w, left);
+	if (n < 0)
+	{
+	    if (errno == EINTR) continue;
+	    /* never leave a torn record in front of later ones */
+	    if (ftruncate(self->walfd, (off_t)self->walsize) < 0)
+	    {
+		IBLog_msg(L_ERROR, "cannot truncate write-ahead log");
+	    }
+	    return -1;
+	}
+	w += n;
+	left -= (size_t)n;
+    }
+    if (id)
+    {
+	if (!self->txlogged)
+	{
+	    self->txlogged = 1;
+	    self->txstart = self->walsize;
+	    self->txRowUsed = self->rowUsed;
+	    self->txAuthorCount = self->authorCount;
+	    self->txChangeTag = self->changeTag;
+	}
+	if (self->txloglen + size > self->txlogsz)
+	{
+	    self->txlogsz = 2 * (self->txloglen + size);
+	    self->txlog = IB_xrealloc(self->txlog, self->txlogsz);
+	}
+	memcpy(self->txlog + self->txloglen, self->walbuf, size);
+	self->txloglen += size;
+    }
+    self->walsize += size;
+    return 0;
+}
+
+typedef struct WalRecord
+{
+    uint8_t type;
+    int hasold;
+    DBT id;
+    DBT old;
+    DBT val;
+} WalRecord;
+
+static int dbtdeser(const uint8_t **p, const uint8_t *end, DBT *dbt)
+{
+    uint64_t size;
+    if (!(*p = varint_deser(*p, end, &size))) return -1;
+    if (size > (uint64_t)(end - *p)) return -1;
+    dbt->data = (void *)*p;
+    dbt->size = (size_t)size;
+    *p += size;
+    return 0;
+}
+
+/* returns 0 at the end of the log or at the first damaged record */
+static int walparse(const uint8_t *log, size_t size, size_t *pos,
+	WalRecord *rec)
+{
+    if (size - *pos < 9) return 0;
+    const uint8_t *p = log + *pos;
+    uint32_t payload = uint32_deser(p + 1);
+    if (payload > size - *pos - 9) return 0;
+    if (uint32_deser(p + 5 + payload) != walsum(p, 5 + payload)) return 0;
+    rec->type = p[0];
+    const uint8_t *end = p + 5 + payload;
+    p += 5;
+    if (rec->type != WAL_COMMIT && rec->type != WAL_ABORT)
+    {
+	if (rec->type != WAL_PUT && rec->type != WAL_DEL) return 0;
+	if (dbtdeser(&p, end, &rec->id) < 0 || p == end) return 0;
+	rec->hasold = *p++;
+	if (rec->hasold && dbtdeser(&p, end, &rec->old) < 0) return 0;
+	if (rec->type == WAL_PUT && dbtdeser(&p, end, &rec->val) < 0) return 0;
+    }
+    *pos += 9 + payload;
+    return 1;
+}
+
+/* undoes records in reverse order */
+static int walundo(DB *db, const WalRecord *recs, size_t n)
+{
+    for (size_t i = n; i > 0; --i)
+    {
+	DBT id = recs[i - 1].id;
+	DBT old = recs[i - 1].old;
+	int drc = recs[i - 1].hasold ? db->put(db, &id, &old, 0)
+	    : db->del(db, &id, 0);
+	if (drc < 0) return -1;
+    }
+    return 0;
+}
+
+/* Redoes all committed changes and rolls back aborted transactions and a
+ * trailing uncommitted one, then checkpoints the database and empties
+ * the log. */
+static int walreplay(InfoDb *self, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    if (!st.st_size) return 0;
+    size_t size = (size_t)st.st_size;
+    uint8_t *log = IB_xmalloc(size);
+    WalRecord *tx = 0;
+    size_t ntx = 0;
+    size_t capa = 0;
+    size_t nredo = 0;
+    size_t nundo = 0;
+    int rc = -1;
+    for (size_t got = 0; got < size;)
+    {
+	ssize_t n = pread(fd, log + got, size - got, (off_t)got);
+	if (n < 0 && errno == EINTR) continue;
+	if (n <= 0) goto done;
+	got += (size_t)n;
+    }
+
+    size_t pos = 0;
+    WalRecord rec;
+    while (walparse(log, size, &pos, &rec))
+    {
+	if (rec.type == WAL_COMMIT)
+	{
+	    for (size_t i = 0; i < ntx; ++i)
+	    {
+		int drc = tx[i].type == WAL_PUT
+		    ? self->db->put(self->db, &tx[i].id, &tx[i].val, 0)
+		    : self->db->del(self->db, &tx[i].id, 0);
+		if (drc < 0) goto done;
+	    }
+	    nredo += ntx;
+	    ntx = 0;
+	}
+	else if (rec.type == WAL_ABORT)
+	{
+	    if (walundo(self->db, tx, ntx) < 0) goto done;
+	    nundo += ntx;
+	    ntx = 0;
+	}
+	else
+	{
+	    if (ntx == capa)
+	    {
+		capa = capa ? 2 * capa : 64;
+		tx = IB_xrealloc(tx, capa * sizeof *tx);
+	    }
+	    tx[ntx++] = rec;
+	}
+    }
+    if (walundo(self->db, tx, ntx) < 0) goto done;
+    nundo += ntx;
+    if (self->db->sync(self->db, 0) < 0) goto done;
+    if (ftruncate(fd, 0) < 0 || fsync(fd) < 0) goto done;
+    if (pos < size)
+    {
+	IBLog_fmt(L_WARNING, "ignored %zu damaged bytes at the end of the "
+		"write-ahead log", size - pos);
+    }
+    IBLog_fmt(L_INFO, "write-ahead log replayed: %zu changes redone, "
+	    "%zu uncommitted changes rolled back", nredo, nundo);
+    rc = 0;
+done:
+    free(tx);
+    free(log);
+    return rc;
+}
+
+/* same order as the default btree comparison */
+static int keycmp(const DBT *a, const uint8_t *b, size_t bsz)
+{
+    size_t len = a->size < bsz ? a->size : bsz;
+    int rc = memcmp(a->data, b, len);
+    if (rc) return rc;
+    return (a->size > bsz) - (a->size < bsz);
+}
+
+/* All runtime changes are logged first. While a backup or compaction
+ * runs, changes to records it already copied are applied to the copy as
+ * well. Callers must hold the write lock. */
+static int mirrored(InfoDb *self, const DBT *id)
+{
+    return self->backup && !self->backupFailed && (self->backupComplete
+	    || (self->backupKey
+		&& keycmp(id, self->backupKey, self->backupKeySz) <= 0));
+}
+
+static void stalefacts(InfoDb *self)
+{
+    if (atomic_load(&self->factsCurrent) >= 0)
+    {
+	atomic_store(&self->factsCurrent, -1);
+    }
+}
+
+/* Writes a record, old is the value it replaces or 0 for a new key.
+ * Callers pass what they read anyway, so logging costs no lookup. The
+ * migrations at startup run before the log is opened. */
+static int dbput(InfoDb *self, DBT *id, DBT *val, const DBT *old)
+{
+    size_t txloglen = self->txloglen;
+    stalefacts(self);
+    if (self->walfd >= 0 && walwrite(self, WAL_PUT, id, old, val) < 0)
+    {
+	return -1;
+    }
+    if (mirrored(self, id)
+	    && self->backup->put(self->backup, id, val, 0) < 0)
+    {
+	self->backupFailed = 1;
+    }
+    if (self->db->put(self->db, id, val, 0) == 0) return 0;
+    if (self->backup) self->backupFailed = 1;
+    /* nothing to undo here, but the abort record is still needed */
+    self->txloglen = txloglen;
+    return -1;
+}
+
+/* deletes an existing record, old is its value */
+static int dbdel(InfoDb *self, DBT *id, const DBT *old)
+{
+    size_t txloglen = self->txloglen;
+    stalefacts(self);
+    if (self->walfd >= 0 && walwrite(self, WAL_DEL, id, old, 0) < 0)
+    {
+	return -1;
+    }
+    if (mirrored(self, id) && self->backup->del(self->backup, id, 0) < 0)
+    {
+	self->backupFailed = 1;
+    }
+    if (self->db->del(self->db, id, 0) >= 0) return 0;
+    if (self->backup) self->backupFailed = 1;
+    self->txloglen = txloglen;
+    return -1;
+}
+
+/* applies the word deltas of the row stored under lower to the full-text
+ * index and releases them, callers must hold the write lock */
+static int words_apply(InfoDb *self, WordDeltas *words, const char *lower)
+{
+    int rc = 0;
+    size_t lowerlen = strlen(lower);
+    words_merge(words);
+    for (size_t i = 0; i < words->n && rc == 0; ++i)
+    {
+	if (!words->words[i].delta) continue;
+	size_t keysz;
+	uint8_t *key = wordkey(words->words[i].word,
+		strlen(words->words[i].word), lower, lowerlen, &keysz);
+	DBT id = { key, keysz };
+	DBT val = { 0 };
+	int64_t count = 0;
+	int drc = self->db->get(self->db, &id, &val, 0);
+	if (drc < 0) rc = -1;
+	else
+	{
+	    DBT old = val;
+	    if (drc == 0 && val.size == 8) count = (int64_t)uint64_deser(val.data);
+	    count += words->words[i].delta;
+	    if (count > 0)
+	    {
+		uint8_t ser[8];
+		uint64_ser(ser, (uint64_t)count);
+		val.data = ser;
+		val.size = 8;
+		if (dbput(self, &id, &val, drc == 0 ? &old : 0) < 0) rc = -1;
+	    }
+	    else if (drc == 0 && dbdel(self, &id, &old) < 0) rc = -1;
+	}
+	scratch_free(key);
+    }
+    words_done(words);
+    return rc;
+}
+
+static int view_init(InfoDbRowView *view)
+{
+    size_t keylen;
+    size_t pos = row_key(view->data, view->size, &view->key, &keylen);
+    if (!pos) return -1;
+    view->first = pos;
+    RowEntry entry = { .time = 0 };
+    int rc;
+    while ((rc = row_entry(view->data, view->size, &pos, &entry)) > 0);
+    if (rc < 0) return -1;
+    atomic_init(&view->refcnt, 1);
+    atomic_init(&view->row, 0);
+    return 0;
+}
+
+/* returns a reference to the decoded row, decoding it on first use */
+static InfoDbRow *view_row(InfoDbRowView *view)
+{
+    InfoDbRow *row = atomic_load_explicit(&view->row, memory_order_acquire);
+    if (!row)
+    {
+	InfoDbRow *decoded = row_deser(view->data, view->size);
+	if (!decoded) return 0;
+	if (atomic_compare_exchange_strong_explicit(&view->row, &row,
+		    decoded, memory_order_acq_rel, memory_order_acquire))
+	{
+	    row = decoded;
+	}
+	else InfoDbRow_destroy(decoded);
+    }
+    return row_retain(row);
+}
+
+static void *view_retain(void *obj)
+{
+    InfoDbRowView *view = obj;
+    atomic_fetch_add_explicit(&view->refcnt, 1, memory_order_relaxed);
+    return view;
+}
+
+static void view_release(void *obj)
+{
+    InfoDbRowView_destroy(obj);
+}
+
+static void freebufs(void *arg)
+{
+    (void)arg;
+    free(fetchBuf);
+    free(loadBuf);
+    free(recordBuf);
+}
+
+static void createbufkey(void)
+{
+    pthread_key_create(&bufKey, freebufs);
+}
+
+/* grows a per-thread buffer, they are released when the thread exits */
+static uint8_t *growbuf(uint8_t **buf, size_t *bufsz, size_t size)
+{
+    if (size > *bufsz)
+    {
+	if (!fetchBuf && !loadBuf && !recordBuf)
+	{
+	    pthread_once(&bufKeyOnce, createbufkey);
+	    pthread_setspecific(bufKey, &bufKey);
+	}
+	*bufsz = 2 * size;
+	*buf = IB_xrealloc(*buf, *bufsz);
+    }
+    return *buf;
+}
+
+/* lock wait times go to the statistics, uncontended locks count as zero */
+static void readlock(InfoDb *self)
+{
+    if (pthread_rwlock_tryrdlock(&self->lock) == 0)
+    {
+	Stats_add(ST_READLOCK, 0);
+	return;
+    }
+    uint64_t tstart = Stats_now();
+    pthread_rwlock_rdlock(&self->lock);
+    Stats_record(ST_READLOCK, tstart);
+}
+
+static void writelock(InfoDb *self)
+{
+    if (pthread_rwlock_trywrlock(&self->lock) == 0)
+    {
+	Stats_add(ST_WRITELOCK, 0);
+	return;
+    }
+    uint64_t tstart = Stats_now();
+    pthread_rwlock_wrlock(&self->lock);
+    Stats_record(ST_WRITELOCK, tstart);
+}
+
+static void lockdb(InfoDb *self)
+{
+    if (pthread_mutex_trylock(&self->dblock) == 0)
+    {
+	Stats_add(ST_DBLOCK, 0);
+	return;
+    }
+    uint64_t tstart = Stats_now();
+    pthread_mutex_lock(&self->dblock);
+    Stats_record(ST_DBLOCK, tstart);
+}
+
+static int fetch(InfoDb *self, const void *key, size_t keysz, DBT *val)
+{
+    DBT id = { (void *)key, keysz };
+    lockdb(self);
+    int rc = self->db->get(self->db, &id, val, 0);
+    if (rc == 0)
+    {
+	uint8_t *buf = growbuf(&fetchBuf, &fetchBufSize, val->size);
+	if (val->size) memcpy(buf, val->data, val->size);
+	val->data = buf;
+    }
+    pthread_mutex_unlock(&self->dblock);
+    return rc;
+}
+
+/* looks up the nick of an author id, it is valid until the next call on
+ * the database */
+static int authorname(const DB *db, uint32_t id, DBT *name)
+{
+    uint8_t key[AUTHORKEYSZ];
+    authorkey(key, id);
+    DBT aid = { key, AUTHORKEYSZ };
+    int drc = db->get(db, &aid, name, 0);
+    if (drc == 0 && memchr(name->data, 0, name->size)) return -1;
+    return drc;
+}
+
+/* Assembles a row from its head and a range scan over its entry records
+ * into a new view, which still needs view_init(). Authors are resolved
+ * from the dictionary right into the row, consecutive entries by the
+ * same author copy the name from the previous one. Callers reading from
+ * the database must hold dblock or the write lock. If head is given, it
+ * receives a copy of the row head the caller must free. Returns 1 if
+ * there is no such row. */
+static int loadview(const DB *db, const char *lower, size_t lowerlen,
+	DBT *head, InfoDbRowView **view)
+{
+    DBT id = { (void *)lower, lowerlen };
+    DBT val = { 0 };
+    int drc = db->get(db, &id, &val, 0);
+    if (drc != 0) return drc;
+    if (val.size <= ROWPREFIXSZ) return -1;
+    if (head)
+    {
+	head->data = IB_xmalloc(val.size);
+	head->size = val.size;
+	memcpy(head->data, val.data, val.size);
+    }
+    size_t size = val.size - ROWPREFIXSZ;
+    uint8_t *data = growbuf(&loadBuf, &loadBufSize, size);
+    memcpy(data, (const uint8_t *)val.data + ROWPREFIXSZ, size);
+    uint8_t keybuf[ENTRYKEYSZ(KEYBUFSZ)];
+    size_t keysz = ENTRYKEYSZ(lowerlen);
+    uint8_t *key = keysz <= sizeof keybuf ? keybuf : scratch_alloc(keysz);
+    entrykey_ser(key, lower, lowerlen, 0);
+    size_t prefixsz = keysz - 8;
+    int64_t prev = 0;
+    size_t authoroff = 0;
+    size_t authorlen = 0;
+    uint32_t authorid = 0;
+    int hasauthor = 0;
+    id.data = key;
+    id.size = keysz;
+    for (drc = db->seq(db, &id, &val, R_CURSOR); drc == 0;
+	    drc = db->seq(db, &id, &val, R_NEXT))
+    {
+	if (id.size != keysz || memcmp(id.data, key, prefixsz)) break;
+	/* the author lookup invalidates the record */
+	uint8_t *record = growbuf(&recordBuf, &recordBufSize, val.size + 1);
+	if (val.size) memcpy(record, val.data, val.size);
+	RowEntry entry = { .time = 0 };
+	uint32_t entryauthor;
+	if (record_deser(record, val.size, &entry, &entryauthor) < 0)
+	{
+	    drc = -1;
+	    break;
+	}
+	DBT name = { 0 };
+	if (!hasauthor || entryauthor != authorid)
+	{
+	    if (authorname(db, entryauthor, &name) != 0)
+	    {
+		drc = -1;
+		break;
+	    }
+	    authorlen = name.size;
+	}
+	int64_t delta = entry.time - prev;
+	size_t entrysz = entry_size(delta, authorlen, entry.desclen);
+	data = growbuf(&loadBuf, &loadBufSize, size + entrysz);
+	if (!name.data) name.data = data + authoroff;
+	size_t nameoff = size + varint_size(zigzag(delta))
+	    + varint_size(authorlen);
+	entry_ser(data + size, delta, name.data, authorlen,
+		entry.description, entry.desclen);
+	authoroff = nameoff;
+	authorid = entryauthor;
+	hasauthor = 1;
+	size += entrysz;
+	prev = entry.time;
+    }
+    if (key != keybuf) scratch_free(key);
+    if (drc < 0) return -1;
+    InfoDbRowView *loaded = IB_xmalloc(sizeof *loaded + size);
+    memcpy(loaded->data, data, size);
+    loaded->size = size;
+    *view = loaded;
+    return 0;
+}
+
+/* lets loadview() read rows from a fact index */
+typedef struct ImageCursor
+{
+    const DbImage *image;
+    size_t pos;
+} ImageCursor;
+
+static int imageget(const DB *db, const DBT *key, DBT *val, unsigned flags)
+{
+    (void)flags;
+    const ImageCursor *cursor = db->internal;
+    int found;
+    size_t i = DbImage_find(cursor->image, key, &found);
+    if (!found) return 1;
+    DBT ikey;
+    DbImage_record(cursor->image, i, &ikey, val);
+    return 0;
+}
+
+static int imageseq(const DB *db, DBT *key, DBT *val, unsigned flags)
+{
+    ImageCursor *cursor = db->internal;
+    int found;
+    if (flags == R_CURSOR)
+    {
+	cursor->pos = DbImage_find(cursor->image, key, &found);
+    }
+    else ++cursor->pos;
+    if (cursor->pos >= DbImage_count(cursor->image)) return 1;
+    DbImage_record(cursor->image, cursor->pos, key, val);
+    return 0;
+}
+
+static InfoDbRowView *fetchview(InfoDb *self, const char *lowerkey)
+{
+    InfoDbRowView *view = 0;
+    lockdb(self);
+    loadview(self->db, lowerkey, strlen(lowerkey), 0, &view);
+    pthread_mutex_unlock(&self->dblock);
+    if (view && view_init(view) < 0)
+    {
+	free(view);
+	view = 0;
+    }
+    return view;
+}
+
+/* The fact index is an image of all rows with their entries and the
+ * change tag, written in the background once writes have settled.
+ * Readers use it without any locks: they announce themselves on the slot
+ * of the current image, and an image is only replaced after all readers
+ * left its slot. Every change marks the index stale until a new one is
+ * written. */
+static int factsenter(InfoDb *self)
+{
+    for (;;)
+    {
+	int slot = atomic_load(&self->factsCurrent);
+	if (slot < 0) return -1;
+	atomic_fetch_add(&self->factsReaders[slot], 1);
+	if (atomic_load(&self->factsCurrent) == slot) return slot;
+	atomic_fetch_sub(&self->factsReaders[slot], 1);
+    }
+}
+
+static void factsleave(InfoDb *self, int slot)
+{
+    atomic_fetch_sub(&self->factsReaders[slot], 1);
+}
+
+static uint64_t factstag(const DbImage *image)
+{
+    DBT id = { (void *)changeKey, sizeof changeKey };
+    DBT val;
+    int found;
+    size_t i = DbImage_find(image, &id, &found);
+    if (!found) return 0;
+    DbImage_record(image, i, &id, &val);
+    return val.size == 8 ? uint64_deser(val.data) : 0;
+}
+
+static void installfacts(InfoDb *self, DbImage *image, uint64_t tag)
+{
+    int slot = !self->factsSlot;
+    while (atomic_load(&self->factsReaders[slot])) sched_yield();
+    DbImage_destroy(self->facts[slot]);
+    self->facts[slot] = image;
+    self->factsSlot = slot;
+    readlock(self);
+    if (tag == self->changeTag) atomic_store(&self->factsCurrent, slot);
+    pthread_rwlock_unlock(&self->lock);
+}
+
+typedef struct FactsSource
+{
+    InfoDb *db;
+    uint64_t tag;
+    int changed;
+    uint8_t *key;
+    size_t keysz;
+    uint8_t *val;
+    size_t valsz;
+    size_t keycapa;
+    size_t valcapa;
+} FactsSource;
+
+/* the fact index holds the rows, their entry records, the author
+ * dictionary and the change tag */
+static int infacts(const DBT *id)
+{
+    const uint8_t *key = id->data;
+    if (key[0]) return 1;
+    if (id->size < 2) return 0;
+    return key[1] == 10 || key[1] == 13
+	|| !keycmp(id, changeKey, sizeof changeKey);
+}
+
+/* Feeds the records of the fact index to DbImage_save(). Readers and
+ * writers keep using the database meanwhile, so the cursor is positioned
+ * again for every record, and records are copied out under the read lock
+ * and dblock. Every change commits a new tag before releasing the write
+ * lock, so the records read so far are consistent as long as the tag is
+ * the one the build started with. Otherwise the build is abandoned. */
+static int factsseq(const DB *db, DBT *key, DBT *val, unsigned flags)
+{
+    FactsSource *src = db->internal;
+    InfoDb *self = src->db;
+    DBT id = { (void *)changeKey, sizeof changeKey };
+    if (flags == R_NEXT)
+    {
+	id.data = src->key;
+	id.size = src->keysz;
+    }
+    /* taken per record, so it stays out of the lock statistics */
+    pthread_rwlock_rdlock(&self->lock);
+    if (self->changeTag != src->tag)
+    {
+	pthread_rwlock_unlock(&self->lock);
+	src->changed = 1;
+	return -1;
+    }
+    lockdb(self);
+    int drc = self->db->seq(self->db, &id, val, R_CURSOR);
+    if (drc == 0 && flags == R_NEXT && !keycmp(&id, src->key, src->keysz))
+    {
+	drc = self->db->seq(self->db, &id, val, R_NEXT);
+    }
+    while (drc == 0 && !infacts(&id))
+    {
+	drc = self->db->seq(self->db, &id, val, R_NEXT);
+    }
+    if (drc == 0)
+    {
+	if (id.size > src->keycapa)
+	{
+	    src->keycapa = id.size;
+	    src->key = IB_xrealloc(src->key, src->keycapa);
+	}
+	if (val->size > src->valcapa)
+	{
+	    src->valcapa = val->size;
+	    src->val = IB_xrealloc(src->val, src->valcapa);
+	}
+	memcpy(src->key, id.data, id.size);
+	src->keysz = id.size;
+	if (val->size) memcpy(src->val, val->data, val->size);
+	src->valsz = val->size;
+	key->data = src->key;
+	key->size = src->keysz;
+	val->data = src->val;
+	val->size = src->valsz;
+    }
+    pthread_mutex_unlock(&self->dblock);
+    pthread_rwlock_unlock(&self->lock);
+    return drc;
+}
+
+/* writes and maps a new fact index without blocking writers, a change
+ * meanwhile means the index is stale anyway, so it is given up and
+ * written again once writes settle */
+static int buildfacts(InfoDb *self)
+{
+    uint64_t tstart = Stats_now();
+    FactsSource src = { .db = self };
+    DB source = { .internal = &src, .seq = factsseq };
+    readlock(self);
+    uint64_t tag = self->changeTag;
+    pthread_rwlock_unlock(&self->lock);
+    src.tag = tag;
+    int rc = DbImage_save(self->factsFile, &source);
+    free(src.key);
+    free(src.val);
+    if (src.changed)
+    {
+	IBLog_msg(L_DEBUG, "database changed while writing the fact index");
+	return -1;
+    }
+    DbImage *image = 0;
+    if (rc == 0)
+    {
+	int fd = open(self->factsFile, O_RDONLY);
+	if (fd >= 0)
+	{
+	    image = DbImage_map(fd);
+	    close(fd);
+	}
+    }
+    if (!image)
+    {
+	IBLog_fmt(L_ERROR, "cannot write fact index `%s'", self->factsFile);
+	return -1;
+    }
+    installfacts(self, image, tag);
+    IBLog_fmt(L_DEBUG, "fact index written in %.2fs",
+	    (double)(Stats_now() - tstart) / 1e9);
+    return 0;
+}
+
+/* maps an existing fact index if it matches the database */
+static void loadfacts(InfoDb *self)
+{
+    int fd = open(self->factsFile, O_RDONLY);
+    if (fd < 0) return;
+    DbImage *image = DbImage_map(fd);
+    close(fd);
+    if (!image) return;
+    if (factstag(image) != self->changeTag)
+    {
+	DbImage_destroy(image);
+	return;
+    }
+    self->facts[0] = image;
+    self->factsSlot = 0;
+    atomic_store(&self->factsCurrent, 0);
+}
+
+static void *factsthread(void *arg)
+{
+    InfoDb *self = arg;
+    pthread_mutex_lock(&self->factsLock);
+    while (!self->factsStopping)
+    {
+	if (!self->factsWanted)
+	{
+	    pthread_cond_wait(&self->factsCond, &self->factsLock);
+	    continue;
+	}
+	struct timespec due = self->factsDue;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec < due.tv_sec
+		|| (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec))
+	{
+	    pthread_cond_timedwait(&self->factsCond, &self->factsLock, &due);
+	    continue;
+	}
+	self->factsWanted = 0;
+	pthread_mutex_unlock(&self->factsLock);
+	buildfacts(self);
+	pthread_mutex_lock(&self->factsLock);
+    }
+    pthread_mutex_unlock(&self->factsLock);
+    return 0;
+}
+
+/* schedules a new fact index once there were no writes for a while */
+static void wantfacts(InfoDb *self)
+{
+    pthread_mutex_lock(&self->factsLock);
+    clock_gettime(CLOCK_REALTIME, &self->factsDue);
+    self->factsDue.tv_sec += FACTSDELAY;
+    if (!self->factsWanted)
+    {
+	self->factsWanted = 1;
+	pthread_cond_signal(&self->factsCond);
+    }
+    pthread_mutex_unlock(&self->factsLock);
+}
+
+/* Returns -1 if there is no current fact index. Found rows go to the
+ * row cache. Writers mark the index stale before they evict changed rows,
+ * so a row cached while the index is still current afterwards is evicted
+ * by them. Otherwise it is evicted here. The image can't be replaced
+ * before the slot is left. */
+static int factsview(InfoDb *self, const char *lowerkey, InfoDbRowView **view)
+{
+    int slot = factsenter(self);
+    if (slot < 0) return -1;
+    ImageCursor cursor = { self->facts[slot], 0 };
+    DB image = { .internal = &cursor, .get = imageget, .seq = imageseq };
+    *view = 0;
+    loadview(&image, lowerkey, strlen(lowerkey), 0, view);
+    if (*view && view_init(*view) < 0)
+    {
+	free(*view);
+	*view = 0;
+    }
+    if (*view)
+    {
+	RowCache_put(self->cache, lowerkey, *view);
+	if (atomic_load(&self->factsCurrent) != slot)
+	{
+	    RowCache_evict(self->cache, lowerkey);
+	}
+    }
+    factsleave(self, slot);
+    return 0;
+}
+
+/* rows follow the metadata, which all starts with a NUL byte */
+static void factsrange(const DbImage *facts, const char *from,
+	const char *to, size_t *first, size_t *end)
+{
+    static const uint8_t firstKey[] = { 1 };
+    DBT id = { (void *)firstKey, sizeof firstKey };
+    int found;
+    *first = DbImage_find(facts, &id, &found);
+    *end = DbImage_count(facts);
+    if (from)
+    {
+	id.data = (void *)from;
+	id.size = strlen(from);
+	size_t pos = DbImage_find(facts, &id, &found);
+	if (pos > *first) *first = pos;
+    }
+    if (to)
+    {
+	id.data = (void *)to;
+	id.size = strlen(to);
+	*end = DbImage_find(facts, &id, &found);
+    }
+}
+
+static int factsrandom(InfoDb *self, const char *from, const char *to,
+	InfoDbRowView **view)
+{
+    int slot = factsenter(self);
+    if (slot < 0) return -1;
+    const DbImage *facts = self->facts[slot];
+    ImageCursor cursor = { facts, 0 };
+    DB image = { .internal = &cursor, .get = imageget, .seq = imageseq };
+    DBT id;
+    DBT val;
+    size_t first;
+    size_t end;
+    factsrange(facts, from, to, &first, &end);
+    *view = 0;
+    if (first < end)
+    {
+	DbImage_record(facts, first + (size_t)prng_below(end - first),
+		&id, &val);
+	loadview(&image, id.data, id.size, 0, view);
+    }
+    factsleave(self, slot);
+    if (*view && view_init(*view) < 0)
+    {
+	free(*view);
+	*view = 0;
+    }
+    return 0;
+}
+
+/* keys the filter rules out are answered without touching the database */
+static InfoDbRowView *getview(InfoDb *self, const char *lowerkey)
+{
+    InfoDbRowView *view = RowCache_get(self->cache, lowerkey);
+    if (view) return view;
+    if (factsview(self, lowerkey, &view) == 0) return view;
+    readlock(self);
+    if (self->filter
+	    && !KeyFilter_contains(self->filter, lowerkey, strlen(lowerkey)))
+    {
+	atomic_fetch_add_explicit(&self->filterRejected, 1,
+		memory_order_relaxed);
+    }
+    else if ((view = fetchview(self, lowerkey)))
+    {
+	RowCache_put(self->cache, lowerkey, view);
+    }
+    else if (self->filter)
+    {
+	atomic_fetch_add_explicit(&self->filterFalse, 1,
+		memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&self->lock);
+    return view;
+}
+
+static int inrange(const char *key, const char *from, const char *to)
+{
+    return (!from || strcmp(key, from) >= 0) && (!to || strcmp(key, to) < 0);
+}
+
+static int idinrange(const DBT *id, const char *from, const char *to)
+{
+    return (!from || keycmp(id, (const uint8_t *)from, strlen(from)) >= 0)
+	&& (!to || keycmp(id, (const uint8_t *)to, strlen(to)) < 0);
+}
+
+/* lowercases the optional bounds of a key range like keys are stored */
+static void lowerrange(const char **from, const char **to,
+	char *frombuf, char *tobuf)
+{
+    if (*from) *from = tolowerkey(*from, frombuf);
+    if (*to) *to = tolowerkey(*to, tobuf);
+}
+
+static void freerange(const char *from, const char *to,
+	char *frombuf, char *tobuf)
+{
+    if (from) freekey((char *)from, frombuf);
+    if (to) freekey((char *)to, tobuf);
+}
+
+/* Visits the keys of the rows in [from, to) in slices, like foreach.
+ * The locks are only held for a slice, so a scan doesn't stall writers
+ * and lookups. Callers must not hold the read lock. */
+static int scanrange(InfoDb *self, const char *from, const char *to,
+	void (*visit)(void *ctx, const DBT *id), void *ctx)
+{
+    static const uint8_t firstKey[] = { 1 };
+    uint8_t *resume = 0;
+    size_t resumesz = 0;
+    int drc = 0;
+    while (drc == 0)
+    {
+	DBT id = { (void *)firstKey, sizeof firstKey };
+	DBT val;
+	if (resume)
+	{
+	    id.data = resume;
+	    id.size = resumesz;
+	}
+	else if (from && *from)
+	{
+	    id.data = (void *)from;
+	    id.size = strlen(from);
+	}
+	readlock(self);
+	lockdb(self);
+	drc = self->db->seq(self->db, &id, &val, R_CURSOR);
+	if (drc == 0 && resume && !keycmp(&id, resume, resumesz))
+	{
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT);
+	}
+	for (size_t n = 0; drc == 0;
+		drc = self->db->seq(self->db, &id, &val, R_NEXT))
+	{
+	    if (to && keycmp(&id, (const uint8_t *)to, strlen(to)) >= 0)
+	    {
+		drc = 1;
+		break;
+	    }
+	    visit(ctx, &id);
+	    if (++n == FOREACHSLICE)
+	    {
+		resume = IB_xrealloc(resume, id.size);
+		memcpy(resume, id.data, id.size);
+		resumesz = id.size;
+		break;
+	    }
+	}
+	pthread_mutex_unlock(&self->dblock);
+	pthread_rwlock_unlock(&self->lock);
+    }
+    free(resume);
+    return drc < 0 ? -1 : 0;
+}
+
+static void countrow(void *ctx, const DBT *id)
+{
+    (void)id;
+    ++*(size_t *)ctx;
+}
+
+typedef struct RowPick
+{
+    uint64_t seen;
+    char *key;
+} RowPick;
+
+/* keeps each visited row with the same probability */
+static void pickrow(void *ctx, const DBT *id)
+{
+    RowPick *pick = ctx;
+    if (prng_below(++pick->seen)) return;
+    pick->key = IB_xrealloc(pick->key, id->size + 1);
+    memcpy(pick->key, id->data, id->size);
+    pick->key[id->size] = 0;
+}
+
+/* uniform pick from all rows in the range, for ranges the random slots
+ * keep missing, callers must not hold the read lock */
+static InfoDbRowView *scanrandom(InfoDb *self, const char *from,
+	const char *to)
+{
+    InfoDbRowView *view = 0;
+    for (int i = 0; !view && i < RANGETRIES; ++i)
+    {
+	RowPick pick = { 0, 0 };
+	if (scanrange(self, from, to, pickrow, &pick) < 0 || !pick.key) break;
+	/* the row may be gone by now, then scan again */
+	readlock(self);
+	view = fetchview(self, pick.key);
+	pthread_rwlock_unlock(&self->lock);
+	free(pick.key);
+    }
+    return view;
+}
+
+/* number of rows in [from, to), either bound may be 0 */
+static size_t rangecount(InfoDb *self, const char *from, const char *to)
+{
+    size_t first;
+    size_t end;
+    int slot = factsenter(self);
+    if (slot >= 0)
+    {
+	factsrange(self->facts[slot], from, to, &first, &end);
+	factsleave(self, slot);
+	return first < end ? end - first : 0;
+    }
+    size_t n = 0;
+    scanrange(self, from, to, countrow, &n);
+    return n;
+}
+
+/* draws one of all rows uniformly, 0 if it isn't in [from, to), callers
+ * must hold the read lock */
+static InfoDbRowView *slotview(InfoDb *self, const char *from,
+	const char *to)
+{
+    uint8_t skey[SLOTKEYSZ];
+    DBT val = { 0 };
+    InfoDbRowView *view = 0;
+    if (!self->rowUsed) return 0;
+    slotkey(skey, prng_below((uint64_t)self->rowUsed));
+    if (fetch(self, skey, SLOTKEYSZ, &val) == 0)
+    {
+	char keybuf[KEYBUFSZ];
+	char *key = val.size < KEYBUFSZ ? keybuf
+	    : scratch_alloc(val.size + 1);
+	memcpy(key, val.data, val.size);
+	key[val.size] = 0;
+	if (inrange(key, from, to))
+	{
+	    view = RowCache_get(self->cache, key);
+	    if (!view) view = fetchview(self, key);
+	}
+	freekey(key, keybuf);
+    }
+    return view;
+}
+
+/* picks a random row with a key in [from, to), either bound may be 0 */
+static InfoDbRowView *randomview(InfoDb *self, const char *from,
+	const char *to)
+{
+    InfoDbRowView *view = 0;
+    uint64_t tstart = Stats_now();
+    if (factsrandom(self, from, to, &view) == 0)
+    {
+	Stats_record(ST_DBRANDOM, tstart);
+	return view;
+    }
+    int tries = from || to ? RANGETRIES : 1;
+    readlock(self);
+    for (int i = 0; !view && i < tries; ++i) view = slotview(self, from, to);
+    int scan = !view && tries > 1 && self->rowUsed;
+    pthread_rwlock_unlock(&self->lock);
+    if (scan) view = scanrandom(self, from, to);
+    Stats_record(ST_DBRANDOM, tstart);
+    return view;
+}
+
+/* old is the current value, 0 if the counter doesn't exist yet */
+static int putcounter(InfoDb *self, const uint8_t *key, uint64_t value,
+	const uint64_t *old)
+{
+    uint8_t ser[8];
+    uint8_t oldser[8];
+    uint64_ser(ser, value);
+    if (old) uint64_ser(oldser, *old);
+    DBT id = { (void *)key, 2 };
+    DBT val = { ser, 8 };
+    DBT oldval = { oldser, 8 };
+    return dbput(self, &id, &val, old ? &oldval : 0);
+}
+
+/* replaces the change tag by a new random one */
+static int changetag(InfoDb *self)
+{
+    uint64_t tag = prng_next();
+    if (putcounter(self, changeKey, tag, &self->changeTag) < 0) return -1;
+    self->changeTag = tag;
+    return 0;
+}
+
+/* oldkey is the key the slot held, 0 for a new slot */
+static int putslot(InfoDb *self, uint64_t slot, const char *lowerkey,
+	const char *oldkey)
+{
+    uint8_t skey[SLOTKEYSZ];
+    slotkey(skey, slot);
+    DBT id = { skey, SLOTKEYSZ };
+    DBT val = { (void *)lowerkey, strlen(lowerkey) };
+    DBT old = { (void *)oldkey, oldkey ? strlen(oldkey) : 0 };
+    return dbput(self, &id, &val, oldkey ? &old : 0);
+}
+
+/* Replaces a key filter that ran full by a larger one. If the rows can't
+ * be read, lookups go without a filter. Callers must hold the write lock
+ * or be the only user. */
+static void growfilter(InfoDb *self)
+{
+    static const uint8_t firstKey[] = { 1 };
+    KeyFilter *filter = KeyFilter_create(2 * self->rowUsed);
+    DBT id = { (void *)firstKey, sizeof firstKey };
+    DBT val = { 0 };
+    int drc;
+    for (drc = self->db->seq(self->db, &id, &val, R_CURSOR); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (KeyFilter_add(filter, id.data, id.size) < 0)
+	{
+	    drc = -1;
+	    break;
+	}
+    }
+    KeyFilter_destroy(self->filter);
+    self->filter = 0;
+    if (drc < 0)
+    {
+	KeyFilter_destroy(filter);
+	IBLog_msg(L_WARNING, "cannot rebuild key filter, disabled");
+	return;
+    }
+    self->filter = filter;
+}
+
+/* undoes one logged change, including the key index and filter when it
+ * created or deleted a row */
+static int undo(InfoDb *self, const WalRecord *rec)
+{
+    DBT id = rec->id;
+    DBT old = rec->old;
+    int mirror = mirrored(self, &id);
+    int drc;
+    if (rec->hasold)
+    {
+	if (mirror && self->backup->put(self->backup, &id, &old, 0) < 0)
+	{
+	    self->backupFailed = 1;
+	}
+	drc = self->db->put(self->db, &id, &old, 0);
+    }
+    else
+    {
+	if (mirror && self->backup->del(self->backup, &id, 0) < 0)
+	{
+	    self->backupFailed = 1;
+	}
+	drc = self->db->del(self->db, &id, 0);
+    }
+    if (drc < 0) return -1;
+    /* all other records have keys starting with a 0 byte */
+    if (!id.size || !*(const uint8_t *)id.data) return 0;
+    const char *lower = id.data;
+    if (rec->type == WAL_DEL)
+    {
+	KeyIndex_add(self->keys, lower, id.size);
+	if (self->filter && KeyFilter_add(self->filter, lower, id.size) < 0)
+	{
+	    growfilter(self);
+	}
+    }
+    else if (!rec->hasold)
+    {
+	KeyIndex_remove(self->keys, lower, id.size);
+	if (self->filter) KeyFilter_remove(self->filter, lower, id.size);
+    }
+    char keybuf[KEYBUFSZ];
+    char *key = id.size < KEYBUFSZ ? keybuf : scratch_alloc(id.size + 1);
+    memcpy(key, lower, id.size);
+    key[id.size] = 0;
+    RowCache_evict(self->cache, key);
+    freekey(key, keybuf);
+    return 0;
+}
+
+/* Undoes the changes of a transaction that failed part-way, so neither
+ * the database nor the in-memory state keeps half of it, and logs an
+ * abort record, so replay undoes them as well. Callers must hold the
+ * write lock. */
+static void rollback(InfoDb *self)
+{
+    if (!self->txlogged) return;
+    WalRecord *recs = 0;
+    size_t nrecs = 0;
+    size_t capa = 0;
+    size_t pos = 0;
+    WalRecord rec;
+    while (walparse(self->txlog, self->txloglen, &pos, &rec))
+    {
+	if (nrecs == capa)
+	{
+	    capa = capa ? 2 * capa : 16;
+	    recs = IB_xrealloc(recs, capa * sizeof *recs);
+	}
+	recs[nrecs++] = rec;
+    }
+    int rc = 0;
+    for (size_t i = nrecs; i > 0; --i)
+    {
+	if (undo(self, recs + i - 1) < 0) rc = -1;
+    }
+    free(recs);
+    if (rc < 0) IBLog_msg(L_ERROR, "cannot roll back a failed change");
+    self->rowUsed = self->txRowUsed;
+    self->authorCount = self->txAuthorCount;
+    self->changeTag = self->txChangeTag;
+    self->txloglen = 0;
+    self->txlogged = 0;
+    stalefacts(self);
+    if (walwrite(self, WAL_ABORT, 0, 0, 0) == 0) return;
+    /* without the abort record, the next commit would redo the changes */
+    pthread_mutex_lock(&self->walSyncLock);
+    if (ftruncate(self->walfd, (off_t)self->txstart) == 0)
+    {
+	self->walsize = self->txstart;
+    }
+    else IBLog_msg(L_ERROR, "cannot discard a failed change from the "
+	    "write-ahead log");
+    pthread_mutex_unlock(&self->walSyncLock);
+}
+
+/* deletes the row stored under lower, head is its current head */
+static int delrow(InfoDb *self, const char *lower, uint64_t slot,
+	const DBT *head)
+{
+    uint8_t skey[SLOTKEYSZ];
+    DBT id = { (void *)lower, strlen(lower) };
+    DBT sid = { skey, SLOTKEYSZ };
+    DBT val = { 0 };
+    uint64_t used = (uint64_t)self->rowUsed;
+    uint64_t last = used - 1;
+    char keybuf[KEYBUFSZ];
+    char *lastkey = (char *)lower;
+    uint8_t *moved = 0;
+    int rc = -1;
+    if (dbdel(self, &id, head) < 0) return -1;
+    KeyIndex_remove(self->keys, lower, id.size);
+    if (self->filter) KeyFilter_remove(self->filter, lower, id.size);
+    slotkey(skey, last);
+    if (slot != last)
+    {
+	/* keep slots dense by moving the last row into the freed slot */
+	if (self->db->get(self->db, &sid, &val, 0) != 0) return -1;
+	lastkey = val.size < KEYBUFSZ ? keybuf : scratch_alloc(val.size + 1);
+	memcpy(lastkey, val.data, val.size);
+	lastkey[val.size] = 0;
+	DBT mid = { lastkey, val.size };
+	DBT old = { 0 };
+	if (self->db->get(self->db, &mid, &old, 0) != 0
+		|| old.size <= ROWPREFIXSZ) goto done;
+	moved = IB_xmalloc(old.size);
+	memcpy(moved, old.data, old.size);
+	uint64_ser(moved, slot);
+	val.data = moved;
+	val.size = old.size;
+	if (dbput(self, &mid, &val, &old) < 0
+		|| putslot(self, slot, lastkey, lower) < 0) goto done;
+    }
+    DBT lastval = { lastkey, strlen(lastkey) };
+    if (dbdel(self, &sid, &lastval) < 0
+	    || putcounter(self, rowUsedKey, last, &used) < 0) goto done;
+    --self->rowUsed;
+    rc = 0;
+done:
+    free(moved);
+    if (lastkey != lower) freekey(lastkey, keybuf);
+    return rc;
+}
+
+/* writes the head of the row stored under lower, old is its current head
+ * or 0 for a new row, callers must hold the write lock */
+static int puthead(InfoDb *self, const char *lower, const DBT *old,
+	uint64_t slot, uint64_t nextseq, const char *key, size_t keylen)
+{
+    if (!old) slot = (uint64_t)self->rowUsed;
+    size_t headsz = ROWPREFIXSZ + header_size(keylen);
+    uint8_t *head = scratch_alloc(headsz);
+    uint64_ser(head, slot);
+    uint64_ser(head + 8, nextseq);
+    header_ser(head + ROWPREFIXSZ, key, keylen);
+    DBT id = { (void *)lower, strlen(lower) };
+    DBT val = { head, headsz };
+    int rc = dbput(self, &id, &val, old);
+    scratch_free(head);
+    if (rc < 0) return -1;
+    if (!old)
+    {
+	/* right after the head, so a rollback finds the key indexed */
+	KeyIndex_add(self->keys, lower, id.size);
+	if (self->filter && KeyFilter_add(self->filter, lower, id.size) < 0)
+	{
+	    growfilter(self);
+	}
+	if (putslot(self, slot, lower, 0) < 0) return -1;
+	if (putcounter(self, rowUsedKey, slot + 1, &slot) < 0) return -1;
+	++self->rowUsed;
+    }
+    return 0;
+}
+
+/* Returns the id of an author, adding new authors to the dictionary.
+ * Callers must hold the write lock. */
+static int internauthor(InfoDb *self, const char *author, size_t authorlen,
+	uint32_t *id)
+{
+    size_t keysz;
+    uint8_t *key = authoridkey(author, authorlen, &keysz);
+    DBT aid = { key, keysz };
+    DBT val = { 0 };
+    int rc = -1;
+    int drc = self->db->get(self->db, &aid, &val, 0);
+    if (drc == 0 && val.size == 4)
+    {
+	*id = uint32_deser(val.data);
+	rc = 0;
+    }
+    else if (drc > 0 && self->authorCount < UINT32_MAX)
+    {
+	uint8_t namekey[AUTHORKEYSZ];
+	uint8_t ser[4];
+	uint8_t count[4];
+	authorkey(namekey, self->authorCount);
+	uint32_ser(ser, self->authorCount);
+	uint32_ser(count, self->authorCount + 1);
+	DBT nid = { namekey, AUTHORKEYSZ };
+	DBT name = { (void *)author, authorlen };
+	DBT cid = { (void *)authorCountKey, sizeof authorCountKey };
+	DBT cval = { count, 4 };
+	DBT cold = { ser, 4 };
+	val.data = ser;
+	val.size = 4;
+	/* the count is only stored once there is an author */
+	if (dbput(self, &nid, &name, 0) == 0 && dbput(self, &aid, &val, 0) == 0
+		&& dbput(self, &cid, &cval, self->authorCount ? &cold : 0) == 0)
+	{
+	    *id = self->authorCount++;
+	    rc = 0;
+	}
+    }
+    scratch_free(key);
+    return rc;
+}
+
+/* adds or deletes the author index record of an entry, callers must hold
+ * the write lock */
+static int indexauthor(InfoDb *self, const char *author, const char *lower,
+	size_t lowerlen, uint64_t seq, int add)
+{
+    char authorbuf[KEYBUFSZ];
+    char *lowerauthor = tolowerkey(author, authorbuf);
+    size_t keysz;
+    uint8_t *key = authoredkey(lowerauthor, strlen(lowerauthor),
+	    lower, lowerlen, seq, &keysz);
+    DBT id = { key, keysz };
+    DBT val = { key, 0 };
+    int rc = add ? dbput(self, &id, &val, 0) : dbdel(self, &id, &val);
+    scratch_free(key);
+    freekey(lowerauthor, authorbuf);
+    return rc;
+}
+
+/* deletes the author index record of an entry by its author id, callers
+ * must hold the write lock */
+static int unindexauthor(InfoDb *self, uint32_t author, const char *lower,
+	size_t lowerlen, uint64_t seq)
+{
+    DBT name;
+    if (authorname(self->db, author, &name) != 0) return -1;
+    char namebuf[KEYBUFSZ];
+    char *nick = name.size < KEYBUFSZ ? namebuf
+	: scratch_alloc(name.size + 1);
+    memcpy(nick, name.data, name.size);
+    nick[name.size] = 0;
+    int rc = indexauthor(self, nick, lower, lowerlen, seq, 0);
+    freekey(nick, namebuf);
+    return rc;
+}
+
+/* writes the record of a new entry, callers must hold the write lock */
+static int putentry(InfoDb *self, const char *lower, size_t lowerlen,
+	uint64_t seq, const RowEntry *entry)
+{
+    uint32_t author;
+    if (internauthor(self, entry->author, entry->authorlen, &author) < 0)
+    {
+	return -1;
+    }
+    size_t keysz;
+    uint8_t *key = entrykey(lower, lowerlen, seq, &keysz);
+    size_t valsz = record_size(entry->time, author, entry->desclen);
+    uint8_t *ser = scratch_alloc(valsz);
+    record_ser(ser, entry->time, author, entry->description, entry->desclen);
+    DBT id = { key, keysz };
+    DBT val = { ser, valsz };
+    int rc = dbput(self, &id, &val, 0);
+    scratch_free(ser);
+    scratch_free(key);
+    if (rc == 0) rc = indexauthor(self, entry->author, lower, lowerlen, seq, 1);
+    return rc;
+}
+
+typedef struct EntryRef
+{
+    uint64_t seq;
+    uint32_t author;
+    DBT record;
+} EntryRef;
+
+/* deletes all entry records of a row, callers must hold the write lock */
+static int delentries(InfoDb *self, const char *lower, size_t lowerlen)
+{
+    size_t keysz;
+    uint8_t *key = entrykey(lower, lowerlen, 0, &keysz);
+    size_t prefixsz = keysz - 8;
+    EntryRef *refs = 0;
+    size_t nrefs = 0;
+    size_t refscapa = 0;
+    DBT id = { key, keysz };
+    DBT val = { 0 };
+    int drc;
+    for (drc = self->db->seq(self->db, &id, &val, R_CURSOR); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (id.size != keysz || memcmp(id.data, key, prefixsz)) break;
+	if (nrefs == refscapa)
+	{
+	    refscapa = refscapa ? 2 * refscapa : 16;
+	    refs = IB_xrealloc(refs, refscapa * sizeof *refs);
+	}
+	RowEntry entry;
+	if (record_deser(val.data, val.size, &entry, &refs[nrefs].author) < 0)
+	{
+	    drc = -1;
+	    break;
+	}
+	refs[nrefs].seq = uint64_deser((const uint8_t *)id.data + prefixsz);
+	refs[nrefs].record.data = IB_xmalloc(val.size + 1);
+	refs[nrefs].record.size = val.size;
+	memcpy(refs[nrefs++].record.data, val.data, val.size);
+    }
+    int rc = drc < 0 ? -1 : 0;
+    id.data = key;
+    id.size = keysz;
+    for (size_t i = 0; i < nrefs && rc == 0; ++i)
+    {
+	uint64_ser(key + prefixsz, refs[i].seq);
+	rc = dbdel(self, &id, &refs[i].record);
+	if (rc == 0)
+	{
+	    rc = unindexauthor(self, refs[i].author, lower, lowerlen,
+		    refs[i].seq);
+	}
+    }
+    for (size_t i = 0; i < nrefs; ++i) free(refs[i].record.data);
+    free(refs);
+    scratch_free(key);
+    return rc;
+}
+
+typedef struct LegacyRow
+{
+    char *key;
+    uint8_t *val;
+    size_t valsz;
+} LegacyRow;
+
+typedef struct ObsoleteKey
+{
+    uint8_t key[SLOTKEYSZ];
+    size_t keysz;
+} ObsoleteKey;
+
+/* Converts the old two-hop layout (lowercase key -> row id -> row, with
+ * an in-band free list) to layout version 2, which splitrows() converts
+ * further. The version record is written last, so an interrupted
+ * migration just runs again. */
+static int migrate(InfoDb *self)
+{
+    LegacyRow *rows = 0;
+    size_t nrows = 0;
+    size_t rowscapa = 0;
+    ObsoleteKey *obsolete = 0;
+    size_t nobsolete = 0;
+    size_t obsoletecapa = 0;
+    uint64_t staleslots = 0;
+    DBT id = { 0 };
+    DBT val = { 0 };
+    int rc = -1;
+    int drc;
+
+    IBLog_msg(L_INFO, "migrating database to single-lookup layout");
+    for (drc = self->db->seq(self->db, &id, &val, R_FIRST); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	const uint8_t *k = id.data;
+	if (id.size && k[0])
+	{
+	    if (nrows == rowscapa)
+	    {
+		rowscapa = rowscapa ? 2 * rowscapa : 256;
+		rows = IB_xrealloc(rows, rowscapa * sizeof *rows);
+	    }
+	    LegacyRow *row = rows + nrows++;
+	    row->key = IB_xmalloc(id.size + 1);
+	    memcpy(row->key, id.data, id.size);
+	    row->key[id.size] = 0;
+	    row->val = IB_xmalloc(val.size ? val.size : 1);
+	    memcpy(row->val, val.data, val.size);
+	    row->valsz = val.size;
+	}
+	else if (id.size == SLOTKEYSZ && k[1] == 3) ++staleslots;
+	else if (id.size <= SLOTKEYSZ && !(id.size == sizeof rowUsedKey
+		    && !memcmp(k, rowUsedKey, sizeof rowUsedKey)))
+	{
+	    if (nobsolete == obsoletecapa)
+	    {
+		obsoletecapa = obsoletecapa ? 2 * obsoletecapa : 256;
+		obsolete = IB_xrealloc(obsolete,
+			obsoletecapa * sizeof *obsolete);
+	    }
+	    memcpy(obsolete[nobsolete].key, k, id.size);
+	    obsolete[nobsolete++].keysz = id.size;
+	}
+    }
+    if (drc < 0) goto done;
+
+    uint64_t slot = 0;
+    for (size_t i = 0; i < nrows; ++i)
+    {
+	id.data = rows[i].key;
+	id.size = strlen(rows[i].key);
+	if (rows[i].valsz == 8)
+	{
+	    DBT rid = { rows[i].val, 8 };
+	    if ((drc = self->db->get(self->db, &rid, &val, 0)) < 0) goto done;
+	}
+	else if (rows[i].valsz > 8)
+	{
+	    val.data = rows[i].val + 8;
+	    val.size = rows[i].valsz - 8;
+	    drc = 0;
+	}
+	else drc = 1;
+	if (drc > 0 || !memchr(val.data, 0, val.size))
+	{
+	    IBLog_fmt(L_WARNING, "dropping dangling key `%s'", rows[i].key);
+	    if (self->db->del(self->db, &id, 0) < 0) goto done;
+	    continue;
+	}
+	uint8_t *newval = IB_xmalloc(val.size + 8);
+	uint64_ser(newval, slot);
+	memcpy(newval + 8, val.data, val.size);
+	val.data = newval;
+	val.size += 8;
+	drc = self->db->put(self->db, &id, &val, 0);
+	free(newval);
+	if (drc < 0 || putslot(self, slot, rows[i].key, 0) < 0) goto done;
+	++slot;
+    }
+    for (uint64_t s = slot; s < staleslots; ++s)
+    {
+	uint8_t skey[SLOTKEYSZ];
+	slotkey(skey, s);
+	id.data = skey;
+	id.size = SLOTKEYSZ;
+	if (self->db->del(self->db, &id, 0) < 0) goto done;
+    }
+    for (size_t i = 0; i < nobsolete; ++i)
+    {
+	id.data = obsolete[i].key;
+	id.size = obsolete[i].keysz;
+	if (self->db->del(self->db, &id, 0) < 0) goto done;
+    }
+    /* not logged, so the old count doesn't matter */
+    self->rowUsed = slot;
+    if (putcounter(self, rowUsedKey, slot, 0) < 0) goto done;
+    uint8_t version = 2;
+    id.data = (void *)versionKey;
+    id.size = sizeof versionKey;
+    val.data = &version;
+    val.size = 1;
+    if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
+    IBLog_fmt(L_INFO, "migrated %llu rows", (unsigned long long)slot);
+    rc = 0;
+
+done:
+    for (size_t i = 0; i < nrows; ++i)
+    {
+	free(rows[i].key);
+	free(rows[i].val);
+    }
+    free(rows);
+    free(obsolete);
+    return rc;
+}
+
+/* Splits the rows of layout version 2, which held all their entries, into
+ * a head and a record per entry. A head's sequence number starts with two
+ * zero bytes, which no unsplit row does, so rows already split by an
+ * interrupted run are skipped. A new change tag keeps an old fact index
+ * from being used. */
+static int splitrows(InfoDb *self)
+{
+    char **keys = 0;
+    size_t nkeys = 0;
+    size_t keyscapa = 0;
+    uint8_t *data = 0;
+    DBT id = { 0 };
+    DBT val = { 0 };
+    int rc = -1;
+    int drc;
+
+    IBLog_msg(L_INFO, "migrating database to per-entry records");
+    for (drc = self->db->seq(self->db, &id, &val, R_FIRST); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (!id.size || !*(const uint8_t *)id.data) continue;
+	if (nkeys == keyscapa)
+	{
+	    keyscapa = keyscapa ? 2 * keyscapa : 256;
+	    keys = IB_xrealloc(keys, keyscapa * sizeof *keys);
+	}
+	keys[nkeys] = IB_xmalloc(id.size + 1);
+	memcpy(keys[nkeys], id.data, id.size);
+	keys[nkeys++][id.size] = 0;
+    }
+    if (drc < 0) goto done;
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+	size_t lowerlen = strlen(keys[i]);
+	id.data = keys[i];
+	id.size = lowerlen;
+	if (self->db->get(self->db, &id, &val, 0) != 0 || val.size <= 8)
+	{
+	    goto done;
+	}
+	const uint8_t *v = val.data;
+	if (val.size > ROWPREFIXSZ && !v[8] && !v[9]) continue;
+	uint64_t slot = uint64_deser(v);
+	DBT old = { 0, val.size };
+	size_t datasz = val.size - 8;
+	data = IB_xrealloc(data, val.size);
+	memcpy(data, v, val.size);
+	old.data = data;
+	const uint8_t *row = data + 8;
+	const char *key;
+	size_t keylen;
+	size_t pos = row_key(row, datasz, &key, &keylen);
+	if (!pos) goto done;
+	RowEntry entry = { .time = 0 };
+	uint64_t seq = 0;
+	while ((drc = row_entry(row, datasz, &pos, &entry)) > 0)
+	{
+	    if (putentry(self, keys[i], lowerlen, seq++, &entry) < 0)
+	    {
+		goto done;
+	    }
+	}
+	if (drc < 0 || puthead(self, keys[i], &old, slot, seq, key, keylen) < 0)
+	{
+	    goto done;
+	}
+    }
+    if (changetag(self) < 0) goto done;
+    uint8_t version = DBVERSION;
+    id.data = (void *)versionKey;
+    id.size = sizeof versionKey;
+    val.data = &version;
+    val.size = 1;
+    if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
+    IBLog_fmt(L_INFO, "split %zu rows", nkeys);
+    rc = 0;
+
+done:
+    for (size_t i = 0; i < nkeys; ++i) free(keys[i]);
+    free(keys);
+    free(data);
+    return rc;
+}
+
+typedef struct OldEntry
+{
+    uint8_t *key;
+    size_t keysz;
+    uint8_t *val;
+    size_t valsz;
+} OldEntry;
+
+/* Converts the entry records of layout version 3, which held their
+ * author inline, to records referencing the author dictionary, and
+ * indexes them by author. Every old record is deleted once its
+ * replacement is written, so an interrupted run continues with the
+ * rest. A new change tag keeps an old fact index from being used. */
+static int internauthors(InfoDb *self)
+{
+    OldEntry *slice = IB_xmalloc(MIGRATESLICE * sizeof *slice);
+    size_t nslice = 0;
+    size_t converted = 0;
+    int rc = -1;
+
+    IBLog_msg(L_INFO, "migrating database to interned authors");
+    for (;;)
+    {
+	DBT id = { (void *)oldEntryPrefix, sizeof oldEntryPrefix };
+	DBT val = { 0 };
+	int drc;
+	for (drc = self->db->seq(self->db, &id, &val, R_CURSOR);
+		drc == 0 && nslice < MIGRATESLICE;
+		drc = self->db->seq(self->db, &id, &val, R_NEXT))
+	{
+	    if (id.size < sizeof oldEntryPrefix || memcmp(id.data,
+			oldEntryPrefix, sizeof oldEntryPrefix)) break;
+	    if (id.size < 12)
+	    {
+		drc = -1;
+		break;
+	    }
+	    OldEntry *old = slice + nslice++;
+	    old->key = IB_xmalloc(id.size);
+	    memcpy(old->key, id.data, id.size);
+	    old->keysz = id.size;
+	    old->val = IB_xmalloc(val.size + 1);
+	    if (val.size) memcpy(old->val, val.data, val.size);
+	    old->valsz = val.size;
+	}
+	if (drc < 0) goto done;
+	if (!nslice) break;
+	for (size_t i = 0; i < nslice; ++i)
+	{
+	    OldEntry *old = slice + i;
+	    size_t lowerlen = old->keysz - 11;
+	    const char *lower = (const char *)old->key + 2;
+	    RowEntry entry = { .time = 0 };
+	    if (old->key[2 + lowerlen] || entry_deser(old->val,
+			old->val + old->valsz, &entry) != old->val + old->valsz
+		    || putentry(self, lower, lowerlen,
+			uint64_deser(old->key + old->keysz - 8), &entry) < 0)
+	    {
+		goto done;
+	    }
+	    id.data = old->key;
+	    id.size = old->keysz;
+	    DBT oldval = { old->val, old->valsz };
+	    if (dbdel(self, &id, &oldval) < 0) goto done;
+	}
+	converted += nslice;
+	while (nslice)
+	{
+	    --nslice;
+	    free(slice[nslice].key);
+	    free(slice[nslice].val);
+	}
+    }
+    if (changetag(self) < 0) goto done;
+    uint8_t version = DBVERSION;
+    DBT id = { (void *)versionKey, sizeof versionKey };
+    DBT val = { &version, 1 };
+    if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
+    IBLog_fmt(L_INFO, "converted %zu entries of %u authors", converted,
+	    (unsigned)self->authorCount);
+    rc = 0;
+
+done:
+    for (size_t i = 0; i < nslice; ++i)
+    {
+	free(slice[i].key);
+	free(slice[i].val);
+    }
+    free(slice);
+    return rc;
+}
+
+/* fills the key index and the key filter in a single pass */
+static int buildindex(InfoDb *self)
+{
+    DBT id = { 0 };
+    DBT val = { 0 };
+    int full = 0;
+    int drc;
+    for (drc = self->db->seq(self->db, &id, &val, R_FIRST); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (id.size && *(const uint8_t *)id.data)
+	{
+	    KeyIndex_add(self->keys, id.data, id.size);
+	    if (KeyFilter_add(self->filter, id.data, id.size) < 0) full = 1;
+	}
+    }
+    if (drc < 0) return -1;
+    if (full) growfilter(self);
+    return 0;
+}
+
+static int buildfulltext(InfoDb *self)
+{
+    char **keys = 0;
+    size_t nkeys = 0;
+    size_t keyscapa = 0;
+    DBT id = { 0 };
+    DBT val = { 0 };
+    int rc = -1;
+    int drc;
+
+    IBLog_msg(L_INFO, "building full-text index");
+    for (drc = self->db->seq(self->db, &id, &val, R_FIRST); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (!id.size || !*(const uint8_t *)id.data) continue;
+	if (nkeys == keyscapa)
+	{
+	    keyscapa = keyscapa ? 2 * keyscapa : 256;
+	    keys = IB_xrealloc(keys, keyscapa * sizeof *keys);
+	}
+	keys[nkeys] = IB_xmalloc(id.size + 1);
+	memcpy(keys[nkeys], id.data, id.size);
+	keys[nkeys++][id.size] = 0;
+    }
+    if (drc < 0) goto done;
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+	WordDeltas words = { 0 };
+	InfoDbRowView *view = 0;
+	if (loadview(self->db, keys[i], strlen(keys[i]), 0, &view) != 0
+		|| words_addrow(&words, view->data, view->size, 1) < 0)
+	{
+	    free(view);
+	    words_done(&words);
+	    goto done;
+	}
+	free(view);
+	if (words_apply(self, &words, keys[i]) < 0) goto done;
+    }
+    uint8_t version = FTVERSION;
+    id.data = (void *)ftVersionKey;
+    id.size = sizeof ftVersionKey;
+    val.data = &version;
+    val.size = 1;
+    if (self->db->put(self->db, &id, &val, 0) < 0) goto done;
+    IBLog_fmt(L_INFO, "indexed %zu rows", nkeys);
+    rc = 0;
+
+done:
+    for (size_t i = 0; i < nkeys; ++i) free(keys[i]);
+    free(keys);
+    return rc;
+}
+
+InfoDb *InfoDb_create(const char *filename)
+{
+    return InfoDb_createStore(filename, STORE_BTREE);
+}
+
+/* the store type only applies to new files, existing files are opened
+ * in their own format */
+InfoDb *InfoDb_createStore(const char *filename, StoreType store)
+{
+    InfoDb *self = IB_xmalloc(sizeof *self);
+    self->shards = 0;
+    self->nshards = 0;
+    self->storeType = store;
+    self->authorCount = 0;
+    self->cache = 0;
+    self->keys = 0;
+    self->filter = 0;
+    atomic_init(&self->filterRejected, 0);
+    atomic_init(&self->filterFalse, 0);
+    self->syncAfter = 0;
+    self->syncDelay = 0;
+    self->pending = 0;
+    self->syncThreadRunning = 0;
+    self->stopping = 0;
+    self->backup = 0;
+    self->backupKey = 0;
+    self->backupKeySz = 0;
+    self->backupFailed = 0;
+    self->backupComplete = 0;
+    self->backupThreadRunning = 0;
+    self->backupDone = 0;
+    self->backupFile = 0;
+    self->walfd = -1;
+    self->walbuf = 0;
+    self->walbufsz = 0;
+    self->walsize = 0;
+    self->txlog = 0;
+    self->txlogsz = 0;
+    self->txloglen = 0;
+    self->txlogged = 0;
+    self->changeTag = 0;
+    self->facts[0] = 0;
+    self->facts[1] = 0;
+    atomic_init(&self->factsReaders[0], 0);
+    atomic_init(&self->factsReaders[1], 0);
+    atomic_init(&self->factsCurrent, -1);
+    self->factsSlot = 1;
+    self->factsWanted = 0;
+    self->factsStopping = 0;
+    self->factsThreadRunning = 0;
+    self->writeHead = 0;
+    self->writeTail = 0;
+    self->writeQueued = 0;
+    self->writerRunning = 0;
+    self->writerStopping = 0;
+    char *walname = suffixname(filename, ".wal");
+    if (pthread_rwlock_init(&self->lock, 0) != 0)
+    {
+	free(walname);
+	free(self);
+	return 0;
+    }
+    pthread_mutex_init(&self->dblock, 0);
+    pthread_mutex_init(&self->syncLock, 0);
+    pthread_mutex_init(&self->walSyncLock, 0);
+    pthread_cond_init(&self->syncCond, 0);
+    pthread_mutex_init(&self->factsLock, 0);
+    pthread_cond_init(&self->factsCond, 0);
+    pthread_mutex_init(&self->writeLock, 0);
+    pthread_cond_init(&self->writeCond, 0);
+    pthread_cond_init(&self->writeSpace, 0);
+    int walfd = -1;
+    if ((self->db = Store_open(filename, O_RDWR|O_CREAT, 0600,
+		    &self->storeType)))
+    {
+	IBLog_fmt(L_INFO, "database file `%s' opened (%s)", filename,
+		Store_typeName(self->storeType));
+	DBT id = { (void *)versionKey, sizeof versionKey };
+	DBT val = { 0 };
+	int needsync = 0;
+	int rc = 0;
+	walfd = open(walname, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if (walfd < 0)
+	{
+	    IBLog_fmt(L_FATAL, "cannot open write-ahead log `%s'", walname);
+	    self->db->close(self->db);
+	    goto error;
+	}
+	if (walreplay(self, walfd) < 0)
+	{
+	    IBLog_fmt(L_FATAL, "cannot replay write-ahead log `%s'", walname);
+	    self->db->close(self->db);
+	    goto error;
+	}
+	int drc = self->db->get(self->db, &id, &val, 0);
+	uint8_t version = drc == 0 && val.size == 1
+	    ? *(const uint8_t *)val.data : 0;
+	DBT cid = { (void *)authorCountKey, sizeof authorCountKey };
+	if (self->db->get(self->db, &cid, &val, 0) == 0 && val.size == 4)
+	{
+	    self->authorCount = uint32_deser(val.data);
+	}
+	/* logged writes pass the old tag, so it must exist */
+	DBT tid = { (void *)changeKey, sizeof changeKey };
+	int trc = self->db->get(self->db, &tid, &val, 0);
+	if (trc == 0 && val.size == 8) self->changeTag = uint64_deser(val.data);
+	else if (trc > 0 && putcounter(self, changeKey, 0, 0) == 0)
+	{
+	    needsync = 1;
+	}
+	else trc = -1;
+	if (trc < 0) rc = -1;
+	else if (drc == 0 && (version < 2 || version > DBVERSION))
+	{
+	    IBLog_fmt(L_FATAL, "unsupported database version in `%s'",
+		    filename);
+	    rc = -1;
+	}
+	else if (drc == 0)
+	{
+	    id.data = (void *)rowUsedKey;
+	    id.size = sizeof rowUsedKey;
+	    if (self->db->get(self->db, &id, &val, 0) == 0 && val.size == 8)
+	    {
+		self->rowUsed = (size_t)uint64_deser(val.data);
+	    }
+	    else rc = -1;
+	    if (rc == 0 && version < DBVERSION)
+	    {
+		/* split rows get the current entry records right away */
+		if (version < 3) rc = splitrows(self);
+		else rc = internauthors(self);
+		needsync = 1;
+	    }
+	}
+	else
+	{
+	    id.data = (void *)rowUsedKey;
+	    id.size = sizeof rowUsedKey;
+	    if (self->db->get(self->db, &id, &val, 0) == 0)
+	    {
+		rc = migrate(self);
+		if (rc == 0) rc = splitrows(self);
+	    }
+	    else
+	    {
+		version = DBVERSION;
+		self->rowUsed = 0;
+		rc = putcounter(self, rowUsedKey, 0, 0);
+		id.data = (void *)versionKey;
+		id.size = sizeof versionKey;
+		val.data = &version;
+		val.size = 1;
+		if (rc == 0) rc = self->db->put(self->db, &id, &val, 0);
+		version = FTVERSION;
+		id.data = (void *)ftVersionKey;
+		id.size = sizeof ftVersionKey;
+		if (rc == 0) rc = self->db->put(self->db, &id, &val, 0);
+	    }
+	    needsync = 1;
+	}
+	self->keys = KeyIndex_create();
+	self->filter = KeyFilter_create(self->rowUsed);
+	if (rc == 0) rc = buildindex(self);
+	if (rc == 0)
+	{
+	    id.data = (void *)ftVersionKey;
+	    id.size = sizeof ftVersionKey;
+	    drc = self->db->get(self->db, &id, &val, 0);
+	    if (drc < 0) rc = -1;
+	    else if (drc > 0)
+	    {
+		rc = buildfulltext(self);
+		needsync = 1;
+	    }
+	}
+	if (rc < 0)
+	{
+	    KeyFilter_destroy(self->filter);
+	    KeyIndex_destroy(self->keys);
+	    self->db->close(self->db);
+	    IBLog_fmt(L_FATAL, "corrupted database file `%s'", filename);
+	    goto error;
+	}
+	if (needsync) self->db->sync(self->db, 0);
+	self->cache = RowCache_create(0, view_retain, view_release);
+	self->filename = IB_copystr(filename);
+	self->walfd = walfd;
+	free(walname);
+
+	self->factsFile = suffixname(filename, ".idx");
+	loadfacts(self);
+	if (atomic_load(&self->factsCurrent) < 0)
+	{
+	    clock_gettime(CLOCK_REALTIME, &self->factsDue);
+	    self->factsWanted = 1;
+	}
+	if (pthread_create(&self->factsThread, 0, factsthread, self) == 0)
+	{
+	    self->factsThreadRunning = 1;
+	}
+	else IBLog_msg(L_WARNING, "cannot start fact index thread");
+	return self;
+    }
+    IBLog_fmt(L_FATAL, "error opening database file `%s'", filename);
+error:
+    if (walfd >= 0) close(walfd);
+    free(walname);
+    pthread_cond_destroy(&self->factsCond);
+    pthread_mutex_destroy(&self->factsLock);
+    pthread_cond_destroy(&self->writeSpace);
+    pthread_cond_destroy(&self->writeCond);
+    pthread_mutex_destroy(&self->writeLock);
+    pthread_cond_destroy(&self->syncCond);
+    pthread_mutex_destroy(&self->walSyncLock);
+    pthread_mutex_destroy(&self->syncLock);
+    pthread_mutex_destroy(&self->dblock);
+    pthread_rwlock_destroy(&self->lock);
+    free(self);
+    return 0;
+}
+
+/* Makes the pending commits durable. It doesn't need the write lock,
+ * writers keep appending to the log meanwhile. Only walclear must not
+ * truncate the log during the fsync. */
+static int dosync(InfoDb *self)
+{
+    pthread_mutex_lock(&self->syncLock);
+    unsigned pending = self->pending;
+    self->pending = 0;
+    pthread_mutex_unlock(&self->syncLock);
+    if (!pending) return 0;
+    uint64_t tstart = Stats_now();
+    pthread_mutex_lock(&self->walSyncLock);
+    int rc = fsync(self->walfd);
+    pthread_mutex_unlock(&self->walSyncLock);
+    Stats_record(ST_DBSYNC, tstart);
+    return rc;
+}
+
+/* syncs once the policy asks for it, callers must not hold the write
+ * lock, so lookups don't wait for the disk */
+static int syncifdue(InfoDb *self)
+{
+    pthread_mutex_lock(&self->syncLock);
+    int due = self->pending && self->pending >= self->syncAfter;
+    pthread_mutex_unlock(&self->syncLock);
+    return due ? dosync(self) : 0;
+}
+
+/* callers must hold the write lock and have synced the database */
+static int walclear(InfoDb *self)
+{
+    if (!self->walsize) return 0;
+    pthread_mutex_lock(&self->walSyncLock);
+    int rc = ftruncate(self->walfd, 0) < 0 || fsync(self->walfd) < 0
+	? -1 : 0;
+    pthread_mutex_unlock(&self->walSyncLock);
+    if (rc == 0) self->walsize = 0;
+    return rc;
+}
+
+/* writes all changes to the database file and empties the log, callers
+ * must hold the write lock */
+static int checkpoint(InfoDb *self)
+{
+    uint64_t tstart = Stats_now();
+    pthread_mutex_lock(&self->syncLock);
+    self->pending = 0;
+    pthread_mutex_unlock(&self->syncLock);
+    int rc = self->db->sync(self->db, 0);
+    if (rc == 0) rc = walclear(self);
+    Stats_record(ST_DBCHECKPOINT, tstart);
+    return rc;
+}
+
+static void *syncthread(void *arg)
+{
+    InfoDb *self = arg;
+    pthread_mutex_lock(&self->syncLock);
+    while (!self->stopping)
+    {
+	if (!self->pending || !self->syncDelay)
+	{
+	    pthread_cond_wait(&self->syncCond, &self->syncLock);
+	    continue;
+	}
+	struct timespec due = self->firstPending;
+	due.tv_sec += self->syncDelay;
+	if (pthread_cond_timedwait(&self->syncCond, &self->syncLock, &due) == 0)
+	{
+	    continue;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (self->pending && (now.tv_sec > due.tv_sec
+		    || (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec)))
+	{
+	    pthread_mutex_unlock(&self->syncLock);
+	    if (dosync(self) < 0)
+	    {
+		IBLog_msg(L_ERROR, "deferred database sync failed");
+	    }
+	    pthread_mutex_lock(&self->syncLock);
+	}
+    }
+    pthread_mutex_unlock(&self->syncLock);
+    return 0;
+}
+
+/* callers must hold the write lock and call syncifdue after releasing
+ * it */
+static int commit(InfoDb *self)
+{
+    if (changetag(self) < 0 || walwrite(self, WAL_COMMIT, 0, 0, 0) < 0)
+    {
+	rollback(self);
+	return -1;
+    }
+    self->txloglen = 0;
+    self->txlogged = 0;
+    wantfacts(self);
+    if (self->walsize >= CHECKPOINTSIZE) return checkpoint(self);
+    pthread_mutex_lock(&self->syncLock);
+    if (++self->pending == 1)
+    {
+	clock_gettime(CLOCK_REALTIME, &self->firstPending);
+	pthread_cond_signal(&self->syncCond);
+    }
+    pthread_mutex_unlock(&self->syncLock);
+    return 0;
+}
+
+/* picks the shard of a key by a hash of its lowercase form */
+static unsigned shardindex(const InfoDb *self, const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = key; *c; ++c)
+    {
+	h ^= (unsigned char)tolower((unsigned char)*c);
+	h *= 1099511628211ULL;
+    }
+    return (unsigned)(h % self->nshards);
+}
+
+static InfoDb *shardfor(InfoDb *self, const char *key)
+{
+    return self->shards[shardindex(self, key)];
+}
+
+static char *shardname(const char *filename, unsigned shard)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof suffix, ".%u", shard);
+    return suffixname(filename, suffix);
+}
+
+/* Every shard records its number and the shard count, so opening the
+ * files with a different count fails instead of hiding rows. */
+static int checkshard(InfoDb *self, unsigned shard, unsigned nshards)
+{
+    uint8_t ser[8];
+    uint32_ser(ser, shard);
+    uint32_ser(ser + 4, nshards);
+    DBT id = { (void *)shardKey, sizeof shardKey };
+    DBT val = { 0 };
+    int rc = -1;
+    writelock(self);
+    int drc = self->db->get(self->db, &id, &val, 0);
+    if (drc == 0) rc = val.size == 8 && !memcmp(val.data, ser, 8) ? 0 : -1;
+    else if (drc > 0)
+    {
+	val.data = ser;
+	val.size = 8;
+	if (dbput(self, &id, &val, 0) == 0 && commit(self) == 0) rc = 0;
+	else rollback(self);
+    }
+    pthread_rwlock_unlock(&self->lock);
+    if (syncifdue(self) < 0) rc = -1;
+    return rc;
+}
+
+/* Shard i lives in filename.i, each shard is a complete database with
+ * its own locks, log, indexes and writer thread. The returned facade
+ * only routes calls to them. */
+InfoDb *InfoDb_createSharded(const char *filename, StoreType store,
+	unsigned shards)
+{
+    char *first = shardname(filename, 0);
+    int hasshards = access(first, F_OK) == 0;
+    free(first);
+    int hasbase = access(filename, F_OK) == 0;
+    if (shards <= 1)
+    {
+	if (hasbase || !hasshards) return InfoDb_createStore(filename, store);
+	unsigned n = 1;
+	for (;; ++n)
+	{
+	    char *name = shardname(filename, n);
+	    int exists = access(name, F_OK) == 0;
+	    free(name);
+	    if (!exists) break;
+	}
+	IBLog_fmt(L_FATAL, "database `%s' is sharded, convert it back with "
+		"`infodbtool reshard -n %u %s %s 1'", filename, n, filename,
+		filename);
+	return 0;
+    }
+    if (hasbase && !hasshards)
+    {
+	IBLog_fmt(L_FATAL, "database `%s' isn't sharded, convert it with "
+		"`infodbtool reshard %s %s %u'", filename, filename, filename,
+		shards);
+	return 0;
+    }
+    InfoDb *self = IB_xmalloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->nshards = shards;
+    self->shards = IB_xmalloc(shards * sizeof *self->shards);
+    for (unsigned i = 0; i < shards; ++i)
+    {
+	char *name = shardname(filename, i);
+	self->shards[i] = InfoDb_createStore(name, store);
+	if (self->shards[i] && checkshard(self->shards[i], i, shards) < 0)
+	{
+	    IBLog_fmt(L_FATAL, "`%s' isn't shard %u of %u", name, i, shards);
+	    InfoDb_destroy(self->shards[i]);
+	    self->shards[i] = 0;
+	}
+	free(name);
+	if (!self->shards[i])
+	{
+	    while (i) InfoDb_destroy(self->shards[--i]);
+	    free(self->shards);
+	    free(self);
+	    return 0;
+	}
+    }
+    return self;
+}
+
+static const char *const fileSuffixes[] = { "", ".wal", ".idx" };
+#define NFILESUFFIXES (sizeof fileSuffixes / sizeof *fileSuffixes)
+
+static char *dbfilename(const char *base, unsigned shards, unsigned shard,
+	const char *suffix)
+{
+    if (shards <= 1) return suffixname(base, suffix);
+    char *name = shardname(base, shard);
+    char *file = suffixname(name, suffix);
+    free(name);
+    return file;
+}
+
+/* moves all files of a closed database, missing files are skipped */
+int InfoDb_rename(const char *from, const char *to, unsigned shards)
+{
+    int rc = 0;
+    for (unsigned i = 0; i < shards || i == 0; ++i)
+    {
+	for (size_t j = 0; j < NFILESUFFIXES; ++j)
+	{
+	    char *src = dbfilename(from, shards, i, fileSuffixes[j]);
+	    char *dst = dbfilename(to, shards, i, fileSuffixes[j]);
+	    if (rename(src, dst) < 0 && errno != ENOENT)
+	    {
+		IBLog_fmt(L_ERROR, "cannot rename `%s' to `%s'", src, dst);
+		rc = -1;
+	    }
+	    free(dst);
+	    free(src);
+	}
+    }
+    return rc;
+}
+
+int InfoDb_unlink(const char *filename, unsigned shards)
+{
+    int rc = 0;
+    for (unsigned i = 0; i < shards || i == 0; ++i)
+    {
+	for (size_t j = 0; j < NFILESUFFIXES; ++j)
+	{
+	    char *name = dbfilename(filename, shards, i, fileSuffixes[j]);
+	    if (unlink(name) < 0 && errno != ENOENT)
+	    {
+		IBLog_fmt(L_ERROR, "cannot remove `%s'", name);
+		rc = -1;
+	    }
+	    free(name);
+	}
+    }
+    return rc;
+}
+
+static size_t rowcount(InfoDb *self)
+{
+    readlock(self);
+    size_t n = self->rowUsed;
+    pthread_rwlock_unlock(&self->lock);
+    return n;
+}
+
+static unsigned pickshard(const size_t *counts, uint64_t total)
+{
+    uint64_t pick = prng_below(total);
+    unsigned i = 0;
+    while (pick >= counts[i]) pick -= counts[i++];
+    return i;
+}
+
+/* Shards are picked with a probability proportional to their rows, so
+ * random rows stay uniform. For ranges, a row is drawn from the rows of
+ * all shards and rejected if it isn't in the range. When that keeps
+ * failing, shards are weighted by their rows in the range instead. */
+static InfoDbRowView *shardedrandom(InfoDb *self, const char *from,
+	const char *to)
+{
+    char frombuf[KEYBUFSZ];
+    char tobuf[KEYBUFSZ];
+    size_t *counts = IB_xmalloc(self->nshards * sizeof *counts);
+    uint64_t total = 0;
+    for (unsigned i = 0; i < self->nshards; ++i)
+    {
+	counts[i] = rowcount(self->shards[i]);
+	total += counts[i];
+    }
+    InfoDbRowView *view = 0;
+    lowerrange(&from, &to, frombuf, tobuf);
+    if (from || to)
+    {
+	for (int i = 0; !view && total && i < RANGETRIES; ++i)
+	{
+	    InfoDb *shard = self->shards[pickshard(counts, total)];
+	    readlock(shard);
+	    view = slotview(shard, from, to);
+	    pthread_rwlock_unlock(&shard->lock);
+	}
+	if (!view)
+	{
+	    total = 0;
+	    for (unsigned i = 0; i < self->nshards; ++i)
+	    {
+		counts[i] = rangecount(self->shards[i], from, to);
+		total += counts[i];
+	    }
+	}
+    }
+    while (!view && total)
+    {
+	unsigned i = pickshard(counts, total);
+	view = randomview(self->shards[i], from, to);
+	total -= counts[i];
+	counts[i] = 0;
+    }
+    freerange(from, to, frombuf, tobuf);
+    free(counts);
+    return view;
+}
+
+void InfoDb_setSyncPolicy(InfoDb *self, unsigned maxPending, unsigned maxDelay)
+{
+    if (self->shards)
+    {
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    InfoDb_setSyncPolicy(self->shards[i], maxPending, maxDelay);
+	}
+	return;
+    }
+    writelock(self);
+    pthread_mutex_lock(&self->syncLock);
+    self->syncAfter = maxPending;
+    self->syncDelay = maxDelay;
+    int syncnow = self->pending >= self->syncAfter;
+    if (maxDelay && !self->syncThreadRunning)
+    {
+	if (pthread_create(&self->syncThread, 0, syncthread, self) == 0)
+	{
+	    self->syncThreadRunning = 1;
+	}
+	else
+	{
+	    IBLog_msg(L_WARNING, "cannot start database sync thread, "
+		    "syncing after every change");
+	    self->syncAfter = 0;
+	    syncnow = 1;
+	}
+    }
+    pthread_cond_signal(&self->syncCond);
+    pthread_mutex_unlock(&self->syncLock);
+    pthread_rwlock_unlock(&self->lock);
+    if (syncnow && dosync(self) < 0)
+    {
+	IBLog_msg(L_ERROR, "database sync failed");
+    }
+}
+
+int InfoDb_sync(InfoDb *self)
+{
+    if (self->shards)
+    {
+	int rc = 0;
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    if (InfoDb_sync(self->shards[i]) < 0) rc = -1;
+	}
+	return rc;
+    }
+    return dosync(self);
+}
+
+void InfoDb_setCacheSize(InfoDb *self, size_t rows)
+{
+    if (self->shards)
+    {
+	size_t perShard = (rows + self->nshards - 1) / self->nshards;
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    InfoDb_setCacheSize(self->shards[i], perShard);
+	}
+	return;
+    }
+    RowCache_setCapacity(self->cache, rows);
+}
+
+void InfoDb_cacheStats(InfoDb *self, size_t *hits, size_t *misses)
+{
+    if (self->shards)
+    {
+	*hits = 0;
+	*misses = 0;
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    size_t h;
+	    size_t m;
+	    InfoDb_cacheStats(self->shards[i], &h, &m);
+	    *hits += h;
+	    *misses += m;
+	}
+	return;
+    }
+    RowCache_stats(self->cache, hits, misses);
+}
+
+void InfoDb_filterStats(InfoDb *self, InfoDbFilterStats *stats)
+{
+    if (self->shards)
+    {
+	memset(stats, 0, sizeof *stats);
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    InfoDbFilterStats shard;
+	    InfoDb_filterStats(self->shards[i], &shard);
+	    stats->keys += shard.keys;
+	    stats->memory += shard.memory;
+	    stats->fpRate += shard.fpRate / self->nshards;
+	    stats->rejected += shard.rejected;
+	    stats->falsePositives += shard.falsePositives;
+	}
+	return;
+    }
+    readlock(self);
+    stats->keys = self->filter ? KeyFilter_count(self->filter) : 0;
+    stats->memory = self->filter ? KeyFilter_memory(self->filter) : 0;
+    stats->fpRate = self->filter ? KeyFilter_fpRate(self->filter) : 0;
+    pthread_rwlock_unlock(&self->lock);
+    stats->rejected = atomic_load_explicit(&self->filterRejected,
+	    memory_order_relaxed);
+    stats->falsePositives = atomic_load_explicit(&self->filterFalse,
+	    memory_order_relaxed);
+}
+
+InfoDbRow *InfoDb_get(InfoDb *self, const char *key)
+{
+    if (self->shards) return InfoDb_get(shardfor(self, key), key);
+    uint64_t tstart = Stats_now();
+    char keybuf[KEYBUFSZ];
+    char *lower = tolowerkey(key, keybuf);
+    InfoDbRowView *view = getview(self, lower);
+    freekey(lower, keybuf);
+    InfoDbRow *row = view ? view_row(view) : 0;
+    InfoDbRowView_destroy(view);
+    Stats_record(ST_DBGET, tstart);
+    return row;
+}
+
+InfoDbRowView *InfoDb_view(InfoDb *self, const char *key)
+{
+    if (self->shards) return InfoDb_view(shardfor(self, key), key);
+    uint64_t tstart = Stats_now();
+    char keybuf[KEYBUFSZ];
+    char *lower = tolowerkey(key, keybuf);
+    InfoDbRowView *view = getview(self, lower);
+    freekey(lower, keybuf);
+    Stats_record(ST_DBGET, tstart);
+    return view;
+}
+
+/* callers must hold the write lock */
+static int put(InfoDb *self, const InfoDbRow *row, const char *lower)
+{
+    size_t lowerlen = strlen(lower);
+    InfoDbRowView *old = 0;
+    WordDeltas words = { 0 };
+    DBT head = { 0 };
+    uint64_t rowslot = 0;
+    int rc = -1;
+    int drc = loadview(self->db, lower, lowerlen, &head, &old);
+    if (drc < 0) goto done;
+    if (drc == 0) rowslot = uint64_deser(head.data);
+    if (drc == 0 && (words_addrow(&words, old->data, old->size, -1) < 0
+		|| delentries(self, lower, lowerlen) < 0)) goto done;
+    if (!IBList_size(row->entries))
+    {
+	if (drc > 0)
+	{
+	    rc = 0;
+	    goto done;
+	}
+	if (delrow(self, lower, rowslot, &head) < 0) goto done;
+    }
+    else
+    {
+	uint64_t seq = 0;
+	int erc = 0;
+	IBListIterator *i = IBList_iterator(row->entries);
+	while (erc == 0 && IBListIterator_moveNext(i))
+	{
+	    const InfoDbEntry *e = IBListIterator_current(i);
+	    RowEntry entry = {
+		.author = e->content,
+		.description = e->content + e->authorlen + 1,
+		.authorlen = e->authorlen,
+		.desclen = e->desclen,
+		.time = e->time
+	    };
+	    words_add(&words, entry.description, 1);
+	    erc = putentry(self, lower, lowerlen, seq++, &entry);
+	}
+	IBListIterator_destroy(i);
+	if (erc < 0 || puthead(self, lower, drc == 0 ? &head : 0, rowslot, seq,
+		    row->key, strlen(row->key)) < 0) goto done;
+    }
+    if (words_apply(self, &words, lower) < 0) goto done;
+    rc = commit(self);
+done:
+    if (rc < 0) rollback(self);
+    free(head.data);
+    free(old);
+    words_done(&words);
+    RowCache_evict(self->cache, lower);
+    return rc;
+}
+
+int InfoDb_put(InfoDb *self, const InfoDbRow *row)
+{
+    if (self->shards) return InfoDb_put(shardfor(self, row->key), row);
+    uint64_t tstart = Stats_now();
+    char keybuf[KEYBUFSZ];
+    char *lower = tolowerkey(row->key, keybuf);
+    writelock(self);
+    int rc = put(self, row, lower);
+    pthread_rwlock_unlock(&self->lock);
+    if (syncifdue(self) < 0) rc = -1;
+    freekey(lower, keybuf);
+    Stats_record(ST_DBPUT, tstart);
+    return rc;
+}
+
+/* splits the rows by shard, so every shard still takes its part in a
+ * single batch */
+static int shardedputall(InfoDb *self, const InfoDbRow *const *rows,
+	size_t n)
+{
+    unsigned *idx = IB_xmalloc(n * sizeof *idx);
+    const InfoDbRow **part = IB_xmalloc(n * sizeof *part);
+    for (size_t i = 0; i < n; ++i) idx[i] = shardindex(self, rows[i]->key);
+    int rc = 0;
+    for (unsigned s = 0; s < self->nshards && rc == 0; ++s)
+    {
+	size_t npart = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+	    if (idx[i] == s) part[npart++] = rows[i];
+	}
+	if (npart) rc = InfoDb_putAll(self->shards[s], part, npart);
+    }
+    free(part);
+    free(idx);
+    return rc;
+}
+
+int InfoDb_putAll(InfoDb *self, const InfoDbRow *const *rows, size_t n)
+{
+    if (self->shards) return shardedputall(self, rows, n);
+    uint64_t tstart = Stats_now();
+    int rc = 0;
+    writelock(self);
+    for (size_t i = 0; i < n && rc == 0; ++i)
+    {
+	char keybuf[KEYBUFSZ];
+	char *lower = tolowerkey(rows[i]->key, keybuf);
+	rc = put(self, rows[i], lower);
+	freekey(lower, keybuf);
+    }
+    pthread_rwlock_unlock(&self->lock);
+    if (syncifdue(self) < 0) rc = -1;
+    Stats_record(ST_DBPUT, tstart);
+    return rc;
+}
+
+/* An entry is a single record, besides it only the small row head is
+ * rewritten for the next sequence number. Callers must hold the write
+ * lock and commit. */
+static int addentry(InfoDb *self, const char *key, const char *lower,
+	const InfoDbEntry *entry)
+{
+    size_t lowerlen = strlen(lower);
+    DBT id = { (void *)lower, lowerlen };
+    DBT val = { 0 };
+    const char *rowkey = key;
+    size_t rowkeylen = strlen(key);
+    uint64_t slot = 0;
+    uint64_t seq = 0;
+    int rc = -1;
+    int drc = self->db->get(self->db, &id, &val, 0);
+    if (drc < 0 || (drc == 0 && val.size <= ROWPREFIXSZ)) goto done;
+    if (drc == 0)
+    {
+	slot = uint64_deser(val.data);
+	seq = uint64_deser((const uint8_t *)val.data + 8);
+	if (!row_key((const uint8_t *)val.data + ROWPREFIXSZ,
+		    val.size - ROWPREFIXSZ, &rowkey, &rowkeylen)) goto done;
+    }
+    RowEntry row = {
+	.author = entry->content,
+	.description = entry->content + entry->authorlen + 1,
+	.authorlen = entry->authorlen,
+	.desclen = entry->desclen,
+	.time = entry->time
+    };
+    if (puthead(self, lower, drc == 0 ? &val : 0, slot, seq + 1,
+		rowkey, rowkeylen) < 0
+	    || putentry(self, lower, lowerlen, seq, &row) < 0) goto done;
+    WordDeltas words = { 0 };
+    words_add(&words, row.description, 1);
+    rc = words_apply(self, &words, lower);
+done:
+    RowCache_evict(self->cache, lower);
+    return rc;
+}
+
+/* callers must hold the write lock */
+static int add(InfoDb *self, const char *key, const char *lower,
+	const InfoDbEntry *entry)
+{
+    if (addentry(self, key, lower, entry) == 0) return commit(self);
+    rollback(self);
+    return -1;
+}
+
+int InfoDb_add(InfoDb *self, const char *key, const InfoDbEntry *entry)
+{
+    if (self->shards) return InfoDb_add(shardfor(self, key), key, entry);
+    uint64_t tstart = Stats_now();
+    char keybuf[KEYBUFSZ];
+    char *lower = tolowerkey(key, keybuf);
+    writelock(self);
+    int rc = add(self, key, lower, entry);
+    pthread_rwlock_unlock(&self->lock);
+    if (syncifdue(self) < 0) rc = -1;
+    freekey(lower, keybuf);
+    Stats_record(ST_DBADD, tstart);
+    return rc;
+}
+
+/* Finds the first entry with the description by a range scan over the
+ * row's entry records and deletes just that record. Callers must hold
+ * the write lock and commit. */
+static int dropentry(InfoDb *self, const char *lower,
+	const char *description)
+{
+    size_t lowerlen = strlen(lower);
+    DBT id = { (void *)lower, lowerlen };
+    DBT val = { 0 };
+    WordDeltas words = { 0 };
+    uint8_t *key = 0;
+    DBT head = { 0 };
+    DBT record = { 0 };
+    int rc = -1;
+    int drc = self->db->get(self->db, &id, &val, 0);
+    if (drc > 0) rc = 0;
+    if (drc != 0 || val.size <= ROWPREFIXSZ) goto done;
+    uint64_t slot = uint64_deser(val.data);
+    /* the old values are logged, the scan invalidates them */
+    head.data = scratch_alloc(val.size);
+    head.size = val.size;
+    memcpy(head.data, val.data, val.size);
+    size_t keysz;
+    key = entrykey(lower, lowerlen, 0, &keysz);
+    size_t prefixsz = keysz - 8;
+    size_t nentries = 0;
+    int found = 0;
+    uint32_t author = 0;
+    id.data = key;
+    id.size = keysz;
+    for (drc = self->db->seq(self->db, &id, &val, R_CURSOR); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (id.size != keysz || memcmp(id.data, key, prefixsz)) break;
+	++nentries;
+	if (!found)
+	{
+	    RowEntry entry;
+	    if (record_deser(val.data, val.size, &entry, &author) < 0)
+	    {
+		goto done;
+	    }
+	    if (!strcmp(description, entry.description))
+	    {
+		found = 1;
+		memcpy(key + prefixsz, (const uint8_t *)id.data + prefixsz, 8);
+		words_add(&words, entry.description, -1);
+		record.data = scratch_alloc(val.size + 1);
+		record.size = val.size;
+		memcpy(record.data, val.data, val.size);
+	    }
+	}
+	/* only needs to know whether this is the last entry */
+	if (found && nentries > 1) break;
+    }
+    if (drc < 0) goto done;
+    if (!found)
+    {
+	rc = 0;
+	goto done;
+    }
+    id.data = key;
+    id.size = keysz;
+    if (dbdel(self, &id, &record) < 0 || unindexauthor(self, author, lower,
+		lowerlen, uint64_deser(key + prefixsz)) < 0) goto done;
+    if (nentries == 1 && delrow(self, lower, slot, &head) < 0) goto done;
+    if (words_apply(self, &words, lower) < 0) goto done;
+    rc = 1;
+done:
+    words_done(&words);
+    scratch_free(record.data);
+    scratch_free(head.data);
+    scratch_free(key);
+    RowCache_evict(self->cache, lower);
+    return rc;
+}
+
+/* callers must hold the write lock */
+static int removeentry(InfoDb *self, const char *lower,
+	const char *description)
+{
+    int rc = dropentry(self, lower, description);
+    if (rc < 0) rollback(self);
+    else if (rc > 0 && commit(self) < 0) rc = -1;
+    return rc;
+}
+
+int InfoDb_remove(InfoDb *self, const char *key, const char *description)
+{
+    if (self->shards)
+    {
+	return InfoDb_remove(shardfor(self, key), key, description);
+    }
+    uint64_t tstart = Stats_now();
+    char keybuf[KEYBUFSZ];
+    char *lower = tolowerkey(key, keybuf);
+    writelock(self);
+    int rc = removeentry(self, lower, description);
+    pthread_rwlock_unlock(&self->lock);
+    if (syncifdue(self) < 0) rc = -1;
+    freekey(lower, keybuf);
+    Stats_record(ST_DBREMOVE, tstart);
+    return rc;
+}
+
+/* Applies a run of changes to the same key as one transaction with a
+ * single commit. If one fails, the transaction is rolled back and the
+ * changes are applied one by one, so only the failing one is lost.
+ * Callers must hold the write lock. */
+static void writegroup(InfoDb *self, WriteRequest *group)
+{
+    WriteRequest *req;
+    int changed = 0;
+    int rc = 0;
+    for (req = group; req && rc >= 0; req = req->next)
+    {
+	rc = req->op == WO_ADD
+	    ? addentry(self, req->key, req->lower, req->entry)
+	    : dropentry(self, req->lower, req->description);
+	req->rc = rc;
+	if (req->op == WO_ADD || rc > 0) changed = 1;
+    }
+    if (rc >= 0 && (!changed || commit(self) == 0)) return;
+    rollback(self);
+    if (!group->next)
+    {
+	group->rc = -1;
+	return;
+    }
+    for (req = group; req; req = req->next)
+    {
+	req->rc = req->op == WO_ADD
+	    ? add(self, req->key, req->lower, req->entry)
+	    : removeentry(self, req->lower, req->description);
+    }
+}
+
+/* Applies queued changes in order. Consecutive changes to the same key
+ * are applied as one transaction, the write lock is released between
+ * keys so lookups can get in. */
+static void runwrites(InfoDb *self, WriteRequest *req)
+{
+    while (req)
+    {
+	WriteRequest *last = req;
+	while (last->next && !strcmp(last->next->lower, req->lower))
+	{
+	    last = last->next;
+	}
+	WriteRequest *next = last->next;
+	last->next = 0;
+	uint64_t tstart = Stats_now();
+	writelock(self);
+	writegroup(self, req);
+	pthread_rwlock_unlock(&self->lock);
+	if (syncifdue(self) < 0)
+	{
+	    for (WriteRequest *failed = req; failed; failed = failed->next)
+	    {
+		failed->rc = -1;
+	    }
+	}
+	Stats_record(req->op == WO_ADD ? ST_DBADD : ST_DBREMOVE, tstart);
+	while (req)
+	{
+	    WriteRequest *done = req;
+	    req = req->next;
+	    if (done->done) done->done(done->ctx, done->rc);
+	    free(done->key);
+	    free(done->lower);
+	    free(done->entry);
+	    free(done->description);
+	    free(done);
+	}
+	req = next;
+    }
+}
+
+static void *writerthread(void *arg)
+{
+    InfoDb *self = arg;
+    pthread_mutex_lock(&self->writeLock);
+    for (;;)
+    {
+	while (!self->writeHead && !self->writerStopping)
+	{
+	    pthread_cond_wait(&self->writeCond, &self->writeLock);
+	}
+	if (!self->writeHead) break;
+	WriteRequest *batch = self->writeHead;
+	self->writeHead = 0;
+	self->writeTail = 0;
+	self->writeQueued = 0;
+	pthread_cond_broadcast(&self->writeSpace);
+	pthread_mutex_unlock(&self->writeLock);
+	runwrites(self, batch);
+	pthread_mutex_lock(&self->writeLock);
+    }
+    pthread_mutex_unlock(&self->writeLock);
+    return 0;
+}
+
+/* queues a change for the writer thread, blocking while the queue is
+ * full, the thread is started on first use */
+static void submit(InfoDb *self, WriteRequest *req)
+{
+    size_t keylen = strlen(req->key);
+    req->next = 0;
+    req->lower = IB_xmalloc(keylen + 1);
+    for (size_t i = 0; i <= keylen; ++i)
+    {
+	req->lower[i] = tolower((unsigned char)req->key[i]);
+    }
+    pthread_mutex_lock(&self->writeLock);
+    if (!self->writerRunning && !self->writerStopping)
+    {
+	if (pthread_create(&self->writerThread, 0, writerthread, self) == 0)
+	{
+	    self->writerRunning = 1;
+	}
+	else IBLog_msg(L_WARNING, "cannot start database writer thread, "
+		"writing synchronously");
+    }
+    if (!self->writerRunning)
+    {
+	pthread_mutex_unlock(&self->writeLock);
+	runwrites(self, req);
+	return;
+    }
+    while (self->writeQueued == WRITEQUEUESIZE)
+    {
+	pthread_cond_wait(&self->writeSpace, &self->writeLock);
+    }
+    if (self->writeTail) self->writeTail->next = req;
+    else self->writeHead = req;
+    self->writeTail = req;
+    ++self->writeQueued;
+    pthread_cond_signal(&self->writeCond);
+    pthread_mutex_unlock(&self->writeLock);
+}
+
+void InfoDb_addAsync(InfoDb *self, const char *key, const InfoDbEntry *entry,
+	InfoDbDone done, void *ctx)
+{
+    if (self->shards)
+    {
+	InfoDb_addAsync(shardfor(self, key), key, entry, done, ctx);
+	return;
+    }
+    WriteRequest *req = IB_xmalloc(sizeof *req);
+    memset(req, 0, sizeof *req);
+    req->op = WO_ADD;
+    req->key = IB_copystr(key);
+    req->entry = entry_create(entry->content, entry->authorlen,
+	    entry->content + entry->authorlen + 1, entry->desclen,
+	    entry->time);
+    req->done = done;
+    req->ctx = ctx;
+    submit(self, req);
+}
+
+void InfoDb_removeAsync(InfoDb *self, const char *key,
+	const char *description, InfoDbDone done, void *ctx)
+{
+    if (self->shards)
+    {
+	InfoDb_removeAsync(shardfor(self, key), key, description, done, ctx);
+	return;
+    }
+    WriteRequest *req = IB_xmalloc(sizeof *req);
+    memset(req, 0, sizeof *req);
+    req->op = WO_REMOVE;
+    req->key = IB_copystr(key);
+    req->description = IB_copystr(description);
+    req->done = done;
+    req->ctx = ctx;
+    submit(self, req);
+}
+
+typedef struct SearchMatch
+{
+    char *key;
+    double score;
+} SearchMatch;
+
+static int cmpkeys(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmpsearchmatch(const void *a, const void *b)
+{
+    const SearchMatch *ma = a;
+    const SearchMatch *mb = b;
+    if (ma->score != mb->score) return ma->score < mb->score ? 1 : -1;
+    return strcmp(ma->key, mb->key);
+}
+
+/* Prefix matches come first, in key order, found by positioning a cursor
+ * at the query. The rest is filled from the trigram index. With shards,
+ * the candidates of all shards are merged in the same order. Only keys
+ * in [from, to) count towards max. */
+IBList *InfoDb_search(InfoDb *self, const char *query, const char *from,
+	const char *to, size_t max)
+{
+    uint64_t tstart = Stats_now();
+    IBList *results = IBList_create();
+    char keybuf[KEYBUFSZ];
+    char frombuf[KEYBUFSZ];
+    char tobuf[KEYBUFSZ];
+    char *lower = tolowerkey(query, keybuf);
+    lowerrange(&from, &to, frombuf, tobuf);
+    size_t querylen = strlen(lower);
+    InfoDb **parts = self->shards ? self->shards : &self;
+    unsigned nparts = self->shards ? self->nshards : 1;
+    char **prefixed = 0;
+    SearchMatch *fuzzy = 0;
+    size_t nprefixed = 0;
+    size_t nfuzzy = 0;
+    if (!max || !querylen) goto done;
+    /* all keys in the range share the common prefix of its bounds, so it
+     * must not count for similarity */
+    size_t common = 0;
+    if (from && to)
+    {
+	while (from[common] && from[common] == to[common]) ++common;
+	if (common > querylen || memcmp(lower, from, common)) common = 0;
+    }
+    prefixed = IB_xmalloc(nparts * max * sizeof *prefixed);
+    fuzzy = IB_xmalloc(nparts * max * sizeof *fuzzy);
+    KeyIndexMatch *matches = scratch_alloc(max * sizeof *matches);
+    for (unsigned p = 0; p < nparts; ++p)
+    {
+	InfoDb *part = parts[p];
+	size_t n = 0;
+	DBT id = { lower, querylen };
+	DBT val = { 0 };
+	readlock(part);
+	lockdb(part);
+	for (int drc = part->db->seq(part->db, &id, &val, R_CURSOR);
+		drc == 0 && n < max;
+		drc = part->db->seq(part->db, &id, &val, R_NEXT))
+	{
+	    if (id.size < querylen || memcmp(id.data, lower, querylen)) break;
+	    if (!idinrange(&id, from, to)) continue;
+	    char *key = IB_xmalloc(id.size + 1);
+	    memcpy(key, id.data, id.size);
+	    key[id.size] = 0;
+	    prefixed[nprefixed++] = key;
+	    ++n;
+	}
+	pthread_mutex_unlock(&part->dblock);
+	if (n < max)
+	{
+	    size_t nmatches = KeyIndex_search(part->keys, lower + common,
+		    from, to, matches, max);
+	    for (size_t i = 0; i < nmatches; ++i)
+	    {
+		if (!strncmp(matches[i].key, lower, querylen)) continue;
+		fuzzy[nfuzzy].key = IB_copystr(matches[i].key);
+		fuzzy[nfuzzy++].score = matches[i].score;
+	    }
+	}
+	pthread_rwlock_unlock(&part->lock);
+    }
+    scratch_free(matches);
+    if (nparts > 1)
+    {
+	qsort(prefixed, nprefixed, sizeof *prefixed, cmpkeys);
+	qsort(fuzzy, nfuzzy, sizeof *fuzzy, cmpsearchmatch);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < nprefixed; ++i)
+    {
+	if (n++ < max) IBList_append(results, prefixed[i], free);
+	else free(prefixed[i]);
+    }
+    for (size_t i = 0; i < nfuzzy; ++i)
+    {
+	if (n++ < max) IBList_append(results, fuzzy[i].key, free);
+	else free(fuzzy[i].key);
+    }
+done:
+    free(fuzzy);
+    free(prefixed);
+    freerange(from, to, frombuf, tobuf);
+    freekey(lower, keybuf);
+    Stats_record(ST_DBSEARCH, tstart);
+    return results;
+}
+
+typedef struct FtPosting
+{
+    char *key;
+    uint64_t count;
+} FtPosting;
+
+typedef struct FtTerm
+{
+    FtPosting *postings;
+    size_t n;
+    size_t capa;
+    size_t pos;
+    double weight;
+} FtTerm;
+
+typedef struct FtMatch
+{
+    const char *key;
+    unsigned terms;
+    double score;
+} FtMatch;
+
+static int cmpposting(const void *a, const void *b)
+{
+    const FtPosting *pa = a;
+    const FtPosting *pb = b;
+    return strcmp(pa->key, pb->key);
+}
+
+static int ftbetter(const FtMatch *a, const FtMatch *b)
+{
+    if (a->terms != b->terms) return a->terms > b->terms;
+    if (a->score != b->score) return a->score > b->score;
+    return strcmp(a->key, b->key) < 0;
+}
+
+static void insertftmatch(FtMatch *matches, size_t *n, size_t max,
+	const FtMatch *match)
+{
+    size_t pos = *n;
+    while (pos && ftbetter(match, matches + pos - 1)) --pos;
+    if (pos >= max) return;
+    size_t last = *n < max ? *n : max - 1;
+    memmove(matches + pos + 1, matches + pos,
+	    (last - pos) * sizeof *matches);
+    matches[pos] = *match;
+    if (*n < max) ++*n;
+}
+
+static void ftscan(InfoDb *self, const char *word, FtTerm *term)
+{
+    size_t prefixsz;
+    uint8_t *prefix = wordkey(word, strlen(word), "", 0, &prefixsz);
+    DBT id = { prefix, prefixsz };
+    DBT val = { 0 };
+    for (int drc = self->db->seq(self->db, &id, &val, R_CURSOR); drc == 0;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT))
+    {
+	if (id.size <= prefixsz || memcmp(id.data, prefix, prefixsz)) break;
+	if (term->n == term->capa)
+	{
+	    term->capa = term->capa ? 2 * term->capa : 16;
+	    term->postings = IB_xrealloc(term->postings,
+		    term->capa * sizeof *term->postings);
+	}
+	FtPosting *posting = term->postings + term->n++;
+	posting->key = IB_xmalloc(id.size - prefixsz + 1);
+	memcpy(posting->key, (const uint8_t *)id.data + prefixsz,
+		id.size - prefixsz);
+	posting->key[id.size - prefixsz] = 0;
+	posting->count = val.size == 8 ? uint64_deser(val.data) : 1;
+    }
+    scratch_free(prefix);
+}
+
+/* Keys are ranked by the number of query words occurring in their
+ * descriptions, then by BM25-like weights (without the logarithm).
+ * The postings of each word come from a cursor range scan ordered by
+ * key, so they are merged in a single pass. Postings collected from
+ * several shards are sorted first. */
+IBList *InfoDb_find(InfoDb *self, const char *text, const char *from,
+	const char *to, size_t max)
+{
+    uint64_t tstart = Stats_now();
+    IBList *results = IBList_create();
+    char frombuf[KEYBUFSZ];
+    char tobuf[KEYBUFSZ];
+    lowerrange(&from, &to, frombuf, tobuf);
+    WordDeltas words = { 0 };
+    FtTerm *terms = 0;
+    FtMatch *matches = 0;
+    if (!max) goto done;
+    words_add(&words, text, 1);
+    words_merge(&words);
+    if (!words.n) goto done;
+
+    terms = IB_xmalloc(words.n * sizeof *terms);
+    memset(terms, 0, words.n * sizeof *terms);
+    InfoDb **parts = self->shards ? self->shards : &self;
+    unsigned nparts = self->shards ? self->nshards : 1;
+    double nrows = 0;
+    for (unsigned p = 0; p < nparts; ++p)
+    {
+	readlock(parts[p]);
+	lockdb(parts[p]);
+	for (size_t i = 0; i < words.n; ++i)
+	{
+	    ftscan(parts[p], words.words[i].word, terms + i);
+	}
+	pthread_mutex_unlock(&parts[p]->dblock);
+	nrows += (double)parts[p]->rowUsed;
+	pthread_rwlock_unlock(&parts[p]->lock);
+    }
+    for (size_t i = 0; i < words.n; ++i)
+    {
+	if (nparts > 1)
+	{
+	    qsort(terms[i].postings, terms[i].n, sizeof *terms[i].postings,
+		    cmpposting);
+	}
+	double df = (double)terms[i].n;
+	terms[i].weight = (nrows - df + 0.5) / (df + 0.5);
+	if (terms[i].weight < 0.1) terms[i].weight = 0.1;
+    }
+
+    matches = scratch_alloc(max * sizeof *matches);
+    size_t nmatches = 0;
+    for (;;)
+    {
+	const char *key = 0;
+	for (size_t i = 0; i < words.n; ++i)
+	{
+	    if (terms[i].pos == terms[i].n) continue;
+	    const char *k = terms[i].postings[terms[i].pos].key;
+	    if (!key || strcmp(k, key) < 0) key = k;
+	}
+	if (!key) break;
+	FtMatch match = { key, 0, 0 };
+	for (size_t i = 0; i < words.n; ++i)
+	{
+	    if (terms[i].pos == terms[i].n) continue;
+	    const FtPosting *posting = terms[i].postings + terms[i].pos;
+	    if (strcmp(posting->key, key)) continue;
+	    double tf = (double)posting->count;
+	    ++match.terms;
+	    match.score += terms[i].weight * tf * 2.2 / (tf + 1.2);
+	    ++terms[i].pos;
+	}
+	if (inrange(key, from, to))
+	{
+	    insertftmatch(matches, &nmatches, max, &match);
+	}
+    }
+    for (size_t i = 0; i < nmatches; ++i)
+    {
+	IBList_append(results, IB_copystr(matches[i].key), free);
+    }
+
+done:
+    if (terms)
+    {
+	for (size_t i = 0; i < words.n; ++i)
+	{
+	    for (size_t j = 0; j < terms[i].n; ++j)
+	    {
+		free(terms[i].postings[j].key);
+	    }
+	    free(terms[i].postings);
+	}
+	free(terms);
+    }
+    scratch_free(matches);
+    words_done(&words);
+    freerange(from, to, frombuf, tobuf);
+    Stats_record(ST_DBFIND, tstart);
+    return results;
+}
+
+/* Lists the keys of the rows with entries by the author in key order, by
+ * a range scan over the author index, starting at from and ending at to
+ * if given. */
+IBList *InfoDb_byAuthor(InfoDb *self, const char *author, const char *from,
+	const char *to, size_t max)
+{
+    uint64_t tstart = Stats_now();
+    IBList *results = IBList_create();
+    char authorbuf[KEYBUFSZ];
+    char frombuf[KEYBUFSZ];
+    char tobuf[KEYBUFSZ];
+    char *lowerauthor = tolowerkey(author, authorbuf);
+    lowerrange(&from, &to, frombuf, tobuf);
+    size_t authorlen = strlen(lowerauthor);
+    InfoDb **parts = self->shards ? self->shards : &self;
+    unsigned nparts = self->shards ? self->nshards : 1;
+    uint8_t *prefix = 0;
+    char **keys = 0;
+    size_t nkeys = 0;
+    if (!max || !authorlen) goto done;
+    size_t startsz;
+    prefix = authoredkey(lowerauthor, authorlen, from ? from : "",
+	    from ? strlen(from) : 0, 0, &startsz);
+    size_t prefixsz = 3 + authorlen;
+    keys = IB_xmalloc(nparts * max * sizeof *keys);
+    for (unsigned p = 0; p < nparts; ++p)
+    {
+	InfoDb *part = parts[p];
+	size_t first = nkeys;
+	DBT id = { prefix, from ? startsz : prefixsz };
+	DBT val = { 0 };
+	readlock(part);
+	lockdb(part);
+	for (int drc = part->db->seq(part->db, &id, &val, R_CURSOR);
+		drc == 0 && nkeys - first < max;
+		drc = part->db->seq(part->db, &id, &val, R_NEXT))
+	{
+	    if (id.size < prefixsz + 9
+		    || memcmp(id.data, prefix, prefixsz)) break;
+	    const char *key = (const char *)id.data + prefixsz;
+	    size_t keylen = id.size - prefixsz - 9;
+	    DBT rowid = { (void *)key, keylen };
+	    if (to && keycmp(&rowid, (const uint8_t *)to, strlen(to)) >= 0)
+	    {
+		break;
+	    }
+	    /* entries of the same row are adjacent */
+	    if (nkeys > first && !strncmp(keys[nkeys - 1], key, keylen)
+		    && !keys[nkeys - 1][keylen]) continue;
+	    keys[nkeys] = IB_xmalloc(keylen + 1);
+	    memcpy(keys[nkeys], key, keylen);
+	    keys[nkeys++][keylen] = 0;
+	}
+	pthread_mutex_unlock(&part->dblock);
+	pthread_rwlock_unlock(&part->lock);
+    }
+    if (nparts > 1) qsort(keys, nkeys, sizeof *keys, cmpkeys);
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+	if (i < max) IBList_append(results, keys[i], free);
+	else free(keys[i]);
+    }
+done:
+    free(keys);
+    scratch_free(prefix);
+    freerange(from, to, frombuf, tobuf);
+    freekey(lowerauthor, authorbuf);
+    Stats_record(ST_DBAUTHOR, tstart);
+    return results;
+}
+
+/* Rows are copied out in slices while holding the read lock, so the
+ * visitor can use the database itself and writers are never blocked for
+ * a whole scan. Row keys never start with a NUL byte, unlike the
+ * metadata and the entry records. */
+int InfoDb_foreach(InfoDb *self, InfoDbVisitor visitor, void *ctx)
+{
+    static const uint8_t firstKey[] = { 1 };
+    if (self->shards)
+    {
+	int rc = 0;
+	for (unsigned i = 0; i < self->nshards && !rc; ++i)
+	{
+	    rc = InfoDb_foreach(self->shards[i], visitor, ctx);
+	}
+	return rc;
+    }
+    char *keys[FOREACHSLICE];
+    InfoDbRowView *views[FOREACHSLICE];
+    char *resume = 0;
+    int rc = 0;
+    for (;;)
+    {
+	size_t n = 0;
+	size_t nviews = 0;
+	DBT id = { resume ? resume : (void *)firstKey,
+	    resume ? strlen(resume) : sizeof firstKey };
+	DBT val = { 0 };
+	readlock(self);
+	lockdb(self);
+	int drc = self->db->seq(self->db, &id, &val, R_CURSOR);
+	if (drc == 0 && resume && !keycmp(&id, (const uint8_t *)resume,
+		    strlen(resume)))
+	{
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT);
+	}
+	while (drc == 0)
+	{
+	    keys[n] = IB_xmalloc(id.size + 1);
+	    memcpy(keys[n], id.data, id.size);
+	    keys[n++][id.size] = 0;
+	    if (n == FOREACHSLICE) break;
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT);
+	}
+	pthread_mutex_unlock(&self->dblock);
+	for (size_t i = 0; i < n; ++i)
+	{
+	    InfoDbRowView *view = fetchview(self, keys[i]);
+	    if (view) views[nviews++] = view;
+	}
+	pthread_rwlock_unlock(&self->lock);
+	if (drc < 0) rc = -1;
+	if (n)
+	{
+	    free(resume);
+	    resume = keys[--n];
+	    for (size_t i = 0; i < n; ++i) free(keys[i]);
+	}
+	for (size_t i = 0; i < nviews; ++i)
+	{
+	    if (!rc && visitor(ctx, views[i])) rc = 1;
+	    InfoDbRowView_destroy(views[i]);
+	}
+	if (rc || drc) break;
+    }
+    free(resume);
+    return rc;
+}
+
+/* Registers a new copy of the database to receive mirrored changes,
+ * returns -1 if another copy is already in progress. */
+static int attachcopy(InfoDb *self, const char *filename, DB **copy)
+{
+    writelock(self);
+    if (self->backup)
+    {
+	pthread_rwlock_unlock(&self->lock);
+	IBLog_msg(L_WARNING,
+		"a database backup or compaction is already running");
+	return -1;
+    }
+    StoreType type = self->storeType;
+    *copy = Store_open(filename, O_RDWR|O_CREAT|O_TRUNC, 0600, &type);
+    self->backup = *copy;
+    self->backupFailed = 0;
+    self->backupComplete = 0;
+    pthread_rwlock_unlock(&self->lock);
+    if (!*copy)
+    {
+	IBLog_fmt(L_ERROR, "cannot create database copy `%s'", filename);
+    }
+    return 0;
+}
+
+/* Copies all records in slices, taking the read lock only per slice, so
+ * lookups keep being served. Writers mirror changes to records already
+ * copied, so the copy stays consistent until it is detached. */
+static int copyrecords(InfoDb *self, DB *copy, size_t *records)
+{
+    int drc = 0;
+    *records = 0;
+    do
+    {
+	size_t n = 0;
+	DBT id = { self->backupKey, self->backupKeySz };
+	DBT val = { 0 };
+	readlock(self);
+	lockdb(self);
+	if (self->backupKey)
+	{
+	    drc = self->db->seq(self->db, &id, &val, R_CURSOR);
+	    if (drc == 0 && !keycmp(&id, self->backupKey, self->backupKeySz))
+	    {
+		drc = self->db->seq(self->db, &id, &val, R_NEXT);
+	    }
+	}
+	else drc = self->db->seq(self->db, &id, &val, R_FIRST);
+	while (drc == 0)
+	{
+	    if (copy->put(copy, &id, &val, 0) < 0)
+	    {
+		drc = -1;
+		break;
+	    }
+	    if (++n == BACKUPSLICE)
+	    {
+		/* writers don't run while the read lock is held */
+		self->backupKey = IB_xrealloc(self->backupKey, id.size);
+		memcpy(self->backupKey, id.data, id.size);
+		self->backupKeySz = id.size;
+		break;
+	    }
+	    drc = self->db->seq(self->db, &id, &val, R_NEXT);
+	}
+	*records += n;
+	if (drc != 0)
+	{
+	    if (drc < 0) self->backupFailed = 1;
+	    else self->backupComplete = 1;
+	    free(self->backupKey);
+	    self->backupKey = 0;
+	    self->backupKeySz = 0;
+	}
+	pthread_mutex_unlock(&self->dblock);
+	pthread_rwlock_unlock(&self->lock);
+    } while (drc == 0);
+    return drc < 0 ? -1 : 0;
+}
+
+/* stops mirroring changes to the copy, callers must hold the write lock */
+static int detachcopy(InfoDb *self)
+{
+    int rc = self->backupFailed ? -1 : 0;
+    self->backup = 0;
+    self->backupComplete = 0;
+    free(self->backupKey);
+    self->backupKey = 0;
+    self->backupKeySz = 0;
+    return rc;
+}
+
+/* The copy is consistent as of the moment it is detached. It is written
+ * to a temporary file, which is renamed on success. */
+int InfoDb_backup(InfoDb *self, const char *filename)
+{
+    if (self->shards)
+    {
+	/* Shards are copied one after the other without stopping writes
+	 * to the others, so they are from slightly different times. Rows
+	 * never span shards, so each row is still consistent. */
+	int rc = 0;
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    char *name = shardname(filename, i);
+	    if (InfoDb_backup(self->shards[i], name) < 0) rc = -1;
+	    free(name);
+	}
+	return rc;
+    }
+    uint64_t tstart = Stats_now();
+    char *tmpname = suffixname(filename, ".tmp");
+
+    int rc = -1;
+    DB *backup = 0;
+    if (attachcopy(self, tmpname, &backup) < 0)
+    {
+	free(tmpname);
+	return -1;
+    }
+    if (!backup) goto done;
+
+    size_t records;
+    int failed = copyrecords(self, backup, &records) < 0;
+    writelock(self);
+    if (detachcopy(self) < 0) failed = 1;
+    pthread_rwlock_unlock(&self->lock);
+
+    if (failed) IBLog_fmt(L_ERROR, "error copying database to `%s'", tmpname);
+    else if (backup->sync(backup, 0) < 0)
+    {
+	IBLog_fmt(L_ERROR, "error syncing backup file `%s'", tmpname);
+    }
+    else rc = 0;
+    if (backup->close(backup) < 0) rc = -1;
+    backup = 0;
+    if (rc == 0 && rename(tmpname, filename) < 0)
+    {
+	IBLog_fmt(L_ERROR, "cannot rename backup file to `%s'", filename);
+	rc = -1;
+    }
+    if (rc == 0)
+    {
+	IBLog_fmt(L_INFO, "backup of %zu records written to `%s' in %.2fs",
+		records, filename, (double)(Stats_now() - tstart) / 1e9);
+    }
+
+done:
+    if (backup) backup->close(backup);
+    if (rc < 0) unlink(tmpname);
+    free(tmpname);
+    return rc;
+}
+
+/* average time of uncached random row lookups in microseconds */
+static double lookuptime(InfoDb *self)
+{
+    uint8_t skey[SLOTKEYSZ];
+    uint64_t total = 0;
+    unsigned n = 0;
+    readlock(self);
+    lockdb(self);
+    for (unsigned i = 0; i < LOOKUPSAMPLES && self->rowUsed; ++i)
+    {
+	uint64_t tstart = Stats_now();
+	slotkey(skey, prng_below((uint64_t)self->rowUsed));
+	DBT id = { skey, SLOTKEYSZ };
+	DBT val = { 0 };
+	if (self->db->get(self->db, &id, &val, 0) != 0) continue;
+	char keybuf[KEYBUFSZ];
+	char *key = val.size < KEYBUFSZ ? keybuf : scratch_alloc(val.size + 1);
+	memcpy(key, val.data, val.size);
+	id.data = key;
+	id.size = val.size;
+	if (self->db->get(self->db, &id, &val, 0) == 0)
+	{
+	    total += Stats_now() - tstart;
+	    ++n;
+	}
+	freekey(key, keybuf);
+    }
+    pthread_mutex_unlock(&self->dblock);
+    pthread_rwlock_unlock(&self->lock);
+    return n ? (double)total / n / 1e3 : 0;
+}
+
+static long long filesize(DB *db)
+{
+    struct stat st;
+    return fstat(db->fd(db), &st) < 0 ? -1 : (long long)st.st_size;
+}
+
+/* Rebuilds the database into a fresh file the same way a backup is
+ * taken and swaps it in with the write lock held. Pages left empty by
+ * deleted rows aren't copied, so the new btree is densely packed. */
+int InfoDb_compact(InfoDb *self)
+{
+    if (self->shards)
+    {
+	int rc = 0;
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    if (InfoDb_compact(self->shards[i]) < 0) rc = -1;
+	}
+	return rc;
+    }
+    uint64_t tstart = Stats_now();
+    char *tmpname = suffixname(self->filename, ".compact");
+    readlock(self);
+    long long sizeBefore = filesize(self->db);
+    pthread_rwlock_unlock(&self->lock);
+    double lookupBefore = lookuptime(self);
+
+    int rc = -1;
+    DB *copy = 0;
+    DB *old = 0;
+    if (attachcopy(self, tmpname, &copy) < 0)
+    {
+	free(tmpname);
+	return -1;
+    }
+    if (!copy) goto done;
+
+    size_t records;
+    int failed = copyrecords(self, copy, &records) < 0;
+    writelock(self);
+    if (detachcopy(self) < 0) failed = 1;
+    if (failed)
+    {
+	IBLog_fmt(L_ERROR, "error copying database to `%s'", tmpname);
+    }
+    else if (copy->sync(copy, 0) < 0)
+    {
+	IBLog_fmt(L_ERROR, "error syncing database copy `%s'", tmpname);
+    }
+    /* closing the old database must not write anything after the swap */
+    else if (self->db->sync(self->db, 0) < 0)
+    {
+	IBLog_msg(L_ERROR, "cannot sync database before compaction");
+    }
+    else if (Store_rename(copy, tmpname, self->filename) < 0)
+    {
+	IBLog_fmt(L_ERROR, "cannot rename database copy to `%s'",
+		self->filename);
+    }
+    else
+    {
+	/* the copy already holds all logged changes */
+	old = self->db;
+	self->db = copy;
+	copy = 0;
+	pthread_mutex_lock(&self->syncLock);
+	self->pending = 0;
+	pthread_mutex_unlock(&self->syncLock);
+	if (walclear(self) < 0)
+	{
+	    IBLog_msg(L_WARNING, "cannot clear write-ahead log");
+	}
+	rc = 0;
+    }
+    long long sizeAfter = filesize(self->db);
+    pthread_rwlock_unlock(&self->lock);
+
+    if (rc == 0)
+    {
+	double lookupAfter = lookuptime(self);
+	IBLog_fmt(L_INFO, "database compacted to %zu records in %.2fs: "
+		"%lld -> %lld bytes, random lookups %.1f -> %.1f µs",
+		records, (double)(Stats_now() - tstart) / 1e9,
+		sizeBefore, sizeAfter, lookupBefore, lookupAfter);
+    }
+
+done:
+    if (old) old->close(old);
+    if (copy) copy->close(copy);
+    if (rc < 0) unlink(tmpname);
+    free(tmpname);
+    return rc;
+}
+
+static void *backupthread(void *arg)
+{
+    InfoDb *self = arg;
+    if (self->backupFile) InfoDb_backup(self, self->backupFile);
+    else InfoDb_compact(self);
+    pthread_mutex_lock(&self->syncLock);
+    self->backupDone = 1;
+    pthread_mutex_unlock(&self->syncLock);
+    return 0;
+}
+
+/* runs a backup to filename, or a compaction if filename is 0 */
+static int startjob(InfoDb *self, const char *filename)
+{
+    int rc = -1;
+    if (self->shards)
+    {
+	rc = 0;
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    char *name = filename ? shardname(filename, i) : 0;
+	    if (startjob(self->shards[i], name) < 0) rc = -1;
+	    free(name);
+	}
+	return rc;
+    }
+    pthread_mutex_lock(&self->syncLock);
+    if (self->backupThreadRunning)
+    {
+	if (!self->backupDone) goto done;
+	pthread_join(self->backupThread, 0);
+	self->backupThreadRunning = 0;
+    }
+    free(self->backupFile);
+    self->backupFile = filename ? IB_copystr(filename) : 0;
+    self->backupDone = 0;
+    if (pthread_create(&self->backupThread, 0, backupthread, self) != 0)
+    {
+	IBLog_msg(L_ERROR, "cannot start database maintenance thread");
+	goto done;
+    }
+    self->backupThreadRunning = 1;
+    rc = 0;
+done:
+    pthread_mutex_unlock(&self->syncLock);
+    return rc;
+}
+
+int InfoDb_startBackup(InfoDb *self, const char *filename)
+{
+    return startjob(self, filename);
+}
+
+int InfoDb_startCompact(InfoDb *self)
+{
+    return startjob(self, 0);
+}
+
+InfoDbRow *InfoDb_getRandom(InfoDb *self)
+{
+    InfoDbRowView *view = self->shards
+	? shardedrandom(self, 0, 0) : randomview(self, 0, 0);
+    InfoDbRow *row = view ? view_row(view) : 0;
+    InfoDbRowView_destroy(view);
+    return row;
+}
+
+InfoDbRowView *InfoDb_viewRandom(InfoDb *self)
+{
+    if (self->shards) return shardedrandom(self, 0, 0);
+    return randomview(self, 0, 0);
+}
+
+InfoDbRowView *InfoDb_viewRandomRange(InfoDb *self, const char *from,
+	const char *to)
+{
+    if (self->shards) return shardedrandom(self, from, to);
+    char frombuf[KEYBUFSZ];
+    char tobuf[KEYBUFSZ];
+    char *lowerfrom = from ? tolowerkey(from, frombuf) : 0;
+    char *lowerto = to ? tolowerkey(to, tobuf) : 0;
+    InfoDbRowView *view = randomview(self, lowerfrom, lowerto);
+    if (lowerto) freekey(lowerto, tobuf);
+    if (lowerfrom) freekey(lowerfrom, frombuf);
+    return view;
+}
+
+void InfoDb_destroy(InfoDb *self)
+{
+    if (!self) return;
+    if (self->shards)
+    {
+	for (unsigned i = 0; i < self->nshards; ++i)
+	{
+	    InfoDb_destroy(self->shards[i]);
+	}
+	free(self->shards);
+	free(self);
+	return;
+    }
+    /* the writer thread finishes all queued changes before it exits */
+    pthread_mutex_lock(&self->writeLock);
+    self->writerStopping = 1;
+    pthread_cond_signal(&self->writeCond);
+    pthread_mutex_unlock(&self->writeLock);
+    if (self->writerRunning) pthread_join(self->writerThread, 0);
+    if (self->backupThreadRunning) pthread_join(self->backupThread, 0);
+    free(self->backupFile);
+    if (self->syncThreadRunning)
+    {
+	pthread_mutex_lock(&self->syncLock);
+	self->stopping = 1;
+	pthread_cond_signal(&self->syncCond);
+	pthread_mutex_unlock(&self->syncLock);
+	pthread_join(self->syncThread, 0);
+    }
+    if (self->factsThreadRunning)
+    {
+	pthread_mutex_lock(&self->factsLock);
+	self->factsStopping = 1;
+	pthread_cond_signal(&self->factsCond);
+	pthread_mutex_unlock(&self->factsLock);
+	pthread_join(self->factsThread, 0);
+	/* leave a current index for the next start */
+	if (atomic_load(&self->factsCurrent) < 0) buildfacts(self);
+    }
+    if (checkpoint(self) < 0)
+    {
+	IBLog_msg(L_ERROR, "final database checkpoint failed");
+    }
+    RowCache_destroy(self->cache);
+    KeyFilter_destroy(self->filter);
+    KeyIndex_destroy(self->keys);
+    self->db->close(self->db);
+    close(self->walfd);
+    free(self->walbuf);
+    free(self->txlog);
+    free(self->filename);
+    DbImage_destroy(self->facts[0]);
+    DbImage_destroy(self->facts[1]);
+    free(self->factsFile);
+    pthread_cond_destroy(&self->factsCond);
+    pthread_mutex_destroy(&self->factsLock);
+    pthread_cond_destroy(&self->writeSpace);
+    pthread_cond_destroy(&self->writeCond);
+    pthread_mutex_destroy(&self->writeLock);
+    pthread_cond_destroy(&self->syncCond);
+    pthread_mutex_destroy(&self->walSyncLock);
+    pthread_mutex_destroy(&self->syncLock);
+    pthread_mutex_destroy(&self->dblock);
+    pthread_rwlock_destroy(&self->lock);
+    free(self);
+}
+
+const char *InfoDbRow_key(const InfoDbRow *self)
+{
+    return self->key;
+}
+
+IBList *InfoDbRow_entries(InfoDbRow *self)
+{
+    return self->entries;
+}
+
+InfoDbRow *InfoDbRow_create(const char *key)
+{
+    return row_create(key, strlen(key));
+}
+
+void InfoDbRow_destroy(InfoDbRow *self)
+{
+    if (!self) return;
+    if (atomic_fetch_sub_explicit(&self->refcnt, 1,
+		memory_order_acq_rel) > 1) return;
+    IBList_destroy(self->entries);
+    free(self->key);
+    free(self);
+}
+
+const char *InfoDbRowView_key(const InfoDbRowView *self)
+{
+    return self->key;
+}
+
+int InfoDbRowView_first(const InfoDbRowView *self, InfoDbEntryView *entry)
+{
+    entry->time = 0;
+    entry->next = self->first;
+    return InfoDbRowView_next(self, entry);
+}
+
+int InfoDbRowView_next(const InfoDbRowView *self, InfoDbEntryView *entry)
+{
+    RowEntry e = { .time = entry->time };
+    if (row_entry(self->data, self->size, &entry->next, &e) <= 0) return 0;
+    entry->description = e.description;
+    entry->author = e.author;
+    entry->time = (time_t)e.time;
+    return 1;
+}
+
+void InfoDbRowView_destroy(InfoDbRowView *self)
+{
+    if (!self) return;
+    if (atomic_fetch_sub_explicit(&self->refcnt, 1,
+		memory_order_acq_rel) > 1) return;
+    InfoDbRow_destroy(atomic_load_explicit(&self->row, memory_order_acquire));
+    free(self);
+}
+
+InfoDbEntry *InfoDbEntry_create(const char *description, const char *author)
+{
+    return entry_create(author, strlen(author),
+	    description, strlen(description), time(0));
+}
+
+InfoDbEntry *InfoDbEntry_createAt(const char *description, const char *author,
+	time_t time)
+{
+    return entry_create(author, strlen(author),
+	    description, strlen(description), time);
 }
 
 time_t InfoDbEntry_time(const InfoDbEntry *self)
@@ -1,29 +1,111 @@
 #ifndef WUMSBOT_INFODB_H
 #define WUMSBOT_INFODB_H
 
+#include "store.h"
+
 #include <ircbot/decl.h>
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 C_CLASS_DECL(InfoDb);
 C_CLASS_DECL(InfoDbRow);
+C_CLASS_DECL(InfoDbRowView);
 C_CLASS_DECL(InfoDbEntry);
 C_CLASS_DECL(IBList);
 
+typedef struct InfoDbEntryView
+{
+    const char *description;
+    const char *author;
+    time_t time;
+    size_t next;
+} InfoDbEntryView;
+
+typedef struct InfoDbFilterStats
+{
+    size_t keys;
+    size_t memory;		/* bytes */
+    double fpRate;		/* expected for the current load */
+    size_t rejected;		/* lookups answered by the filter */
+    size_t falsePositives;	/* lookups passing it for missing keys */
+} InfoDbFilterStats;
+
+typedef int (*InfoDbVisitor)(void *ctx, const InfoDbRowView *row);
+typedef void (*InfoDbDone)(void *ctx, int rc);
+
 InfoDb *InfoDb_create(const char *filename) ATTR_NONNULL((1));
+InfoDb *InfoDb_createStore(const char *filename, StoreType store)
+    ATTR_NONNULL((1));
+InfoDb *InfoDb_createSharded(const char *filename, StoreType store,
+	unsigned shards) ATTR_NONNULL((1));
+int InfoDb_rename(const char *from, const char *to, unsigned shards)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+int InfoDb_unlink(const char *filename, unsigned shards) ATTR_NONNULL((1));
+void InfoDb_seedRandom(uint64_t seed);
+void InfoDb_setSyncPolicy(InfoDb *self, unsigned maxPending, unsigned maxDelay)
+    CMETHOD;
+int InfoDb_sync(InfoDb *self) CMETHOD;
+void InfoDb_setCacheSize(InfoDb *self, size_t rows) CMETHOD;
+void InfoDb_cacheStats(InfoDb *self, size_t *hits, size_t *misses) CMETHOD;
+void InfoDb_filterStats(InfoDb *self, InfoDbFilterStats *stats)
+    CMETHOD ATTR_NONNULL((2));
 InfoDbRow *InfoDb_get(InfoDb *self, const char *key) CMETHOD ATTR_NONNULL((2));
 int InfoDb_put(InfoDb *self, const InfoDbRow *row) CMETHOD ATTR_NONNULL((2));
+int InfoDb_putAll(InfoDb *self, const InfoDbRow *const *rows, size_t n)
+    CMETHOD;
 int InfoDb_add(InfoDb *self, const char *key, const InfoDbEntry *entry)
     CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+int InfoDb_remove(InfoDb *self, const char *key, const char *description)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+void InfoDb_addAsync(InfoDb *self, const char *key, const InfoDbEntry *entry,
+	InfoDbDone done, void *ctx) CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+void InfoDb_removeAsync(InfoDb *self, const char *key,
+	const char *description, InfoDbDone done, void *ctx)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
 InfoDbRow *InfoDb_getRandom(InfoDb *self) CMETHOD;
+InfoDbRowView *InfoDb_view(InfoDb *self, const char *key)
+    CMETHOD ATTR_NONNULL((2));
+InfoDbRowView *InfoDb_viewRandom(InfoDb *self) CMETHOD;
+InfoDbRowView *InfoDb_viewRandomRange(InfoDb *self, const char *from,
+	const char *to) CMETHOD;
+IBList *InfoDb_search(InfoDb *self, const char *query, const char *from,
+	const char *to, size_t max)
+    CMETHOD ATTR_NONNULL((2)) ATTR_RETNONNULL;
+IBList *InfoDb_find(InfoDb *self, const char *text, const char *from,
+	const char *to, size_t max)
+    CMETHOD ATTR_NONNULL((2)) ATTR_RETNONNULL;
+IBList *InfoDb_byAuthor(InfoDb *self, const char *author, const char *from,
+	const char *to, size_t max)
+    CMETHOD ATTR_NONNULL((2)) ATTR_RETNONNULL;
+int InfoDb_foreach(InfoDb *self, InfoDbVisitor visitor, void *ctx)
+    CMETHOD ATTR_NONNULL((2));
+int InfoDb_backup(InfoDb *self, const char *filename)
+    CMETHOD ATTR_NONNULL((2));
+int InfoDb_startBackup(InfoDb *self, const char *filename)
+    CMETHOD ATTR_NONNULL((2));
+int InfoDb_compact(InfoDb *self) CMETHOD;
+int InfoDb_startCompact(InfoDb *self) CMETHOD;
 void InfoDb_destroy(InfoDb *self);
 
+InfoDbRow *InfoDbRow_create(const char *key) ATTR_RETNONNULL ATTR_NONNULL((1));
 const char *InfoDbRow_key(const InfoDbRow *self) CMETHOD ATTR_RETNONNULL;
 IBList *InfoDbRow_entries(InfoDbRow *self) CMETHOD ATTR_RETNONNULL;
 void InfoDbRow_destroy(InfoDbRow *self);
 
+const char *InfoDbRowView_key(const InfoDbRowView *self)
+    CMETHOD ATTR_RETNONNULL;
+int InfoDbRowView_first(const InfoDbRowView *self, InfoDbEntryView *entry)
+    CMETHOD ATTR_NONNULL((2));
+int InfoDbRowView_next(const InfoDbRowView *self, InfoDbEntryView *entry)
+    CMETHOD ATTR_NONNULL((2));
+void InfoDbRowView_destroy(InfoDbRowView *self);
+
 InfoDbEntry *InfoDbEntry_create(const char *description, const char *author)
     ATTR_RETNONNULL ATTR_NONNULL((1)) ATTR_NONNULL((2));
+InfoDbEntry *InfoDbEntry_createAt(const char *description, const char *author,
+	time_t time) ATTR_RETNONNULL ATTR_NONNULL((1)) ATTR_NONNULL((2));
 time_t InfoDbEntry_time(const InfoDbEntry *self) CMETHOD;
 const char *InfoDbEntry_description(const InfoDbEntry *self)
     CMETHOD ATTR_RETNONNULL;
@@ -0,0 +1,184 @@
+#include "keyfilter.h"
+
+#include <ircbot/util.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Cuckoo filter over lowercase keys. Every key leaves a 16 bit fingerprint
+ * in one of two buckets, the second bucket is derived from the first one
+ * and the fingerprint, so fingerprints can be moved between their buckets
+ * without knowing the key, and removed again. Keys that were added always
+ * match, others with a probability of about 8 * load / 65536. */
+
+#define BUCKETSLOTS 4
+#define MINBUCKETS 256
+#define MAXKICKS 500
+
+struct KeyFilter
+{
+    uint16_t *slots;
+    size_t mask;
+    size_t count;
+    uint32_t kick;
+};
+
+static uint64_t hashkey(const char *key, size_t keylen)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < keylen; ++i)
+    {
+	h ^= (unsigned char)key[i];
+	h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void locate(const KeyFilter *self, const char *key, size_t keylen,
+	size_t *bucket, uint16_t *fp)
+{
+    uint64_t h = hashkey(key, keylen);
+    *fp = (uint16_t)(h >> 48);
+    if (!*fp) *fp = 1;
+    *bucket = (size_t)h & self->mask;
+}
+
+static size_t altbucket(const KeyFilter *self, size_t bucket, uint16_t fp)
+{
+    return (bucket ^ ((size_t)fp * 0x5bd1e995U)) & self->mask;
+}
+
+static int insert(uint16_t *bucket, uint16_t fp)
+{
+    for (int i = 0; i < BUCKETSLOTS; ++i)
+    {
+	if (!bucket[i])
+	{
+	    bucket[i] = fp;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static int find(const uint16_t *bucket, uint16_t fp)
+{
+    for (int i = 0; i < BUCKETSLOTS; ++i) if (bucket[i] == fp) return i;
+    return -1;
+}
+
+KeyFilter *KeyFilter_create(size_t capacity)
+{
+    KeyFilter *self = IB_xmalloc(sizeof *self);
+    size_t nbuckets = MINBUCKETS;
+    while (nbuckets * BUCKETSLOTS < 2 * capacity) nbuckets <<= 1;
+    self->slots = IB_xmalloc(nbuckets * BUCKETSLOTS * sizeof *self->slots);
+    memset(self->slots, 0, nbuckets * BUCKETSLOTS * sizeof *self->slots);
+    self->mask = nbuckets - 1;
+    self->count = 0;
+    self->kick = 1;
+    return self;
+}
+
+/* With both buckets full, fingerprints are kicked out to their other
+ * bucket. If that doesn't end in a free slot, the kicks are undone, so a
+ * failed insertion leaves the filter unchanged. */
+int KeyFilter_add(KeyFilter *self, const char *key, size_t keylen)
+{
+    size_t bucket;
+    uint16_t fp;
+    locate(self, key, keylen, &bucket, &fp);
+    size_t alt = altbucket(self, bucket, fp);
+    if (insert(self->slots + bucket * BUCKETSLOTS, fp)
+	    || insert(self->slots + alt * BUCKETSLOTS, fp))
+    {
+	++self->count;
+	return 0;
+    }
+    size_t path[MAXKICKS];
+    int n;
+    self->kick = self->kick * 1103515245U + 12345U;
+    if (self->kick & 0x10000) bucket = alt;
+    for (n = 0; n < MAXKICKS; ++n)
+    {
+	self->kick = self->kick * 1103515245U + 12345U;
+	size_t pos = bucket * BUCKETSLOTS + (self->kick >> 20) % BUCKETSLOTS;
+	uint16_t victim = self->slots[pos];
+	self->slots[pos] = fp;
+	path[n] = pos;
+	fp = victim;
+	bucket = altbucket(self, bucket, fp);
+	if (insert(self->slots + bucket * BUCKETSLOTS, fp))
+	{
+	    ++self->count;
+	    return 0;
+	}
+    }
+    while (n--)
+    {
+	uint16_t placed = self->slots[path[n]];
+	self->slots[path[n]] = fp;
+	fp = placed;
+    }
+    return -1;
+}
+
+void KeyFilter_remove(KeyFilter *self, const char *key, size_t keylen)
+{
+    size_t bucket;
+    uint16_t fp;
+    locate(self, key, keylen, &bucket, &fp);
+    for (int tries = 0; tries < 2; ++tries)
+    {
+	uint16_t *slots = self->slots + bucket * BUCKETSLOTS;
+	int i = find(slots, fp);
+	if (i >= 0)
+	{
+	    slots[i] = 0;
+	    --self->count;
+	    return;
+	}
+	bucket = altbucket(self, bucket, fp);
+    }
+}
+
+int KeyFilter_contains(const KeyFilter *self, const char *key, size_t keylen)
+{
+    size_t bucket;
+    uint16_t fp;
+    locate(self, key, keylen, &bucket, &fp);
+    if (find(self->slots + bucket * BUCKETSLOTS, fp) >= 0) return 1;
+    bucket = altbucket(self, bucket, fp);
+    return find(self->slots + bucket * BUCKETSLOTS, fp) >= 0;
+}
+
+size_t KeyFilter_count(const KeyFilter *self)
+{
+    return self->count;
+}
+
+size_t KeyFilter_memory(const KeyFilter *self)
+{
+    return sizeof *self
+	+ (self->mask + 1) * BUCKETSLOTS * sizeof *self->slots;
+}
+
+/* expected rate for the current load, a lookup compares the fingerprint
+ * to all slots of two buckets */
+double KeyFilter_fpRate(const KeyFilter *self)
+{
+    double load = (double)self->count
+	/ (double)((self->mask + 1) * BUCKETSLOTS);
+    return 2.0 * BUCKETSLOTS * load / 65535.0;
+}
+
+void KeyFilter_destroy(KeyFilter *self)
+{
+    if (!self) return;
+    free(self->slots);
+    free(self);
+}
@@ -0,0 +1,22 @@
+#ifndef WUMSBOT_KEYFILTER_H
+#define WUMSBOT_KEYFILTER_H
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+
+C_CLASS_DECL(KeyFilter);
+
+KeyFilter *KeyFilter_create(size_t capacity) ATTR_RETNONNULL;
+int KeyFilter_add(KeyFilter *self, const char *key, size_t keylen)
+    CMETHOD ATTR_NONNULL((2));
+void KeyFilter_remove(KeyFilter *self, const char *key, size_t keylen)
+    CMETHOD ATTR_NONNULL((2));
+int KeyFilter_contains(const KeyFilter *self, const char *key, size_t keylen)
+    CMETHOD ATTR_NONNULL((2));
+size_t KeyFilter_count(const KeyFilter *self) CMETHOD;
+size_t KeyFilter_memory(const KeyFilter *self) CMETHOD;
+double KeyFilter_fpRate(const KeyFilter *self) CMETHOD;
+void KeyFilter_destroy(KeyFilter *self);
+
+#endif
@@ -0,0 +1,363 @@
+#include "keyindex.h"
+
+#include <ircbot/util.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+/* Trigram index over lowercase keys. Keys are padded like "  key " so
+ * every key has at least one trigram and matches at the start of a key
+ * score higher. Each trigram maps to an unordered posting list of key ids.
+ */
+
+#define MINSCORE 0.3
+
+typedef struct Posting
+{
+    uint32_t trigram;
+    uint32_t n;
+    uint32_t capa;
+    uint32_t *ids;
+} Posting;
+
+struct KeyIndex
+{
+    char **keys;
+    uint32_t *ntrigrams;
+    uint32_t nkeys;
+    uint32_t keyscapa;
+    uint32_t *freeIds;
+    uint32_t nfree;
+    uint32_t freecapa;
+    Posting *postings;
+    uint32_t mask;
+    uint32_t npostings;
+    size_t count;
+};
+
+/* per-thread search state, searches run concurrently under a read lock */
+static thread_local uint16_t *hits;
+static thread_local uint32_t hitsSize;
+static thread_local uint32_t *candidates;
+static thread_local uint32_t candidatesCapa;
+
+static uint32_t hashtrigram(uint32_t trigram)
+{
+    trigram *= 0x9e3779b1U;
+    return trigram ^ (trigram >> 15);
+}
+
+static int cmptrigram(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* fills tri (room for keylen + 1 values) with the distinct trigrams of the
+ * padded key, returns their number */
+static uint32_t trigrams(const char *key, size_t keylen, uint32_t *tri)
+{
+    uint32_t n = 0;
+    uint32_t window = ((uint32_t)' ' << 8) | ' ';
+    for (size_t i = 0; i <= keylen; ++i)
+    {
+	unsigned char c = i < keylen ? (unsigned char)key[i] : ' ';
+	window = ((window << 8) | c) & 0xffffffU;
+	tri[n++] = window;
+    }
+    qsort(tri, n, sizeof *tri, cmptrigram);
+    uint32_t u = 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+	if (!u || tri[u-1] != tri[i]) tri[u++] = tri[i];
+    }
+    return u;
+}
+
+static Posting *findposting(const KeyIndex *self, uint32_t trigram)
+{
+    if (!self->postings) return 0;
+    uint32_t pos = hashtrigram(trigram) & self->mask;
+    while (self->postings[pos].trigram)
+    {
+	if (self->postings[pos].trigram == trigram) return self->postings + pos;
+	pos = (pos + 1) & self->mask;
+    }
+    return 0;
+}
+
+static void growpostings(KeyIndex *self)
+{
+    uint32_t oldsize = self->postings ? self->mask + 1 : 0;
+    uint32_t size = oldsize ? 2 * oldsize : 1024;
+    Posting *old = self->postings;
+    self->postings = IB_xmalloc(size * sizeof *self->postings);
+    memset(self->postings, 0, size * sizeof *self->postings);
+    self->mask = size - 1;
+    for (uint32_t i = 0; i < oldsize; ++i)
+    {
+	if (!old[i].trigram) continue;
+	uint32_t pos = hashtrigram(old[i].trigram) & self->mask;
+	while (self->postings[pos].trigram) pos = (pos + 1) & self->mask;
+	self->postings[pos] = old[i];
+    }
+    free(old);
+}
+
+static Posting *getposting(KeyIndex *self, uint32_t trigram)
+{
+    Posting *posting = findposting(self, trigram);
+    if (posting) return posting;
+    if (!self->postings || 4 * (self->npostings + 1) > 3 * (self->mask + 1))
+    {
+	growpostings(self);
+    }
+    uint32_t pos = hashtrigram(trigram) & self->mask;
+    while (self->postings[pos].trigram) pos = (pos + 1) & self->mask;
+    posting = self->postings + pos;
+    posting->trigram = trigram;
+    ++self->npostings;
+    return posting;
+}
+
+KeyIndex *KeyIndex_create(void)
+{
+    KeyIndex *self = IB_xmalloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    return self;
+}
+
+void KeyIndex_add(KeyIndex *self, const char *key, size_t keylen)
+{
+    uint32_t id;
+    if (self->nfree) id = self->freeIds[--self->nfree];
+    else
+    {
+	if (self->nkeys == self->keyscapa)
+	{
+	    self->keyscapa = self->keyscapa ? 2 * self->keyscapa : 1024;
+	    self->keys = IB_xrealloc(self->keys,
+		    self->keyscapa * sizeof *self->keys);
+	    self->ntrigrams = IB_xrealloc(self->ntrigrams,
+		    self->keyscapa * sizeof *self->ntrigrams);
+	}
+	id = self->nkeys++;
+    }
+    self->keys[id] = IB_xmalloc(keylen + 1);
+    memcpy(self->keys[id], key, keylen);
+    self->keys[id][keylen] = 0;
+
+    uint32_t *tri = IB_xmalloc((keylen + 1) * sizeof *tri);
+    uint32_t n = trigrams(key, keylen, tri);
+    self->ntrigrams[id] = n;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+	Posting *posting = getposting(self, tri[i]);
+	if (posting->n == posting->capa)
+	{
+	    posting->capa = posting->capa ? 2 * posting->capa : 4;
+	    posting->ids = IB_xrealloc(posting->ids,
+		    posting->capa * sizeof *posting->ids);
+	}
+	posting->ids[posting->n++] = id;
+    }
+    free(tri);
+    ++self->count;
+}
+
+void KeyIndex_remove(KeyIndex *self, const char *key, size_t keylen)
+{
+    uint32_t *tri = IB_xmalloc((keylen + 1) * sizeof *tri);
+    uint32_t n = trigrams(key, keylen, tri);
+
+    /* find the id through the shortest posting list */
+    Posting *shortest = 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+	Posting *posting = findposting(self, tri[i]);
+	if (!posting) goto done;
+	if (!shortest || posting->n < shortest->n) shortest = posting;
+    }
+    uint32_t id = UINT32_MAX;
+    for (uint32_t i = 0; i < shortest->n; ++i)
+    {
+	const char *k = self->keys[shortest->ids[i]];
+	if (!strncmp(k, key, keylen) && !k[keylen])
+	{
+	    id = shortest->ids[i];
+	    break;
+	}
+    }
+    if (id == UINT32_MAX) goto done;
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+	Posting *posting = findposting(self, tri[i]);
+	for (uint32_t j = 0; j < posting->n; ++j)
+	{
+	    if (posting->ids[j] == id)
+	    {
+		posting->ids[j] = posting->ids[--posting->n];
+		break;
+	    }
+	}
+    }
+    free(self->keys[id]);
+    self->keys[id] = 0;
+    if (self->nfree == self->freecapa)
+    {
+	self->freecapa = self->freecapa ? 2 * self->freecapa : 256;
+	self->freeIds = IB_xrealloc(self->freeIds,
+		self->freecapa * sizeof *self->freeIds);
+    }
+    self->freeIds[self->nfree++] = id;
+    --self->count;
+done:
+    free(tri);
+}
+
+size_t KeyIndex_size(const KeyIndex *self)
+{
+    return self->count;
+}
+
+/* from and to limit the keys to [from, to), 0 means unbounded */
+static int inrange(const char *key, const char *from, const char *to)
+{
+    return (!from || strcmp(key, from) >= 0) && (!to || strcmp(key, to) < 0);
+}
+
+static void insertmatch(KeyIndexMatch *matches, size_t *n, size_t max,
+	const char *key, double score)
+{
+    size_t pos = *n;
+    while (pos && (matches[pos-1].score < score
+		|| (matches[pos-1].score == score
+		    && strcmp(matches[pos-1].key, key) > 0))) --pos;
+    if (pos >= max) return;
+    size_t last = *n < max ? *n : max - 1;
+    memmove(matches + pos + 1, matches + pos,
+	    (last - pos) * sizeof *matches);
+    matches[pos].key = key;
+    matches[pos].score = score;
+    if (*n < max) ++*n;
+}
+
+static void addcandidates(const Posting *posting, uint32_t *ncandidates)
+{
+    for (uint32_t i = 0; i < posting->n; ++i)
+    {
+	uint32_t id = posting->ids[i];
+	if (hits[id]++) continue;
+	if (*ncandidates == candidatesCapa)
+	{
+	    candidatesCapa = candidatesCapa ? 2 * candidatesCapa : 1024;
+	    candidates = IB_xrealloc(candidates,
+		    candidatesCapa * sizeof *candidates);
+	}
+	candidates[(*ncandidates)++] = id;
+    }
+}
+
+/* Substring matches score above 1, closer in length to the query is
+ * better. Every substring match contains the trigrams inside the query,
+ * so candidates come from the shortest posting list of one of these.
+ *
+ * If that doesn't give enough results, keys similar to the query are
+ * added, scoring their trigram similarity. Posting lists hold distinct
+ * trigrams, so counting hits over the query's lists gives the number of
+ * shared trigrams. */
+size_t KeyIndex_search(const KeyIndex *self, const char *query,
+	const char *from, const char *to, KeyIndexMatch *matches, size_t max)
+{
+    size_t querylen = strlen(query);
+    if (!max || !querylen || !self->count) return 0;
+    if (hitsSize < self->nkeys)
+    {
+	free(hits);
+	hitsSize = self->nkeys;
+	hits = IB_xmalloc(hitsSize * sizeof *hits);
+	memset(hits, 0, hitsSize * sizeof *hits);
+    }
+
+    uint32_t *tri = IB_xmalloc((querylen + 1) * sizeof *tri);
+    const Posting **lists = IB_xmalloc((querylen + 1) * sizeof *lists);
+    uint32_t n = trigrams(query, querylen, tri);
+    uint32_t nlists = 0;
+    const Posting *inner = 0;
+    int missing = 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+	const Posting *posting = findposting(self, tri[i]);
+	int isinner = (tri[i] >> 16) != ' ' && (tri[i] & 0xffU) != ' ';
+	if (!posting || !posting->n)
+	{
+	    if (isinner) missing = 1;
+	    continue;
+	}
+	lists[nlists++] = posting;
+	if (isinner && (!inner || posting->n < inner->n)) inner = posting;
+    }
+    free(tri);
+
+    uint32_t ncandidates = 0;
+    size_t nmatches = 0;
+    if (inner && !missing)
+    {
+	addcandidates(inner, &ncandidates);
+	for (uint32_t i = 0; i < ncandidates; ++i)
+	{
+	    uint32_t id = candidates[i];
+	    const char *key = self->keys[id];
+	    hits[id] = 0;
+	    if (inrange(key, from, to) && strstr(key, query))
+	    {
+		insertmatch(matches, &nmatches, max, key,
+			1.0 + (double)querylen / (double)strlen(key));
+	    }
+	}
+	ncandidates = 0;
+    }
+
+    if (nmatches < max)
+    {
+	for (uint32_t i = 0; i < nlists; ++i)
+	{
+	    addcandidates(lists[i], &ncandidates);
+	}
+	for (uint32_t i = 0; i < ncandidates; ++i)
+	{
+	    uint32_t id = candidates[i];
+	    uint32_t shared = hits[id];
+	    hits[id] = 0;
+	    double score = (double)shared
+		/ (double)(n + self->ntrigrams[id] - shared);
+	    if (score >= MINSCORE && inrange(self->keys[id], from, to)
+		    && !strstr(self->keys[id], query))
+	    {
+		insertmatch(matches, &nmatches, max, self->keys[id], score);
+	    }
+	}
+    }
+
+    free(lists);
+    return nmatches;
+}
+
+void KeyIndex_destroy(KeyIndex *self)
+{
+    if (!self) return;
+    for (uint32_t i = 0; i < self->nkeys; ++i) free(self->keys[i]);
+    if (self->postings)
+    {
+	for (uint32_t i = 0; i <= self->mask; ++i) free(self->postings[i].ids);
+    }
+    free(self->postings);
+    free(self->freeIds);
+    free(self->ntrigrams);
+    free(self->keys);
+    free(self);
+}
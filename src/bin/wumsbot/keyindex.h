@@ -0,0 +1,27 @@
+#ifndef WUMSBOT_KEYINDEX_H
+#define WUMSBOT_KEYINDEX_H
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+
+C_CLASS_DECL(KeyIndex);
+
+typedef struct KeyIndexMatch
+{
+    const char *key;
+    double score;
+} KeyIndexMatch;
+
+KeyIndex *KeyIndex_create(void) ATTR_RETNONNULL;
+void KeyIndex_add(KeyIndex *self, const char *key, size_t keylen)
+    CMETHOD ATTR_NONNULL((2));
+void KeyIndex_remove(KeyIndex *self, const char *key, size_t keylen)
+    CMETHOD ATTR_NONNULL((2));
+size_t KeyIndex_size(const KeyIndex *self) CMETHOD;
+size_t KeyIndex_search(const KeyIndex *self, const char *query,
+	const char *from, const char *to, KeyIndexMatch *matches, size_t max)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((5));
+void KeyIndex_destroy(KeyIndex *self);
+
+#endif
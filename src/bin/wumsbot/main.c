@@ -1,303 +1,223 @@
+#include <ircbot/event.h>
 #include <ircbot/hashtable.h>
 #include <ircbot/ircbot.h>
 #include <ircbot/ircchannel.h>
 #include <ircbot/ircserver.h>
-#include <ircbot/list.h>
 #include <ircbot/log.h>
-#include <ircbot/stringbuilder.h>
+#include <ircbot/service.h>
 #include <ircbot/util.h>
 
-#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "commands.h"
+#include "config.h"
 #include "infodb.h"
+#include "stats.h"
 
-#define IRCNET "libera"
-#define SERVER "irc.libera.chat"
-#define PORT 6697
-#define NICK "wumsbot"
-#define CHANNEL "#bsd-de"
-#define UID 999
-#define PIDFILE "/var/run/wumsbot/wumsbot.pid"
-#define DBFILE "/var/db/wumsbot/wumsbot.db"
-#define CERTFILE "/var/db/wumsbot/wumsbot.crt"
-#define KEYFILE "/var/db/wumsbot/wumsbot.key"
+#define CONFIGFILE "/usr/local/etc/wumsbot.conf"
 #define LOGIDENT "wumsbot"
 
-static const char *beer[] = {
-    "Prost!",
-    "Feierabend?",
-    "Beer is the answer, but I can't remember the question ...",
-    "gmBh heißt, geh mal Bier holen!",
-    "Bierpreisbremse jetzt!",
-    "Mit des Bieres Hochgenuss, wächst des Bauches Radius.",
-    "Bier kalt stellen ist auch irgendwie kochen.",
-    "Wer das Bier nicht ehrt, ist des Deliriums nicht wert!",
-    "The mouth of a perfectly happy man is filled with beer.",
-    "Beer ...a high and mighty liquor.",
-    "Es gibt keine hässlichen Frauen. Es gibt nur zu wenig Bier.",
-    "Im Himmel gibts kein Bier. Drum trinken wir es hier.",
-    "Nur Wasser trinkt der Vierbeiner. Der Mensch, der findet Bier feiner.",
-    "Beer is proof that God loves us and wants us to be happy.",
-    "Beauty is in the eye of the beer holder",
-    "Am Morgen ein Bier und der Tag gehört dir.",
-    "Bier trinken ist besser als Quark reden!",
-    "Durst wird durch Bier erst schön!",
-    "Ein Bier das nicht getrunken wird, hat seinen Beruf verfehlt.",
-    "Zwischen Leber und Milz passt noch immer ein Pils.",
-    "Bier am Morgen vertreibt Kummer und Sorgen!",
-    "Jeder sollte an etwas glauben. Ich glaube ich trinke noch ein Bier.",
-    "Endlich wieder nüchtern. Das muss ich feiern.",
-    "Alkohol löst keine Probleme, aber das tut Milch ja auch nicht.",
-    "Meine mentale Verfassung ist besäufniserregend.",
-    "Wer Asbach trinkt, sieht uralt aus.",
-    "Alcohol, the cause and solution to all of lifes problems."
-};
-
+static Config *config;
 static InfoDb *infoDb;
+static IrcServer **servers;
 
-static void bier(IrcBotEvent *event)
+static int hasNick(void *ctx, const char *nick)
 {
-    const IrcChannel *channel = IrcBotEvent_channel(event);
-    if (!channel) return;
+    const IrcChannel *channel = IrcBotEvent_channel(ctx);
+    return !!IBHashTable_get(IrcChannel_nicks(channel), nick);
+}
 
-    const char *arg = IrcBotEvent_arg(event);
-    IBList *beerfor;
-    IrcBotResponse *response = IrcBotEvent_response(event);
-    if (arg && (beerfor = IBList_fromString(arg, " \t")))
-    {
-	char buf[256];
-	IBListIterator *i = IBList_iterator(beerfor);
-	while (IBListIterator_moveNext(i))
-	{
-	    const char *nick = IBListIterator_current(i);
-	    if (IBHashTable_get(IrcChannel_nicks(channel), nick))
-	    {
-		snprintf(buf, 256, "wird %s mit Bier abfüllen!", nick);
-		IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-			buf, 1);
-	    }
-	}
-	IBListIterator_destroy(i);
-	IBList_destroy(beerfor);
-    }
-    else
-    {
-	IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-		beer[rand() % (sizeof beer / sizeof *beer)], 0);
-    }
+static void respond(void *ctx, const char *msg, int action)
+{
+    IrcBotEvent *event = ctx;
+    IrcBotResponse_addMsg(IrcBotEvent_response(event),
+	    IrcBotEvent_origin(event), msg, action);
 }
 
-static void kaffee(IrcBotEvent *event)
+/* Replies to changes are sent by the InfoDb writer thread, but IRC
+ * servers may only be used from the event thread. The replies are queued
+ * and the event thread is woken through a pipe to send them. */
+typedef struct ReplyTarget
 {
-    const IrcChannel *channel = IrcBotEvent_channel(event);
-    if (!channel) return;
-
-    const char *arg = IrcBotEvent_arg(event);
-    const char *from = IrcBotEvent_from(event);
-    IBList *coffeefor;
-    IrcBotResponse *response = IrcBotEvent_response(event);
-    if ((arg && (coffeefor = IBList_fromString(arg, " \t")))
-	    || (from && (coffeefor = IBList_fromString(from, " \t"))))
-    {
-	char buf[256];
-	IBListIterator *i = IBList_iterator(coffeefor);
-	while (IBListIterator_moveNext(i))
-	{
-	    const char *nick = IBListIterator_current(i);
-	    if (IBHashTable_get(IrcChannel_nicks(channel), nick))
-	    {
-		snprintf(buf, 256, "reicht %s eine Tasse Kaffee...", nick);
-		IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-			buf, 1);
-	    }
-	}
-	IBListIterator_destroy(i);
-	IBList_destroy(coffeefor);
-    }
+    const char *to;
+    char server[];
+} ReplyTarget;
+
+typedef struct Reply
+{
+    struct Reply *next;
+    ReplyTarget *target;
+    int action;
+    char msg[];
+} Reply;
+
+static int replyPipe[2] = { -1, -1 };
+static Reply *replyHead;
+static Reply *replyTail;
+static pthread_mutex_t replyLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *replyTarget(void *ctx)
+{
+    IrcBotEvent *event = ctx;
+    const char *server = IrcServer_id(IrcBotEvent_server(event));
+    const char *to = IrcBotEvent_origin(event);
+    size_t serverlen = strlen(server);
+    size_t tolen = strlen(to);
+    ReplyTarget *target = IB_xmalloc(sizeof *target + serverlen + tolen + 2);
+    memcpy(target->server, server, serverlen + 1);
+    memcpy(target->server + serverlen + 1, to, tolen + 1);
+    target->to = target->server + serverlen + 1;
+    return target;
 }
 
-static char *normalizeWs(const char *input, size_t len)
+/* called by the writer thread */
+static void sendReply(void *target, const char *msg, int action)
 {
-    if (!len) len = strlen(input);
-    char *output = IB_xmalloc(len+1);
-    const char *r = input;
-    char *w = output;
-    while (isspace(*r)) { ++r; --len; }
-    while (len)
+    size_t msglen = strlen(msg);
+    Reply *reply = IB_xmalloc(sizeof *reply + msglen + 1);
+    reply->next = 0;
+    reply->target = target;
+    reply->action = action;
+    memcpy(reply->msg, msg, msglen + 1);
+    pthread_mutex_lock(&replyLock);
+    if (replyPipe[1] < 0)
     {
-	if (isspace(*r))
-	{
-	    *w++ = ' ';
-	    while (isspace(*r)) { ++r; --len; }
-	}
-	else
-	{
-	    *w++ = *r++;
-	    --len;
-	}
+	pthread_mutex_unlock(&replyLock);
+	free(target);
+	free(reply);
+	return;
     }
-    if (w != output && w[-1] == ' ') --w;
-    *w = 0;
-    if (w == output)
+    /* one byte wakes the event thread for all replies queued until it
+     * takes the queue */
+    if (!replyHead && write(replyPipe[1], "", 1) < 0)
     {
-	free(output);
-	output = 0;
+	IBLog_msg(L_ERROR, "cannot queue a reply");
     }
-    return output;
+    if (replyTail) replyTail->next = reply;
+    else replyHead = reply;
+    replyTail = reply;
+    pthread_mutex_unlock(&replyLock);
 }
 
-static void info(IrcBotEvent *event)
+static IrcServer *findServer(const char *id)
 {
-    const char *arg = IrcBotEvent_arg(event);
-    IrcBotResponse *response = IrcBotEvent_response(event);
-    char *key = 0;
-    InfoDbRow *row = 0;
-    if (arg && (key = normalizeWs(arg, 0)))
+    for (size_t i = 0; i < config->nservers; ++i)
     {
-	row = InfoDb_get(infoDb, key);
-	free(key);
+	if (!strcmp(IrcServer_id(servers[i]), id)) return servers[i];
     }
-    else
+    return 0;
+}
+
+static void sendReplies(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+    (void)sender;
+    (void)args;
+
+    char buf[16];
+    if (read(replyPipe[0], buf, sizeof buf) < 0)
     {
-	row = InfoDb_getRandom(infoDb);
+	IBLog_msg(L_WARNING, "cannot read reply notification");
     }
-    if (row)
+    pthread_mutex_lock(&replyLock);
+    Reply *reply = replyHead;
+    replyHead = 0;
+    replyTail = 0;
+    pthread_mutex_unlock(&replyLock);
+    while (reply)
     {
-	char date[11];
-	struct tm tm;
-	IBStringBuilder *sb = IBStringBuilder_create();
-	IBStringBuilder_append(sb, InfoDbRow_key(row));
-	IBStringBuilder_append(sb, " = ");
-	IBListIterator *i = IBList_iterator(InfoDbRow_entries(row));
-	int first = 1;
-	while (IBListIterator_moveNext(i))
+	Reply *next = reply->next;
+	IrcServer *server = findServer(reply->target->server);
+	if (server)
 	{
-	    const InfoDbEntry *entry = IBListIterator_current(i);
-	    if (!first) IBStringBuilder_append(sb, " | ");
-	    else first = 0;
-	    IBStringBuilder_append(sb, InfoDbEntry_description(entry));
-	    IBStringBuilder_append(sb, " [");
-	    IBStringBuilder_append(sb, InfoDbEntry_author(entry));
-	    IBStringBuilder_append(sb, ", ");
-	    time_t time = InfoDbEntry_time(entry);
-	    gmtime_r(&time, &tm);
-	    strftime(date, 11, "%d.%m.%Y", &tm);
-	    IBStringBuilder_append(sb, date);
-	    IBStringBuilder_append(sb, "]");
+	    IrcServer_sendMsg(server, reply->target->to, reply->msg,
+		    reply->action);
 	}
-	IBListIterator_destroy(i);
-	InfoDbRow_destroy(row);
-	IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-		IBStringBuilder_str(sb), 0);
-	IBStringBuilder_destroy(sb);
-    }
-    else
-    {
-	IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-		"hat keine Ahnung...", 1);
+	free(reply->target);
+	free(reply);
+	reply = next;
     }
 }
 
+/* all channels share one InfoDb, namespaced channels see only their
+ * own facts */
+static void dispatch(IrcBotEvent *event, CommandHandler handler)
+{
+    const IrcChannel *channel = IrcBotEvent_channel(event);
+    CommandEvent cmd = {
+	.arg = IrcBotEvent_arg(event),
+	.from = IrcBotEvent_from(event),
+	.hasNick = channel ? hasNick : 0,
+	.ns = channel ? Config_namespace(config,
+		IrcServer_id(IrcBotEvent_server(event)),
+		IrcChannel_name(channel)) : 0,
+	.respond = respond,
+	.replyTarget = replyTarget,
+	.sendReply = sendReply,
+	.ctx = event
+    };
+    handler(&cmd);
+}
+
+static void bier(IrcBotEvent *event)
+{
+    dispatch(event, Command_bier);
+}
+
+static void kaffee(IrcBotEvent *event)
+{
+    dispatch(event, Command_kaffee);
+}
+
+static void info(IrcBotEvent *event)
+{
+    dispatch(event, Command_info);
+}
+
 static void lerne(IrcBotEvent *event)
 {
-    const char *arg = IrcBotEvent_arg(event);
-    size_t eqpos;
-    IrcBotResponse *response = IrcBotEvent_response(event);
-    if (!arg || !arg[(eqpos = strcspn(arg, "="))]) goto invalid;
-    char *key = normalizeWs(arg, eqpos);
-    char *val = normalizeWs(arg+eqpos+1, 0);
-    if (!key || !val)
-    {
-	free(val);
-	free(key);
-	goto invalid;
-    }
-    const char *author = IrcBotEvent_from(event);
-    if (!author) author = "<anonymous>";
-    InfoDbEntry *entry = InfoDbEntry_create(val, author);
-    if (InfoDb_add(infoDb, key, entry) < 0)
-    {
-	IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-		"hat ein Datenbankproblem :o", 1);
-    }
-    else
-    {
-	IBStringBuilder *sb = IBStringBuilder_create();
-	IBStringBuilder_append(sb, "Ok, ");
-	IBStringBuilder_append(sb, key);
-	IBStringBuilder_append(sb, " = ");
-	IBStringBuilder_append(sb, val);
-	IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-		IBStringBuilder_str(sb), 0);
-	IBStringBuilder_destroy(sb);
-    }
-    InfoDbEntry_destroy(entry);
-    free(val);
-    free(key);
-    return;
-
-invalid:
-    IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-	    "hat nicht verstanden (?)", 1);
+    dispatch(event, Command_lerne);
 }
 
 static void vergiss(IrcBotEvent *event)
 {
-    const char *arg = IrcBotEvent_arg(event);
-    size_t eqpos;
-    IrcBotResponse *response = IrcBotEvent_response(event);
-    if (!arg || !arg[(eqpos = strcspn(arg, "="))]) goto invalid;
-    char *key = normalizeWs(arg, eqpos);
-    char *val = normalizeWs(arg+eqpos+1, 0);
-    if (!key || !val)
-    {
-	free(val);
-	free(key);
-	goto invalid;
-    }
-    InfoDbRow *row = InfoDb_get(infoDb, key);
-    if (!row) goto unknown;
-    IBListIterator *i = IBList_iterator(InfoDbRow_entries(row));
-    while (IBListIterator_moveNext(i))
-    {
-	InfoDbEntry *entry = IBListIterator_current(i);
-	if (!strcmp(val, InfoDbEntry_description(entry)))
-	{
-	    IBList_remove(InfoDbRow_entries(row), entry);
-	    InfoDbEntry_destroy(entry);
-	    if (InfoDb_put(infoDb, row) < 0)
-	    {
-		IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-			"hat ein Datenbankproblem :o", 1);
-	    }
-	    else
-	    {
-		IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-			"Ok, vergessen!", 0);
-	    }
-	    IBListIterator_destroy(i);
-	    InfoDbRow_destroy(row);
-	    free(val);
-	    free(key);
-	    return;
-	}
-    }
-    IBListIterator_destroy(i);
-unknown:
-    InfoDbRow_destroy(row);
-    free(val);
-    free(key);
-    IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-	    "wusste davon nichts...", 1);
-    return;
-
-invalid:
-    IrcBotResponse_addMsg(response, IrcBotEvent_origin(event),
-	    "hat nicht verstanden (?)", 1);
+    dispatch(event, Command_vergiss);
+}
+
+static void suche(IrcBotEvent *event)
+{
+    dispatch(event, Command_suche);
+}
+
+static void finde(IrcBotEvent *event)
+{
+    dispatch(event, Command_finde);
+}
+
+static void gelehrt(IrcBotEvent *event)
+{
+    dispatch(event, Command_gelehrt);
+}
+
+static void stats(IrcBotEvent *event)
+{
+    dispatch(event, Command_stats);
+}
+
+static void backup(IrcBotEvent *event)
+{
+    dispatch(event, Command_backup);
+}
+
+static void compact(IrcBotEvent *event)
+{
+    dispatch(event, Command_compact);
 }
 
 static void started(void)
@@ -307,35 +227,112 @@ static void started(void)
 
 static int startup(void)
 {
-    infoDb = InfoDb_create(DBFILE);
+    if (pipe(replyPipe) < 0)
+    {
+	IBLog_msg(L_ERROR, "cannot create reply pipe");
+	return EXIT_FAILURE;
+    }
+    IBEvent_register(IBService_readyRead(), 0, sendReplies, replyPipe[0]);
+    IBService_registerRead(replyPipe[0]);
+    infoDb = InfoDb_createSharded(config->dbfile, config->store,
+	    config->shards);
+    if (infoDb)
+    {
+	InfoDb_setCacheSize(infoDb, config->cachesize);
+	InfoDb_setSyncPolicy(infoDb, config->syncafter, config->syncdelay);
+	Commands_init(infoDb);
+	Commands_setAdmins(config->admins, config->adminpass);
+	Commands_setBackupFile(config->backupfile);
+	if (config->statsinterval && Stats_startLogger(config->statsinterval,
+		    Commands_logStats) < 0)
+	{
+	    IBLog_msg(L_WARNING, "cannot start statistics logger");
+	}
+    }
     return infoDb ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static void shutdown(void)
 {
+    Stats_stopLogger();
+    Commands_setAdmins(0, 0);
+    Commands_setBackupFile(0);
+    /* changes still queued are applied, but not answered any more */
     InfoDb_destroy(infoDb);
+    IBService_unregisterRead(replyPipe[0]);
+    IBEvent_unregister(IBService_readyRead(), 0, sendReplies, replyPipe[0]);
+    pthread_mutex_lock(&replyLock);
+    close(replyPipe[0]);
+    close(replyPipe[1]);
+    replyPipe[0] = -1;
+    replyPipe[1] = -1;
+    Reply *reply = replyHead;
+    replyHead = 0;
+    replyTail = 0;
+    pthread_mutex_unlock(&replyLock);
+    while (reply)
+    {
+	Reply *next = reply->next;
+	free(reply->target);
+	free(reply);
+	reply = next;
+    }
+}
+
+static IrcServer *addServer(const ConfigServer *cs)
+{
+    IrcServer *server = IrcServer_create(cs->id, cs->host, cs->port,
+	    cs->nick, 0, 0);
+    if (cs->ipv6) IrcServer_useIpv6(server);
+    if (cs->cert) IrcServer_enableTls(server, cs->cert, cs->key);
+    for (size_t i = 0; i < cs->nchannels; ++i)
+    {
+	IrcServer_join(server, cs->channels[i].name);
+    }
+    IrcBot_addServer(server);
+    return server;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc == 2 && !strcmp(argv[1], "-f"))
+    const char *configfile = 0;
+    int foreground = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:f")) != -1)
     {
-	IBLog_setFileLogger(stderr);
+	switch (opt)
+	{
+	    case 'c':
+		configfile = optarg;
+		break;
+	    case 'f':
+		foreground = 1;
+		break;
+	    default:
+		fprintf(stderr, "usage: %s [-f] [-c configfile]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
     }
-    else
+
+    if (foreground) IBLog_setFileLogger(stderr);
+    else IBLog_setSyslogLogger(LOGIDENT, LOG_DAEMON, 1);
+    /* a missing default config file means the built-in settings */
+    config = configfile ? Config_load(configfile, 0)
+	: Config_load(CONFIGFILE, 1);
+    if (!config) return EXIT_FAILURE;
+    if (!foreground)
     {
-	IBLog_setSyslogLogger(LOGIDENT, LOG_DAEMON, 1);
-	IrcBot_daemonize(UID, -1, PIDFILE, started);
+	IrcBot_daemonize(config->uid, -1, config->pidfile, started);
     }
 
     IrcBot_startup(startup);
     IrcBot_shutdown(shutdown);
 
-    IrcServer *server = IrcServer_create(IRCNET, SERVER, PORT, NICK, 0, 0);
-    IrcServer_useIpv6(server);
-    IrcServer_enableTls(server, CERTFILE, KEYFILE);
-    IrcServer_join(server, CHANNEL);
-    IrcBot_addServer(server);
+    servers = IB_xmalloc(config->nservers * sizeof *servers);
+    for (size_t i = 0; i < config->nservers; ++i)
+    {
+	servers[i] = addServer(config->servers + i);
+    }
 
     IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "bier", bier);
     IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "kaffee", kaffee);
@@ -345,9 +342,21 @@ int main(int argc, char **argv)
     IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "learn", lerne);
     IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "vergiss", vergiss);
     IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "forget", vergiss);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "suche", suche);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "search", suche);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "finde", finde);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "find", finde);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "gelehrt", gelehrt);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_CHANNEL, "taught", gelehrt);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_PRIVATE, "stats", stats);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_PRIVATE, "backup", backup);
+    IrcBot_addHandler(IBET_BOTCOMMAND, 0, ORIGIN_PRIVATE, "compact", compact);
 
     srand(time(0));
 
-    return IrcBot_run();
+    int rc = IrcBot_run();
+    free(servers);
+    Config_destroy(config);
+    return rc;
 }
 
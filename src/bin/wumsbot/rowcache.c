@@ -0,0 +1,275 @@
+#include "rowcache.h"
+
+#include <ircbot/util.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CacheNode CacheNode;
+
+struct CacheNode
+{
+    CacheNode *next;
+    CacheNode *newer;
+    CacheNode *older;
+    void *obj;
+    uint32_t hash;
+    char key[];
+};
+
+/* the cache is split into independently locked segments, so concurrent
+ * lookups of different keys don't all contend on a single mutex */
+#define NSEGMENTS 16
+
+typedef struct CacheSegment
+{
+    CacheNode **buckets;
+    CacheNode *newest;
+    CacheNode *oldest;
+    size_t capacity;
+    size_t used;
+    size_t hits;
+    size_t misses;
+    uint32_t mask;
+    pthread_mutex_t lock;
+} CacheSegment;
+
+struct RowCache
+{
+    RowCacheRetainer retainer;
+    RowCacheReleaser releaser;
+    size_t capacity;
+    CacheSegment segments[NSEGMENTS];
+};
+
+static uint32_t hashstr(const char *key)
+{
+    uint32_t h = 2166136261U;
+    while (*key)
+    {
+	h ^= (unsigned char)*key++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static CacheNode **findslot(CacheSegment *self, const char *key, uint32_t hash)
+{
+    CacheNode **slot = self->buckets + (hash & self->mask);
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key)))
+    {
+	slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void unlink_lru(CacheSegment *self, CacheNode *node)
+{
+    if (node->newer) node->newer->older = node->older;
+    else self->newest = node->older;
+    if (node->older) node->older->newer = node->newer;
+    else self->oldest = node->newer;
+}
+
+static void link_newest(CacheSegment *self, CacheNode *node)
+{
+    node->newer = 0;
+    node->older = self->newest;
+    if (self->newest) self->newest->newer = node;
+    else self->oldest = node;
+    self->newest = node;
+}
+
+static void removenode(RowCache *cache, CacheSegment *self, CacheNode **slot)
+{
+    CacheNode *node = *slot;
+    *slot = node->next;
+    unlink_lru(self, node);
+    cache->releaser(node->obj);
+    free(node);
+    --self->used;
+}
+
+static CacheSegment *segment(RowCache *self, uint32_t hash)
+{
+    return self->segments + (hash >> 28) % NSEGMENTS;
+}
+
+static void rehash(RowCache *cache, CacheSegment *self, size_t capacity)
+{
+    while (self->used > capacity)
+    {
+	CacheNode *oldest = self->oldest;
+	removenode(cache, self, findslot(self, oldest->key, oldest->hash));
+    }
+    free(self->buckets);
+    self->buckets = 0;
+    self->mask = 0;
+    self->capacity = capacity;
+    if (!capacity) return;
+    uint32_t nbuckets = 16;
+    while (nbuckets < capacity && nbuckets < (1U << 30)) nbuckets <<= 1;
+    self->buckets = IB_xmalloc(nbuckets * sizeof *self->buckets);
+    memset(self->buckets, 0, nbuckets * sizeof *self->buckets);
+    self->mask = nbuckets - 1;
+    for (CacheNode *node = self->oldest; node; node = node->newer)
+    {
+	node->next = 0;
+	*findslot(self, node->key, node->hash) = node;
+    }
+}
+
+static size_t segcapacity(size_t capacity)
+{
+    return (capacity + NSEGMENTS - 1) / NSEGMENTS;
+}
+
+RowCache *RowCache_create(size_t capacity,
+	RowCacheRetainer retainer, RowCacheReleaser releaser)
+{
+    RowCache *self = IB_xmalloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->retainer = retainer;
+    self->releaser = releaser;
+    self->capacity = capacity;
+    for (int i = 0; i < NSEGMENTS; ++i)
+    {
+	rehash(self, self->segments + i, segcapacity(capacity));
+	pthread_mutex_init(&self->segments[i].lock, 0);
+    }
+    return self;
+}
+
+void *RowCache_get(RowCache *self, const char *key)
+{
+    void *obj = 0;
+    uint32_t hash = hashstr(key);
+    CacheSegment *seg = segment(self, hash);
+    pthread_mutex_lock(&seg->lock);
+    if (seg->capacity)
+    {
+	CacheNode *node = *findslot(seg, key, hash);
+	if (node)
+	{
+	    unlink_lru(seg, node);
+	    link_newest(seg, node);
+	    obj = self->retainer(node->obj);
+	    ++seg->hits;
+	}
+	else ++seg->misses;
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return obj;
+}
+
+void RowCache_put(RowCache *self, const char *key, void *obj)
+{
+    uint32_t hash = hashstr(key);
+    CacheSegment *seg = segment(self, hash);
+    pthread_mutex_lock(&seg->lock);
+    if (!seg->capacity) goto done;
+    CacheNode **slot = findslot(seg, key, hash);
+    if (*slot)
+    {
+	self->releaser((*slot)->obj);
+	(*slot)->obj = self->retainer(obj);
+	unlink_lru(seg, *slot);
+	link_newest(seg, *slot);
+	goto done;
+    }
+    if (seg->used == seg->capacity)
+    {
+	CacheNode *oldest = seg->oldest;
+	removenode(self, seg, findslot(seg, oldest->key, oldest->hash));
+	slot = findslot(seg, key, hash);
+    }
+    size_t keysz = strlen(key) + 1;
+    CacheNode *node = IB_xmalloc(sizeof *node + keysz);
+    memcpy(node->key, key, keysz);
+    node->next = 0;
+    node->hash = hash;
+    node->obj = self->retainer(obj);
+    *slot = node;
+    link_newest(seg, node);
+    ++seg->used;
+done:
+    pthread_mutex_unlock(&seg->lock);
+}
+
+void RowCache_evict(RowCache *self, const char *key)
+{
+    uint32_t hash = hashstr(key);
+    CacheSegment *seg = segment(self, hash);
+    pthread_mutex_lock(&seg->lock);
+    if (seg->capacity)
+    {
+	CacheNode **slot = findslot(seg, key, hash);
+	if (*slot) removenode(self, seg, slot);
+    }
+    pthread_mutex_unlock(&seg->lock);
+}
+
+void RowCache_clear(RowCache *self)
+{
+    for (int i = 0; i < NSEGMENTS; ++i)
+    {
+	CacheSegment *seg = self->segments + i;
+	pthread_mutex_lock(&seg->lock);
+	while (seg->oldest)
+	{
+	    CacheNode *oldest = seg->oldest;
+	    removenode(self, seg, findslot(seg, oldest->key, oldest->hash));
+	}
+	pthread_mutex_unlock(&seg->lock);
+    }
+}
+
+void RowCache_setCapacity(RowCache *self, size_t capacity)
+{
+    for (int i = 0; i < NSEGMENTS; ++i)
+    {
+	CacheSegment *seg = self->segments + i;
+	pthread_mutex_lock(&seg->lock);
+	if (segcapacity(capacity) != seg->capacity)
+	{
+	    rehash(self, seg, segcapacity(capacity));
+	}
+	pthread_mutex_unlock(&seg->lock);
+    }
+    self->capacity = capacity;
+}
+
+size_t RowCache_capacity(const RowCache *self)
+{
+    return self->capacity;
+}
+
+void RowCache_stats(RowCache *self, size_t *hits, size_t *misses)
+{
+    size_t h = 0;
+    size_t m = 0;
+    for (int i = 0; i < NSEGMENTS; ++i)
+    {
+	CacheSegment *seg = self->segments + i;
+	pthread_mutex_lock(&seg->lock);
+	h += seg->hits;
+	m += seg->misses;
+	pthread_mutex_unlock(&seg->lock);
+    }
+    if (hits) *hits = h;
+    if (misses) *misses = m;
+}
+
+void RowCache_destroy(RowCache *self)
+{
+    if (!self) return;
+    RowCache_clear(self);
+    for (int i = 0; i < NSEGMENTS; ++i)
+    {
+	pthread_mutex_destroy(&self->segments[i].lock);
+	free(self->segments[i].buckets);
+    }
+    free(self);
+}
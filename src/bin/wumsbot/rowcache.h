@@ -0,0 +1,26 @@
+#ifndef WUMSBOT_ROWCACHE_H
+#define WUMSBOT_ROWCACHE_H
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+
+C_CLASS_DECL(RowCache);
+
+typedef void *(*RowCacheRetainer)(void *obj);
+typedef void (*RowCacheReleaser)(void *obj);
+
+RowCache *RowCache_create(size_t capacity,
+	RowCacheRetainer retainer, RowCacheReleaser releaser)
+    ATTR_RETNONNULL ATTR_NONNULL((2)) ATTR_NONNULL((3));
+void *RowCache_get(RowCache *self, const char *key) CMETHOD ATTR_NONNULL((2));
+void RowCache_put(RowCache *self, const char *key, void *obj)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+void RowCache_evict(RowCache *self, const char *key) CMETHOD ATTR_NONNULL((2));
+void RowCache_clear(RowCache *self) CMETHOD;
+void RowCache_setCapacity(RowCache *self, size_t capacity) CMETHOD;
+size_t RowCache_capacity(const RowCache *self) CMETHOD;
+void RowCache_stats(RowCache *self, size_t *hits, size_t *misses) CMETHOD;
+void RowCache_destroy(RowCache *self);
+
+#endif
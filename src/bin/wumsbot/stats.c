@@ -0,0 +1,155 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* power of two buckets in microseconds, the last one is open ended */
+#define NBUCKETS 24
+
+typedef struct Histogram
+{
+    atomic_ullong count;
+    atomic_ullong total;
+    atomic_ullong max;
+    atomic_ullong buckets[NBUCKETS];
+} Histogram;
+
+static const char *names[] = {
+    "bier", "kaffee", "info", "lerne", "vergiss", "suche", "finde",
+    "gelehrt", "stats", "backup", "compact",
+    "get", "random", "put", "add", "remove", "search", "find", "author",
+    "sync", "checkpoint",
+    "read", "write", "db"
+};
+
+static Histogram histograms[ST_COUNT];
+
+static pthread_t loggerThread;
+static pthread_mutex_t loggerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loggerCond = PTHREAD_COND_INITIALIZER;
+static StatsLogger loggerFunc;
+static unsigned loggerInterval;
+static int loggerRunning;
+static int loggerStopping;
+
+uint64_t Stats_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+void Stats_add(StatsTimer timer, uint64_t ns)
+{
+    Histogram *h = histograms + timer;
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us && bucket < NBUCKETS - 1; us >>= 1)
+    {
+	++bucket;
+    }
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(h->buckets + bucket, 1, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&h->max,
+	    memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max,
+		ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+void Stats_record(StatsTimer timer, uint64_t start)
+{
+    Stats_add(timer, Stats_now() - start);
+}
+
+const char *Stats_name(StatsTimer timer)
+{
+    return names[timer];
+}
+
+/* percentiles are reported as the upper bound of their bucket */
+static double percentile(const unsigned long long *buckets,
+	unsigned long long count, unsigned pct)
+{
+    unsigned long long rank = (count * pct + 99) / 100;
+    unsigned long long seen = 0;
+    for (int i = 0; i < NBUCKETS; ++i)
+    {
+	seen += buckets[i];
+	if (seen >= rank) return (double)(1UL << i);
+    }
+    return (double)(1UL << (NBUCKETS - 1));
+}
+
+void Stats_summary(StatsTimer timer, StatsSummary *summary)
+{
+    Histogram *h = histograms + timer;
+    unsigned long long buckets[NBUCKETS];
+    unsigned long long count = 0;
+    for (int i = 0; i < NBUCKETS; ++i)
+    {
+	buckets[i] = atomic_load_explicit(h->buckets + i,
+		memory_order_relaxed);
+	count += buckets[i];
+    }
+    summary->count = count;
+    summary->mean = count ? (double)atomic_load_explicit(&h->total,
+	    memory_order_relaxed) / (double)count / 1e3 : 0;
+    summary->p50 = count ? percentile(buckets, count, 50) : 0;
+    summary->p99 = count ? percentile(buckets, count, 99) : 0;
+    summary->max = (double)atomic_load_explicit(&h->max,
+	    memory_order_relaxed) / 1e3;
+    if (summary->p50 > summary->max) summary->p50 = summary->max;
+    if (summary->p99 > summary->max) summary->p99 = summary->max;
+}
+
+static void *loggerthread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&loggerLock);
+    struct timespec due;
+    clock_gettime(CLOCK_REALTIME, &due);
+    while (!loggerStopping)
+    {
+	due.tv_sec += loggerInterval;
+	while (!loggerStopping && pthread_cond_timedwait(&loggerCond,
+		    &loggerLock, &due) == 0);
+	if (loggerStopping) break;
+	pthread_mutex_unlock(&loggerLock);
+	loggerFunc();
+	pthread_mutex_lock(&loggerLock);
+    }
+    pthread_mutex_unlock(&loggerLock);
+    return 0;
+}
+
+int Stats_startLogger(unsigned interval, StatsLogger logger)
+{
+    int rc = -1;
+    pthread_mutex_lock(&loggerLock);
+    if (loggerRunning || !interval) goto done;
+    loggerFunc = logger;
+    loggerInterval = interval;
+    loggerStopping = 0;
+    if (pthread_create(&loggerThread, 0, loggerthread, 0) != 0) goto done;
+    loggerRunning = 1;
+    rc = 0;
+done:
+    pthread_mutex_unlock(&loggerLock);
+    return rc;
+}
+
+void Stats_stopLogger(void)
+{
+    pthread_mutex_lock(&loggerLock);
+    if (!loggerRunning)
+    {
+	pthread_mutex_unlock(&loggerLock);
+	return;
+    }
+    loggerStopping = 1;
+    pthread_cond_signal(&loggerCond);
+    pthread_mutex_unlock(&loggerLock);
+    pthread_join(loggerThread, 0);
+    loggerRunning = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef WUMSBOT_STATS_H
+#define WUMSBOT_STATS_H
+
+#include <ircbot/decl.h>
+
+#include <stdint.h>
+
+typedef enum StatsTimer
+{
+    ST_BIER,
+    ST_KAFFEE,
+    ST_INFO,
+    ST_LERNE,
+    ST_VERGISS,
+    ST_SUCHE,
+    ST_FINDE,
+    ST_GELEHRT,
+    ST_STATS,
+    ST_BACKUP,
+    ST_COMPACT,
+    ST_DBGET,
+    ST_DBRANDOM,
+    ST_DBPUT,
+    ST_DBADD,
+    ST_DBREMOVE,
+    ST_DBSEARCH,
+    ST_DBFIND,
+    ST_DBAUTHOR,
+    ST_DBSYNC,
+    ST_DBCHECKPOINT,
+    ST_READLOCK,
+    ST_WRITELOCK,
+    ST_DBLOCK,
+    ST_COUNT
+} StatsTimer;
+
+typedef struct StatsSummary
+{
+    uint64_t count;
+    double mean;	/* all times in microseconds */
+    double p50;
+    double p99;
+    double max;
+} StatsSummary;
+
+typedef void (*StatsLogger)(void);
+
+uint64_t Stats_now(void);
+void Stats_add(StatsTimer timer, uint64_t ns);
+void Stats_record(StatsTimer timer, uint64_t start);
+const char *Stats_name(StatsTimer timer) ATTR_RETNONNULL;
+void Stats_summary(StatsTimer timer, StatsSummary *summary) ATTR_NONNULL((2));
+int Stats_startLogger(unsigned interval, StatsLogger logger) ATTR_NONNULL((2));
+void Stats_stopLogger(void);
+
+#endif
@@ -0,0 +1,419 @@
+#include "dbimage.h"
+#include "store.h"
+
+#include <ircbot/log.h>
+#include <ircbot/util.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MEMCACHESIZE (256U << 20)
+
+/* overlay values of the mmap store are tagged, so deletions of records
+ * in the image can be recorded */
+#define TOMBSTONE 0
+#define LIVE 1
+
+static const char *typeNames[] = { "btree", "mmap", "mem" };
+
+/* State of the mem and mmap stores. The mem store keeps all records in
+ * an in-memory btree and only uses the image file for loading and
+ * saving. The mmap store serves records from the mapped image, with
+ * changes since the last sync kept in an in-memory overlay. */
+typedef struct ImageStore
+{
+    DB *mem;
+    DbImage *image;
+    char *filename;
+    int fd;
+    int dirty;
+    int positioned;
+    uint8_t *cursor;
+    size_t cursorsz;
+    size_t cursorcapa;
+    uint8_t *buf;
+    size_t bufsz;
+} ImageStore;
+
+int Store_parseType(const char *name, StoreType *type)
+{
+    for (size_t i = 0; i < sizeof typeNames / sizeof *typeNames; ++i)
+    {
+	if (!strcmp(name, typeNames[i]))
+	{
+	    *type = (StoreType)i;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+const char *Store_typeName(StoreType type)
+{
+    return typeNames[type];
+}
+
+static DB *memdb(int large)
+{
+    BTREEINFO info;
+    memset(&info, 0, sizeof info);
+    if (large) info.cachesize = MEMCACHESIZE;
+    return dbopen(0, O_RDWR, 0600, DB_BTREE, &info);
+}
+
+/* (re)opens the image file, only mapping it if needed */
+static int openimage(ImageStore *self, int map)
+{
+    int fd = open(self->filename, O_RDONLY);
+    if (fd < 0) return -1;
+    DbImage *image = 0;
+    if (map && !(image = DbImage_map(fd)))
+    {
+	close(fd);
+	return -1;
+    }
+    DbImage_destroy(self->image);
+    if (self->fd >= 0) close(self->fd);
+    self->image = image;
+    self->fd = fd;
+    return 0;
+}
+
+static void setcursor(ImageStore *self, const DBT *key)
+{
+    if (key->data == self->cursor) return;
+    if (key->size > self->cursorcapa)
+    {
+	self->cursorcapa = key->size;
+	self->cursor = IB_xrealloc(self->cursor, self->cursorcapa);
+    }
+    if (key->size) memcpy(self->cursor, key->data, key->size);
+    self->cursorsz = key->size;
+}
+
+static int imgfd(const DB *db)
+{
+    const ImageStore *self = db->internal;
+    return self->fd;
+}
+
+static int imgclose(DB *db)
+{
+    ImageStore *self = db->internal;
+    int rc = db->sync(db, 0);
+    if (self->mem->close(self->mem) < 0) rc = -1;
+    DbImage_destroy(self->image);
+    if (self->fd >= 0) close(self->fd);
+    free(self->buf);
+    free(self->cursor);
+    free(self->filename);
+    free(self);
+    free(db);
+    return rc;
+}
+
+static int memget(const DB *db, const DBT *key, DBT *val, unsigned flags)
+{
+    ImageStore *self = db->internal;
+    return self->mem->get(self->mem, key, val, flags);
+}
+
+static int memput(const DB *db, DBT *key, const DBT *val, unsigned flags)
+{
+    ImageStore *self = db->internal;
+    self->dirty = 1;
+    return self->mem->put(self->mem, key, val, flags);
+}
+
+static int memdel(const DB *db, const DBT *key, unsigned flags)
+{
+    ImageStore *self = db->internal;
+    self->dirty = 1;
+    return self->mem->del(self->mem, key, flags);
+}
+
+static int memseq(const DB *db, DBT *key, DBT *val, unsigned flags)
+{
+    ImageStore *self = db->internal;
+    return self->mem->seq(self->mem, key, val, flags);
+}
+
+static int memsync(const DB *db, unsigned flags)
+{
+    (void)flags;
+    ImageStore *self = db->internal;
+    if (!self->dirty) return 0;
+    if (DbImage_save(self->filename, self->mem) < 0
+	    || openimage(self, 0) < 0) return -1;
+    self->dirty = 0;
+    return 0;
+}
+
+/* strips the tag of an overlay value, returns 1 for deleted records */
+static int untag(DBT *val)
+{
+    const uint8_t *data = val->data;
+    if (data[0] == TOMBSTONE) return 1;
+    val->data = (void *)(data + 1);
+    --val->size;
+    return 0;
+}
+
+static int overlayput(ImageStore *self, const DBT *key, const DBT *val)
+{
+    size_t size = 1 + (val ? val->size : 0);
+    if (size > self->bufsz)
+    {
+	self->bufsz = size;
+	self->buf = IB_xrealloc(self->buf, self->bufsz);
+    }
+    self->buf[0] = val ? LIVE : TOMBSTONE;
+    if (val && val->size) memcpy(self->buf + 1, val->data, val->size);
+    DBT tagged = { self->buf, size };
+    self->dirty = 1;
+    return self->mem->put(self->mem, (DBT *)key, &tagged, 0);
+}
+
+static int mapget(const DB *db, const DBT *key, DBT *val, unsigned flags)
+{
+    (void)flags;
+    ImageStore *self = db->internal;
+    int rc = self->mem->get(self->mem, key, val, 0);
+    if (rc == 0) return untag(val);
+    if (rc < 0) return -1;
+    int found;
+    size_t i = DbImage_find(self->image, key, &found);
+    if (!found) return 1;
+    DBT ikey;
+    DbImage_record(self->image, i, &ikey, val);
+    return 0;
+}
+
+static int mapput(const DB *db, DBT *key, const DBT *val, unsigned flags)
+{
+    (void)flags;
+    return overlayput(db->internal, key, val);
+}
+
+static int mapdel(const DB *db, const DBT *key, unsigned flags)
+{
+    (void)flags;
+    ImageStore *self = db->internal;
+    int found;
+    DbImage_find(self->image, key, &found);
+    if (!found)
+    {
+	int rc = self->mem->del(self->mem, key, 0);
+	if (rc == 0) self->dirty = 1;
+	return rc;
+    }
+    DBT val;
+    int rc = self->mem->get(self->mem, key, &val, 0);
+    if (rc < 0) return -1;
+    if (rc == 0 && untag(&val)) return 1;
+    return overlayput(self, key, 0);
+}
+
+/* merges the image with the overlay, overlay records take precedence */
+static int mapseq(const DB *db, DBT *key, DBT *val, unsigned flags)
+{
+    ImageStore *self = db->internal;
+    int strict = 0;
+    if (flags == R_CURSOR)
+    {
+	setcursor(self, key);
+	self->positioned = 1;
+    }
+    else if (flags == R_NEXT && self->positioned) strict = 1;
+    else if (flags == R_FIRST || flags == R_NEXT) self->positioned = 0;
+    else
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    size_t pos = 0;
+    DBT okey;
+    DBT oval;
+    int orc;
+    if (self->positioned)
+    {
+	DBT from = { self->cursor, self->cursorsz };
+	int found;
+	pos = DbImage_find(self->image, &from, &found);
+	if (found && strict) ++pos;
+	okey = from;
+	orc = self->mem->seq(self->mem, &okey, &oval, R_CURSOR);
+	if (orc == 0 && strict && !DbImage_cmp(&okey, &from))
+	{
+	    orc = self->mem->seq(self->mem, &okey, &oval, R_NEXT);
+	}
+    }
+    else orc = self->mem->seq(self->mem, &okey, &oval, R_FIRST);
+
+    size_t count = DbImage_count(self->image);
+    for (;;)
+    {
+	if (orc < 0) return -1;
+	DBT ikey;
+	DBT ival;
+	int cmp = 1;
+	if (pos < count)
+	{
+	    DbImage_record(self->image, pos, &ikey, &ival);
+	    cmp = orc ? -1 : DbImage_cmp(&ikey, &okey);
+	}
+	else if (orc) return 1;
+	if (cmp < 0)
+	{
+	    *key = ikey;
+	    *val = ival;
+	    break;
+	}
+	if (cmp == 0) ++pos;
+	if (!untag(&oval))
+	{
+	    *key = okey;
+	    *val = oval;
+	    break;
+	}
+	orc = self->mem->seq(self->mem, &okey, &oval, R_NEXT);
+    }
+    setcursor(self, key);
+    self->positioned = 1;
+    return 0;
+}
+
+/* writes a new image of all records and maps it, so the overlay can be
+ * dropped */
+static int mapsync(const DB *db, unsigned flags)
+{
+    (void)flags;
+    ImageStore *self = db->internal;
+    if (!self->dirty) return 0;
+    if (DbImage_save(self->filename, db) < 0) return -1;
+    DB *mem = memdb(0);
+    if (!mem) return -1;
+    if (openimage(self, 1) < 0)
+    {
+	mem->close(mem);
+	return -1;
+    }
+    self->mem->close(self->mem);
+    self->mem = mem;
+    self->dirty = 0;
+    return 0;
+}
+
+static DB *imgopen(const char *filename, int flags, StoreType type)
+{
+    if ((flags & O_TRUNC) || ((flags & O_CREAT)
+		&& access(filename, F_OK) < 0 && errno == ENOENT))
+    {
+	if (DbImage_save(filename, 0) < 0) return 0;
+    }
+    ImageStore *self = IB_xmalloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->fd = -1;
+    self->filename = IB_copystr(filename);
+    if (openimage(self, 1) < 0 || !(self->mem = memdb(type == STORE_MEM)))
+    {
+	goto error;
+    }
+
+    DB *db = IB_xmalloc(sizeof *db);
+    memset(db, 0, sizeof *db);
+    db->type = DB_BTREE;
+    db->internal = self;
+    db->close = imgclose;
+    db->fd = imgfd;
+    if (type == STORE_MEM)
+    {
+	size_t count = DbImage_count(self->image);
+	for (size_t i = 0; i < count; ++i)
+	{
+	    DBT key;
+	    DBT val;
+	    DbImage_record(self->image, i, &key, &val);
+	    if (self->mem->put(self->mem, &key, &val, 0) < 0)
+	    {
+		free(db);
+		goto error;
+	    }
+	}
+	DbImage_destroy(self->image);
+	self->image = 0;
+	db->get = memget;
+	db->put = memput;
+	db->del = memdel;
+	db->seq = memseq;
+	db->sync = memsync;
+    }
+    else
+    {
+	db->get = mapget;
+	db->put = mapput;
+	db->del = mapdel;
+	db->seq = mapseq;
+	db->sync = mapsync;
+    }
+    return db;
+
+error:
+    if (self->mem) self->mem->close(self->mem);
+    DbImage_destroy(self->image);
+    if (self->fd >= 0) close(self->fd);
+    free(self->filename);
+    free(self);
+    return 0;
+}
+
+/* Existing files keep their format: images are opened with the mmap
+ * store unless the mem store is requested, anything else as a btree. */
+DB *Store_open(const char *filename, int flags, int mode, StoreType *type)
+{
+    if (!(flags & O_TRUNC))
+    {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+	    StoreType found = *type;
+	    if (!DbImage_check(fd)) found = STORE_BTREE;
+	    else if (*type == STORE_BTREE) found = STORE_MMAP;
+	    if (found != *type)
+	    {
+		IBLog_fmt(L_WARNING, "`%s' is not a %s store, opening it "
+			"as %s", filename, Store_typeName(*type),
+			Store_typeName(found));
+		*type = found;
+	    }
+	}
+	if (fd >= 0) close(fd);
+    }
+    if (*type == STORE_BTREE)
+    {
+	return dbopen(filename, flags, mode, DB_BTREE, 0);
+    }
+    return imgopen(filename, flags, *type);
+}
+
+/* Renames the file of an open store. The btree store keeps writing to
+ * its descriptor, but image stores save to their file name on sync. */
+int Store_rename(DB *db, const char *from, const char *to)
+{
+    if (rename(from, to) < 0) return -1;
+    if (db->close == imgclose)
+    {
+	ImageStore *self = db->internal;
+	free(self->filename);
+	self->filename = IB_copystr(to);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef WUMSBOT_STORE_H
+#define WUMSBOT_STORE_H
+
+#include <ircbot/decl.h>
+
+#include <db.h>
+
+/* Storage backends for InfoDb. All of them are driven through the BSD db
+ * interface and keep its btree semantics: keys are ordered bytewise, data
+ * returned is valid until the next call, get and del return 1 for keys
+ * not found, and seq supports R_FIRST, R_NEXT and R_CURSOR. */
+typedef enum StoreType
+{
+    STORE_BTREE,    /* BSD db btree file */
+    STORE_MMAP,	    /* mapped sorted image, changes kept in memory until sync */
+    STORE_MEM	    /* in-memory btree, saved as an image on sync */
+} StoreType;
+
+int Store_parseType(const char *name, StoreType *type)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+const char *Store_typeName(StoreType type) ATTR_RETNONNULL;
+DB *Store_open(const char *filename, int flags, int mode, StoreType *type)
+    ATTR_NONNULL((1)) ATTR_NONNULL((4));
+int Store_rename(DB *db, const char *from, const char *to)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2)) ATTR_NONNULL((3));
+
+#endif
@@ -1,4 +1,5 @@
-wumsbot_MODULES:= main infodb
+wumsbot_MODULES:= main arena commands config dbimage infodb keyfilter \
+	keyindex rowcache stats store
 wumsbot_LDFLAGS:= -pthread
 wumsbot_PKGDEPS:= ircbot >= 1.0
 $(call binrules, wumsbot)
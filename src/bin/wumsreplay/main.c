@@ -0,0 +1,527 @@
+#include "../wumsbot/commands.h"
+#include "../wumsbot/infodb.h"
+
+#include <ircbot/log.h>
+#include <ircbot/util.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CMDPREFIX '!'
+#define NBUCKETS 24
+
+typedef struct Message
+{
+    char *from;
+    char *target;	/* 0 for membership changes */
+    char *command;
+    char *arg;
+    CommandHandler handler;
+    int part;
+} Message;
+
+typedef struct CommandStats
+{
+    const char *name;
+    uint32_t *samples;
+    size_t nsamples;
+    size_t capacity;
+    uint64_t total;
+    size_t responses;
+    size_t buckets[NBUCKETS];
+} CommandStats;
+
+typedef struct Namespace
+{
+    const char *channel;
+    const char *ns;
+} Namespace;
+
+typedef struct Replay
+{
+    const char *target;
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    size_t responses;
+    size_t pending;	/* replies still expected from the writer */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Replay;
+
+/* channel members, stored as "channel nick" in an open addressing set */
+static char **members;
+static size_t membersUsed;
+static uint32_t membersMask;
+
+static Message *messages;
+static size_t nmessages;
+static CommandStats *stats;
+static size_t nstats;
+static Namespace *namespaces;
+static size_t nnamespaces;
+static int verbose;
+
+static uint64_t nsecs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+static uint32_t hashstr(const char *key)
+{
+    uint32_t h = 2166136261U;
+    while (*key)
+    {
+	h ^= (unsigned char)*key++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static char *memberkey(char *buf, size_t bufsz,
+	const char *channel, const char *nick)
+{
+    snprintf(buf, bufsz, "%s %s", channel, nick);
+    return buf;
+}
+
+static size_t memberslot(const char *key)
+{
+    size_t pos = hashstr(key) & membersMask;
+    while (members[pos] && strcmp(members[pos], key))
+    {
+	pos = (pos + 1) & membersMask;
+    }
+    return pos;
+}
+
+static void addmember(const char *channel, const char *nick)
+{
+    char key[512];
+    memberkey(key, sizeof key, channel, nick);
+    if ((membersUsed + 1) * 2 > (size_t)membersMask + 1)
+    {
+	char **old = members;
+	size_t oldsize = (size_t)membersMask + 1;
+	membersMask = membersMask * 2 + 1;
+	members = IB_xmalloc(((size_t)membersMask + 1) * sizeof *members);
+	memset(members, 0, ((size_t)membersMask + 1) * sizeof *members);
+	for (size_t i = 0; i < oldsize; ++i)
+	{
+	    if (old[i]) members[memberslot(old[i])] = old[i];
+	}
+	free(old);
+    }
+    size_t pos = memberslot(key);
+    if (members[pos]) return;
+    members[pos] = IB_copystr(key);
+    ++membersUsed;
+}
+
+static void removemember(const char *channel, const char *nick)
+{
+    char key[512];
+    size_t pos = memberslot(memberkey(key, sizeof key, channel, nick));
+    if (!members[pos]) return;
+    free(members[pos]);
+    members[pos] = 0;
+    --membersUsed;
+
+    /* re-insert the rest of the cluster to keep probing intact */
+    for (pos = (pos + 1) & membersMask; members[pos];
+	    pos = (pos + 1) & membersMask)
+    {
+	char *moved = members[pos];
+	members[pos] = 0;
+	members[memberslot(moved)] = moved;
+    }
+}
+
+static void clearmembers(void)
+{
+    for (size_t i = 0; i <= membersMask; ++i)
+    {
+	free(members[i]);
+	members[i] = 0;
+    }
+    membersUsed = 0;
+}
+
+static int hasNick(void *ctx, const char *nick)
+{
+    Replay *replay = ctx;
+    char key[512];
+    return !!members[memberslot(memberkey(key, sizeof key,
+		    replay->target, nick))];
+}
+
+static void respond(void *ctx, const char *msg, int action)
+{
+    Replay *replay = ctx;
+    size_t len = strlen(msg);
+    if (replay->outlen + len + 4 > replay->outcap)
+    {
+	while (replay->outlen + len + 4 > replay->outcap)
+	{
+	    replay->outcap = replay->outcap ? 2 * replay->outcap : 1024;
+	}
+	replay->out = IB_xrealloc(replay->out, replay->outcap);
+    }
+    if (action) replay->out[replay->outlen++] = '*';
+    replay->out[replay->outlen++] = '>';
+    replay->out[replay->outlen++] = ' ';
+    memcpy(replay->out + replay->outlen, msg, len);
+    replay->outlen += len;
+    replay->out[replay->outlen++] = '\n';
+    ++replay->responses;
+}
+
+static void *replyTarget(void *ctx)
+{
+    Replay *replay = ctx;
+    pthread_mutex_lock(&replay->lock);
+    ++replay->pending;
+    pthread_mutex_unlock(&replay->lock);
+    return replay;
+}
+
+static void sendReply(void *target, const char *msg, int action)
+{
+    Replay *replay = target;
+    pthread_mutex_lock(&replay->lock);
+    respond(replay, msg, action);
+    --replay->pending;
+    pthread_cond_signal(&replay->cond);
+    pthread_mutex_unlock(&replay->lock);
+}
+
+static int addnamespace(char *arg)
+{
+    char *eq = strchr(arg, '=');
+    if (!eq || eq == arg || !eq[1]) return -1;
+    *eq = 0;
+    namespaces = IB_xrealloc(namespaces,
+	    (nnamespaces + 1) * sizeof *namespaces);
+    namespaces[nnamespaces].channel = arg;
+    namespaces[nnamespaces++].ns = eq + 1;
+    return 0;
+}
+
+static const char *namespacefor(const char *channel)
+{
+    for (size_t i = 0; i < nnamespaces; ++i)
+    {
+	if (!strcasecmp(namespaces[i].channel, channel))
+	{
+	    return namespaces[i].ns;
+	}
+    }
+    return 0;
+}
+
+static CommandStats *statsfor(const char *name)
+{
+    for (size_t i = 0; i < nstats; ++i)
+    {
+	if (!strcmp(stats[i].name, name)) return stats + i;
+    }
+    stats = IB_xrealloc(stats, (nstats + 1) * sizeof *stats);
+    CommandStats *s = stats + nstats++;
+    memset(s, 0, sizeof *s);
+    s->name = name;
+    return s;
+}
+
+static void record(CommandStats *s, uint64_t ns, size_t responses)
+{
+    if (ns > UINT32_MAX) ns = UINT32_MAX;
+    if (s->nsamples == s->capacity)
+    {
+	s->capacity = s->capacity ? 2 * s->capacity : 256;
+	s->samples = IB_xrealloc(s->samples, s->capacity * sizeof *s->samples);
+    }
+    s->samples[s->nsamples++] = (uint32_t)ns;
+    s->total += ns;
+    s->responses += responses;
+
+    /* power of two buckets, starting at 1us */
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us && bucket < NBUCKETS - 1; us >>= 1)
+    {
+	++bucket;
+    }
+    ++s->buckets[bucket];
+}
+
+/* splits off the next space separated word of an IRC protocol line */
+static char *nextword(char **line)
+{
+    char *word = *line;
+    while (*word == ' ') ++word;
+    if (!*word) return 0;
+    char *end = strchr(word, ' ');
+    if (end)
+    {
+	*end = 0;
+	*line = end + 1;
+    }
+    else *line = word + strlen(word);
+    return word;
+}
+
+static int parseline(char *line, Message *msg)
+{
+    memset(msg, 0, sizeof *msg);
+    if (*line++ != ':') return 0;
+    char *prefix = nextword(&line);
+    char *verb = nextword(&line);
+    if (!prefix || !verb) return 0;
+    char *bang = strchr(prefix, '!');
+    if (bang) *bang = 0;
+    msg->from = prefix;
+
+    if (!strcmp(verb, "JOIN") || !strcmp(verb, "PART"))
+    {
+	char *channel = nextword(&line);
+	if (!channel) return 0;
+	if (*channel == ':') ++channel;
+	msg->command = channel;
+	msg->part = verb[0] == 'P';
+	return 1;
+    }
+    if (strcmp(verb, "PRIVMSG")) return 0;
+
+    msg->target = nextword(&line);
+    if (!msg->target || *line++ != ':' || *line++ != CMDPREFIX) return 0;
+    msg->command = nextword(&line);
+    if (!msg->command || !(msg->handler = Commands_find(msg->command)))
+    {
+	return 0;
+    }
+    while (*line == ' ') ++line;
+    msg->arg = *line ? line : 0;
+    return 1;
+}
+
+static int readlog(const char *filename)
+{
+    FILE *log = fopen(filename, "r");
+    if (!log)
+    {
+	perror(filename);
+	return -1;
+    }
+    size_t capacity = 0;
+    size_t skipped = 0;
+    char buf[1024];
+    while (fgets(buf, sizeof buf, log))
+    {
+	buf[strcspn(buf, "\r\n")] = 0;
+	char *line = IB_copystr(buf);
+	if (nmessages == capacity)
+	{
+	    capacity = capacity ? 2 * capacity : 256;
+	    messages = IB_xrealloc(messages, capacity * sizeof *messages);
+	}
+	if (parseline(line, messages + nmessages)) ++nmessages;
+	else
+	{
+	    free(line);
+	    ++skipped;
+	}
+    }
+    fclose(log);
+    fprintf(stderr, "%zu messages read, %zu lines skipped\n",
+	    nmessages, skipped);
+    return 0;
+}
+
+static void replay(Replay *r)
+{
+    clearmembers();
+    for (size_t i = 0; i < nmessages; ++i)
+    {
+	Message *msg = messages + i;
+	if (!msg->target)
+	{
+	    if (msg->part) removemember(msg->command, msg->from);
+	    else addmember(msg->command, msg->from);
+	    continue;
+	}
+
+	int channel = *msg->target == '#' || *msg->target == '&';
+	if (channel) addmember(msg->target, msg->from);
+	r->target = channel ? msg->target : msg->from;
+	r->outlen = 0;
+	r->responses = 0;
+	CommandEvent event = {
+	    .arg = msg->arg,
+	    .from = msg->from,
+	    .hasNick = channel ? hasNick : 0,
+	    .ns = channel ? namespacefor(msg->target) : 0,
+	    .respond = respond,
+	    .replyTarget = replyTarget,
+	    .sendReply = sendReply,
+	    .ctx = r
+	};
+	uint64_t start = nsecs();
+	msg->handler(&event);
+	/* wait for replies sent later, so output and timing include them */
+	pthread_mutex_lock(&r->lock);
+	while (r->pending) pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	record(statsfor(msg->command), nsecs() - start, r->responses);
+
+	if (verbose)
+	{
+	    printf("<%s> !%s%s%s\n", msg->from, msg->command,
+		    msg->arg ? " " : "", msg->arg ? msg->arg : "");
+	    fwrite(r->out, 1, r->outlen, stdout);
+	}
+    }
+}
+
+static int cmpsample(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(double secs)
+{
+    size_t total = 0;
+    printf("%-8s %8s %10s %10s %10s %10s %10s\n", "command", "count",
+	    "mean(us)", "p50(us)", "p99(us)", "max(us)", "responses");
+    for (size_t i = 0; i < nstats; ++i)
+    {
+	CommandStats *s = stats + i;
+	qsort(s->samples, s->nsamples, sizeof *s->samples, cmpsample);
+	printf("%-8s %8zu %10.2f %10.2f %10.2f %10.2f %10zu\n", s->name,
+		s->nsamples, (double)s->total / (double)s->nsamples / 1e3,
+		s->samples[s->nsamples / 2] / 1e3,
+		s->samples[s->nsamples * 99 / 100] / 1e3,
+		s->samples[s->nsamples - 1] / 1e3, s->responses);
+	total += s->nsamples;
+    }
+    for (size_t i = 0; i < nstats; ++i)
+    {
+	CommandStats *s = stats + i;
+	printf("\n%s latency histogram:\n", s->name);
+	int last = NBUCKETS - 1;
+	while (last && !s->buckets[last]) --last;
+	for (int b = 0; b <= last; ++b)
+	{
+	    printf("  < %8luus %10zu %6.2f%%\n", 1UL << b, s->buckets[b],
+		    100.0 * (double)s->buckets[b] / (double)s->nsamples);
+	}
+    }
+    printf("\n%zu commands in %.3fs, %.0f commands/s\n", total, secs,
+	    secs > 0 ? (double)total / secs : 0);
+}
+
+static void usage(const char *prg)
+{
+    fprintf(stderr, "usage: %s [-v] [-a admins] [-P adminpass] [-r repeat] "
+	    "[-c cachesize]\n\t[-p syncafter] [-n shards] [-S btree|mmap|mem] "
+	    "[-s seed] [-N channel=namespace ...]\n\tdbfile logfile\n", prg);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    unsigned repeat = 1;
+    unsigned syncAfter = 16;
+    size_t cachesize = 1024;
+    unsigned shards = 1;
+    StoreType store = STORE_BTREE;
+    uint64_t seed = 0;
+    const char *admins = 0;
+    const char *adminPass = 0;
+    while ((opt = getopt(argc, argv, "va:P:r:c:p:n:S:s:N:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'v': verbose = 1; break;
+	    case 'a': admins = optarg; break;
+	    case 'P': adminPass = optarg; break;
+	    case 'r': repeat = (unsigned)atoi(optarg); break;
+	    case 'c': cachesize = (size_t)atol(optarg); break;
+	    case 'p': syncAfter = (unsigned)atoi(optarg); break;
+	    case 'n': shards = (unsigned)atol(optarg); break;
+	    case 's': seed = strtoull(optarg, 0, 10); break;
+	    case 'S':
+		if (Store_parseType(optarg, &store) < 0)
+		{
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    case 'N':
+		if (addnamespace(optarg) < 0)
+		{
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    default: usage(argv[0]); return EXIT_FAILURE;
+	}
+    }
+    if (optind != argc - 2 || !repeat || !shards)
+    {
+	usage(argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    IBLog_setFileLogger(stderr);
+    InfoDb *db = InfoDb_createSharded(argv[optind], store, shards);
+    if (!db) return EXIT_FAILURE;
+    InfoDb_setCacheSize(db, cachesize);
+    InfoDb_setSyncPolicy(db, syncAfter, 0);
+    Commands_init(db);
+    Commands_setAdmins(admins, adminPass);
+
+    int rc = EXIT_FAILURE;
+    Replay r = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+    };
+    if (readlog(argv[optind+1]) < 0) goto done;
+    if (!nmessages) goto done;
+
+    membersMask = 63;
+    members = IB_xmalloc(((size_t)membersMask + 1) * sizeof *members);
+    memset(members, 0, ((size_t)membersMask + 1) * sizeof *members);
+
+    /* with a fixed seed, replaying the same database answers !info with
+     * the same random facts */
+    InfoDb_seedRandom(seed);
+    uint64_t start = nsecs();
+    for (unsigned i = 0; i < repeat; ++i) replay(&r);
+    InfoDb_sync(db);
+    report((double)(nsecs() - start) / 1e9);
+    rc = EXIT_SUCCESS;
+
+    clearmembers();
+    free(members);
+    free(r.out);
+    for (size_t i = 0; i < nstats; ++i) free(stats[i].samples);
+    free(stats);
+
+done:
+    /* message fields all point into the line they were parsed from */
+    for (size_t i = 0; i < nmessages; ++i) free(messages[i].from - 1);
+    free(messages);
+    free(namespaces);
+    Commands_setAdmins(0, 0);
+    InfoDb_destroy(db);
+    return rc;
+}
@@ -0,0 +1,7 @@
+wumsreplay_MODULES:= main ../wumsbot/arena ../wumsbot/commands \
+	../wumsbot/dbimage ../wumsbot/infodb ../wumsbot/keyfilter \
+	../wumsbot/keyindex ../wumsbot/rowcache ../wumsbot/stats \
+	../wumsbot/store
+wumsreplay_LDFLAGS:= -pthread
+wumsreplay_PKGDEPS:= ircbot >= 1.0
+$(call binrules, wumsreplay)